@@ -1,2 +1,28 @@
-#define G_BEGIN_EXPENSIVE_CHECKS
+/*
+ * Copyright © 2008 Ryan Lortie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ */
+
+#ifndef _gexpensive_h_
+#define _gexpensive_h_
+
+/* checks that are too slow for fast paths.  they are skipped along
+ * with all other checks when G_DISABLE_CHECKS is defined.
+ *
+ *   G_BEGIN_EXPENSIVE_CHECKS {
+ *     ...
+ *   } G_END_EXPENSIVE_CHECKS
+ */
+#ifdef G_DISABLE_CHECKS
+# define G_BEGIN_EXPENSIVE_CHECKS       if (0)
+#else
+# define G_BEGIN_EXPENSIVE_CHECKS       if (1)
+#endif
 #define G_END_EXPENSIVE_CHECKS
+
+#endif /* _gexpensive_h_ */
@@ -32,8 +32,12 @@
 
 #include "gvariant-serialiser.h"
 #include "gvariant-private.h"
+#include "gexpensive.h"
 
 #include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <errno.h>
 #include <glib.h>
 
 /**
@@ -50,6 +54,9 @@ struct OPAQUE_TYPE__GVariant
     {
       GVariant *source;
       guint8 *data;
+
+      /* arrays only: see g_variant_get_array_length() */
+      gsize length;
     } serialised;
 
     struct
@@ -63,17 +70,41 @@ struct OPAQUE_TYPE__GVariant
       GDestroyNotify callback;
       gpointer user_data;
     } notify;
+
+    /* 'data' overlays 'serialised.data' and points at 'payload'
+     * instead of into a separate allocation.  'payload' only overlays
+     * fields that are never used for inline values ('length' is only
+     * for arrays) so it may not be placed before 'data': on 32-bit
+     * hosts that would move 'data' away from 'serialised.data'.
+     */
+    struct
+    {
+      GVariant *unused;
+      guint8 *data;
+      guint64 payload;
+    } inlined;
   } contents;
 
   gsize size;
   GVariantTypeInfo *type;
-  gboolean floating;
-  GStaticMutex lock;
   guint state;
   gint ref_count;
 };
 
-#define check g_variant_assert_invariant
+/* fails to compile (with a negative array size) if 'inlined.data' and
+ * 'serialised.data' ever stop lining up.  G_STATIC_ASSERT() would need
+ * a newer GLib than we require.
+ */
+typedef char g_variant_inlined_data_check
+  [offsetof (GVariant, contents.inlined.data) ==
+   offsetof (GVariant, contents.serialised.data) ? 1 : -1];
+
+#define check(value) \
+  G_STMT_START {                                \
+    G_BEGIN_EXPENSIVE_CHECKS {                  \
+      g_variant_assert_invariant (value);       \
+    } G_END_EXPENSIVE_CHECKS                    \
+  } G_STMT_END
 
 #define STATE_NATIVE            0x01
 #define STATE_TRUSTED           0x02
@@ -86,20 +117,97 @@ struct OPAQUE_TYPE__GVariant
 #define STATE_SOURCE_NATIVE     0x100
 #define STATE_NOTIFY            0x200
 #define STATE_ZERO              0x400
+#define STATE_FLOATING          0x800
+#define STATE_INLINE            0x1000
+#define STATE_LENGTH_KNOWN      0x2000
+#define STATE_ARENA             0x4000
+#define STATE_ARENA_DATA        0x8000
+#define STATE_OFFSET_SIZE_SHIFT 16
+#define STATE_OFFSET_SIZE_MASK  0xf0000
 #define STATE_LOCKED            0x80000000
 
 static void g_variant_fill_gvs (GVariantSerialised *, gpointer);
+static void g_variant_fill_exclusive (GVariantSerialised *, gpointer);
+static void g_variant_require_state (GVariant *, guint);
+static gpointer g_variant_alloc_data (GVariant *, gsize);
+static gpointer g_variant_magazine_alloc (gsize);
+
+/* see g_variant_get_stats() */
+static gint g_variant_stats_bytes_byteswapped;
+static gint g_variant_stats_magazine_hits;
+static gint g_variant_stats_magazine_misses;
+static gint g_variant_stats_magazine_exchanges;
+
+/* The state word holds the state bits, the floating flag and the lock
+ * bit.  State bits are only ever added while holding the lock, but are
+ * read without the lock by anyone who wants to know if a particular
+ * state has already been reached.  New state bits are therefore
+ * published atomically (and only after the contents that they describe
+ * have been fully written) so that lock-free readers never see a state
+ * bit without also seeing the data that it implies.
+ */
+static guint
+g_variant_get_state (GVariant *value)
+{
+  return g_atomic_int_get ((gint *) &value->state);
+}
 
+static void
+g_variant_set_state (GVariant *value,
+                     guint     state)
+{
+  guint old;
+
+  do
+    old = g_variant_get_state (value);
+  while (!g_atomic_int_compare_and_exchange ((gint *) &value->state,
+                                             old, old | state));
+}
+
+/* clears @state, returning %TRUE if any of those bits were set */
+static gboolean
+g_variant_clear_state (GVariant *value,
+                       guint     state)
+{
+  guint old;
+
+  do
+    old = g_variant_get_state (value);
+  while (!g_atomic_int_compare_and_exchange ((gint *) &value->state,
+                                             old, old & ~state));
+
+  return (old & state) != 0;
+}
+
+/* The lock is a single bit in the state word rather than a mutex
+ * embedded in every instance.  It is only ever held while performing a
+ * state transition or while examining the tree form of a value, and it
+ * is never taken recursively.  Where two locks are held at once the
+ * second is always on the source of the first, so there is no lock
+ * order inversion.
+ */
 static void
 g_variant_lock (GVariant *value)
 {
-  g_static_mutex_lock (&value->lock);
+  guint state;
+
+  while (TRUE)
+    {
+      state = g_variant_get_state (value);
+
+      if (~state & STATE_LOCKED &&
+          g_atomic_int_compare_and_exchange ((gint *) &value->state,
+                                             state, state | STATE_LOCKED))
+        break;
+
+      g_thread_yield ();
+    }
 }
 
 static void
 g_variant_unlock (GVariant *value)
 {
-  g_static_mutex_unlock (&value->lock);
+  g_variant_clear_state (value, STATE_LOCKED);
 }
 
 static gboolean
@@ -111,7 +219,7 @@ g_variant_transition_size_known (GVariant *value)
   children = value->contents.tree.children;
   n_children = value->contents.tree.n_children;
   value->size = g_variant_serialiser_needed_size (value->type,
-                                                  &g_variant_fill_gvs,
+                                                  &g_variant_fill_exclusive,
                                                   (gpointer *) children,
                                                   n_children);
 
@@ -124,20 +232,27 @@ g_variant_transition_serialised (GVariant *value)
   GVariantSerialised gvs;
   GVariant **children;
   gsize n_children;
+  gsize i;
 
   children = value->contents.tree.children;
   n_children = value->contents.tree.n_children;
 
   gvs.type = value->type;
   gvs.size = value->size;
-  gvs.data = g_slice_alloc (gvs.size);
+  gvs.data = g_variant_alloc_data (value, gvs.size);
 
-  g_variant_serialiser_serialise (gvs, &g_variant_fill_gvs,
+  g_variant_serialiser_serialise (gvs, &g_variant_fill_exclusive,
                                   (gpointer *) children, n_children);
 
   value->contents.serialised.source = NULL;
   value->contents.serialised.data = gvs.data;
 
+  /* the tree is no longer needed (and unref won't see it anymore) */
+  for (i = 0; i < n_children; i++)
+    g_variant_unref (children[i]);
+
+  g_free (children);
+
   return TRUE;
 }
 
@@ -151,6 +266,7 @@ g_variant_transition_native (GVariant *value)
   gvs.data = value->contents.serialised.data;
 
   g_variant_serialised_byteswap (gvs);
+  g_atomic_int_add (&g_variant_stats_bytes_byteswapped, gvs.size);
 
   return TRUE;
 }
@@ -161,7 +277,8 @@ g_variant_transition_trusted (GVariant *value)
   GVariantSerialised gvs;
 
   if ((value->state & STATE_INDEPENDENT) == 0)
-    if (value->contents.serialised.source->state & STATE_TRUSTED)
+    if (g_variant_get_state (value->contents.serialised.source) &
+        STATE_TRUSTED)
       return TRUE;
 
   gvs.type = value->type;
@@ -171,6 +288,42 @@ g_variant_transition_trusted (GVariant *value)
   return g_variant_serialised_is_normal (gvs);
 }
 
+/* a string from untrusted data might not be terminated within its
+ * bounds (or be a valid object path or signature).  in that case, use
+ * @fallback instead.  an early terminator just shortens the string.
+ */
+static const gchar *
+g_variant_deep_copy_string (GVariant    *value,
+                            const gchar *fallback)
+{
+  const gchar *string;
+  gsize size;
+
+  size = g_variant_get_size (value);
+  string = g_variant_get_data (value);
+
+  if (size == 0 || memchr (string, '\0', size) == NULL)
+    return fallback;
+
+  switch (g_variant_get_type_class (value))
+  {
+    case G_VARIANT_TYPE_CLASS_OBJECT_PATH:
+      if (!g_variant_is_object_path (string))
+        return fallback;
+      break;
+
+    case G_VARIANT_TYPE_CLASS_SIGNATURE:
+      if (!g_variant_is_signature (string))
+        return fallback;
+      break;
+
+    default:
+      break;
+  }
+
+  return string;
+}
+
 static GVariant *
 g_variant_deep_copy (GVariant *value)
 {
@@ -204,13 +357,14 @@ g_variant_deep_copy (GVariant *value)
       return g_variant_new_double (g_variant_get_double (value));
       
     case G_VARIANT_TYPE_CLASS_STRING:
-      return g_variant_new_string (g_variant_get_string (value, NULL));
+      return g_variant_new_string (g_variant_deep_copy_string (value, ""));
 
     case G_VARIANT_TYPE_CLASS_OBJECT_PATH:
-      return g_variant_new_object_path (g_variant_get_string (value, NULL));
+      return g_variant_new_object_path (g_variant_deep_copy_string (value,
+                                                                    "/"));
 
     case G_VARIANT_TYPE_CLASS_SIGNATURE:
-      return g_variant_new_signature (g_variant_get_string (value, NULL));
+      return g_variant_new_signature (g_variant_deep_copy_string (value, ""));
 
     case G_VARIANT_TYPE_CLASS_VARIANT:
       {
@@ -251,10 +405,14 @@ static gboolean
 g_variant_transition_renormalised (GVariant *value)
 {
   GVariant tmp;
+  GVariant *copy;
 
   tmp = *value;
-  g_static_mutex_init (&tmp.lock);
-  value->contents.serialised.source = g_variant_deep_copy (&tmp);
+  tmp.state &= ~STATE_LOCKED;
+  copy = g_variant_ref_sink (g_variant_deep_copy (&tmp));
+  g_variant_require_state (copy, STATE_SERIALISED);
+
+  value->contents.serialised.source = copy;
 
   return TRUE;
 }
@@ -267,11 +425,11 @@ g_variant_transition_independent (GVariant *value)
 
   source = value->contents.serialised.source;
 
-  g_assert (source->state & STATE_INDEPENDENT);
+  g_assert (g_variant_get_state (source) & STATE_INDEPENDENT);
 
-  new = g_slice_alloc (value->size);
+  new = g_variant_magazine_alloc (value->size);
 
-  if (!(source->state & STATE_NATIVE))
+  if (!(g_variant_get_state (source) & STATE_NATIVE))
     {
       memcpy (new, value->contents.serialised.data, value->size);
 
@@ -280,10 +438,10 @@ g_variant_transition_independent (GVariant *value)
       g_variant_unlock (source);
     }
 
-  if (source->state & STATE_NATIVE)
+  if (g_variant_get_state (source) & STATE_NATIVE)
     {
       memcpy (new, value->contents.serialised.data, value->size);
-      value->state |= STATE_NATIVE;
+      g_variant_set_state (value, STATE_NATIVE);
     }
 
   value->contents.serialised.data = new;
@@ -296,7 +454,8 @@ g_variant_transition_independent (GVariant *value)
 static gboolean
 g_variant_transition_source_native (GVariant *value)
 {
-  return (value->contents.serialised.source->state & STATE_NATIVE) != 0;
+  return (g_variant_get_state (value->contents.serialised.source) &
+          STATE_NATIVE) != 0;
 }
 
 struct transition
@@ -335,7 +494,7 @@ struct state state_table[] =
 
   { STATE_RENORMALISED, NULL, g_variant_transition_renormalised,
     { { STATE_SERIALISED | STATE_INDEPENDENT,
-        STATE_NATIVE | STATE_FIXED_SIZE | STATE_TRUSTED         },
+        STATE_FIXED_SIZE | STATE_TRUSTED                        },
       { STATE_LOCKED                                            } } },
 
   { STATE_FIXED_SIZE, NULL, NULL,
@@ -360,69 +519,91 @@ struct state state_table[] =
     { { STATE_LOCKED                                            } } }
 };
 
+/*
+ * g_variant_try_state_locked:
+ * @value: a locked #GVariant
+ * @state: the state bits that are required
+ * @returns: %TRUE if @value is now in @state
+ *
+ * Walks the state table attempting to bring @value into @state,
+ * recursively requesting any prerequisite states along the way.  The
+ * caller must hold the lock on @value; the recursion happens entirely
+ * under that one acquisition.
+ */
 static gboolean
-g_variant_try_state (GVariant *value,
-                     guint     state)
+g_variant_try_state_locked (GVariant *value,
+                            guint     state)
 {
+  gsize i;
+
   if ((value->state & state) == state)
     return TRUE;
-  
-  g_variant_lock (value);
-
-  if ((value->state & state) != state)
-    {
-      gsize i;
 
-      for (i = 0; i < G_N_ELEMENTS (state_table); i++)
-        if ((state & state_table[i].state) >
-            (state_table[i].state & value->state))
-          {
-            struct state *s = &state_table[i];
-            struct transition *t;
-
-            /* see if we can transition directly first */
-            for (t = s->transitions; t->required_states != STATE_LOCKED; t++)
-              if ((t->forbidden_states & value->state) == 0 &&
-                  (t->required_states & value->state) == t->required_states)
-                if (s->enable == NULL || s->enable (value))
-                  {
-                    value->state |= s->state;
-                    goto ok;
-                  }
-
-            /* try to request other states to satisfy our prereqs */
-            for (t = s->transitions; t->required_states != STATE_LOCKED; t++)
-              if ((t->forbidden_states & value->state) == 0 &&
-                  g_variant_try_state (value, t->required_states))
+  for (i = 0; i < G_N_ELEMENTS (state_table); i++)
+    if ((state & state_table[i].state) >
+        (state_table[i].state & value->state))
+      {
+        struct state *s = &state_table[i];
+        struct transition *t;
+
+        /* see if we can transition directly first */
+        for (t = s->transitions; t->required_states != STATE_LOCKED; t++)
+          if ((t->forbidden_states & value->state) == 0 &&
+              (t->required_states & value->state) == t->required_states)
+            if (s->enable == NULL || s->enable (value))
               {
-                /* one of the other states may have given us this one
-                 * for free already.  double-check that.
-                 */
-                if (value->state & s->state)
-                  goto ok;
-
-                else if (s->enable == NULL || s->enable (value))
-                  {
-                    value->state |= s->state;
-                    goto ok;
-                  }
+                g_variant_set_state (value, s->state);
+                goto ok;
               }
 
-            /* failed to get this particular state */
-            g_variant_unlock (value);
-            return FALSE;
+        /* try to request other states to satisfy our prereqs */
+        for (t = s->transitions; t->required_states != STATE_LOCKED; t++)
+          if ((t->forbidden_states & value->state) == 0 &&
+              g_variant_try_state_locked (value, t->required_states))
+          {
+            /* one of the other states may have given us this one
+             * for free already.  double-check that.
+             */
+            if (value->state & s->state)
+              goto ok;
 
-            ok: continue;
+            else if (s->enable == NULL || s->enable (value))
+              {
+                g_variant_set_state (value, s->state);
+                goto ok;
+              }
           }
-    }
 
-  g_variant_unlock (value);
+        /* failed to get this particular state */
+        return FALSE;
+
+        ok: continue;
+      }
 
   g_assert ((value->state & state) == state);
 
   return TRUE;
 }
 
+static gboolean
+g_variant_try_state (GVariant *value,
+                     guint     state)
+{
+  gboolean success;
+
+  /* states are never lost once gained, so if they have already been
+   * published then there is no need to take the lock at all.
+   */
+  if ((g_variant_get_state (value) & state) == state)
+    return TRUE;
+
+  g_variant_lock (value);
+  success = g_variant_try_state_locked (value, state);
+  g_variant_unlock (value);
+
+  return success;
+}
+
 static void
 g_variant_require_state (GVariant *value,
                          guint     state)
@@ -433,16 +614,26 @@ g_variant_require_state (GVariant *value,
   g_assert (success);
 }
 
+/*
+ * g_variant_lock_tree:
+ * @value: a #GVariant
+ * @returns: %TRUE if @value is in tree form (and is now locked)
+ *
+ * The tree form of a #GVariant is replaced by its serialised form when
+ * %STATE_SERIALISED is reached, so the tree may only be examined while
+ * holding the lock.  Once %STATE_SERIALISED has been published the
+ * value stays serialised forever, so in that case %FALSE is returned
+ * without the lock ever being taken.
+ */
 static gboolean
-g_variant_is_out_of_state (GVariant *value,
-                           guint     state)
+g_variant_lock_tree (GVariant *value)
 {
-  if (value->state & state)
+  if (g_variant_get_state (value) & STATE_SERIALISED)
     return FALSE;
 
   g_variant_lock (value);
 
-  if (value->state & state)
+  if (value->state & STATE_SERIALISED)
     {
       g_variant_unlock (value);
       return FALSE;
@@ -451,17 +642,440 @@ g_variant_is_out_of_state (GVariant *value,
   return TRUE;
 }
 
+/* GVariant structures and small serialised data are allocated and
+ * freed far more often than anything else.  Each thread keeps a
+ * "magazine" (a short list of free blocks) for each small size, so
+ * most allocations and frees need no locking at all.
+ *
+ * When values are created by one thread and freed by another, the
+ * first thread's magazines only ever empty and the second's only ever
+ * fill.  Full magazines are therefore handed over to a shared depot
+ * where a thread with an empty magazine can pick one up.  Only the
+ * depot is locked, and only once per G_VARIANT_MAGAZINE_SIZE blocks.
+ *
+ * Blocks come from GSlice (and are eventually returned to it) with
+ * their exact size, so a block may be allocated by one and freed by
+ * the other.  Sizes too small to hold the links or larger than
+ * G_VARIANT_MAGAZINE_MAX_BLOCK go straight to GSlice.
+ */
+#define G_VARIANT_MAGAZINE_SIZE       64
+#define G_VARIANT_MAGAZINE_MAX_BLOCK  128
+
+typedef struct _GVariantMagazineBlock GVariantMagazineBlock;
+struct _GVariantMagazineBlock
+{
+  GVariantMagazineBlock *next;
+
+  /* only in the first block of a magazine in the depot */
+  GVariantMagazineBlock *next_magazine;
+};
+
+typedef struct
+{
+  GVariantMagazineBlock *blocks;
+  gint n_blocks;
+} GVariantMagazine;
+
+typedef struct
+{
+  GVariantMagazine magazines[G_VARIANT_MAGAZINE_MAX_BLOCK + 1];
+
+  /* counts not yet added to the g_variant_stats_magazine_* */
+  guint hits;
+  guint misses;
+  guint exchanges;
+} GVariantMagazines;
+
+static GStaticPrivate g_variant_magazines = G_STATIC_PRIVATE_INIT;
+static GStaticMutex g_variant_depot_lock = G_STATIC_MUTEX_INIT;
+static GVariantMagazineBlock *g_variant_depot[G_VARIANT_MAGAZINE_MAX_BLOCK + 1];
+
+static void
+g_variant_magazines_flush (GVariantMagazines *mags)
+{
+  g_atomic_int_add (&g_variant_stats_magazine_hits, mags->hits);
+  g_atomic_int_add (&g_variant_stats_magazine_misses, mags->misses);
+  g_atomic_int_add (&g_variant_stats_magazine_exchanges, mags->exchanges);
+  mags->hits = mags->misses = mags->exchanges = 0;
+}
+
+/* called when a thread exits */
+static void
+g_variant_magazines_free (gpointer data)
+{
+  GVariantMagazines *mags = data;
+  gsize size;
+
+  for (size = 0; size <= G_VARIANT_MAGAZINE_MAX_BLOCK; size++)
+    while (mags->magazines[size].blocks)
+      {
+        GVariantMagazineBlock *block = mags->magazines[size].blocks;
+
+        mags->magazines[size].blocks = block->next;
+        g_slice_free1 (size, block);
+      }
+
+  g_variant_magazines_flush (mags);
+  g_free (mags);
+}
+
+static GVariantMagazines *
+g_variant_magazines_get (void)
+{
+  GVariantMagazines *mags;
+
+  mags = g_static_private_get (&g_variant_magazines);
+
+  if G_UNLIKELY (mags == NULL)
+    {
+      mags = g_new0 (GVariantMagazines, 1);
+      g_static_private_set (&g_variant_magazines, mags,
+                            &g_variant_magazines_free);
+    }
+
+  return mags;
+}
+
+static gpointer
+g_variant_magazine_alloc (gsize size)
+{
+  GVariantMagazineBlock *block;
+  GVariantMagazines *mags;
+  GVariantMagazine *mag;
+
+  if (size < sizeof (GVariantMagazineBlock) ||
+      size > G_VARIANT_MAGAZINE_MAX_BLOCK)
+    return g_slice_alloc (size);
+
+  mags = g_variant_magazines_get ();
+  mag = &mags->magazines[size];
+
+  if G_UNLIKELY (mag->n_blocks == 0)
+    {
+      g_static_mutex_lock (&g_variant_depot_lock);
+      if ((block = g_variant_depot[size]))
+        g_variant_depot[size] = block->next_magazine;
+      g_static_mutex_unlock (&g_variant_depot_lock);
+
+      if (block == NULL)
+        {
+          mags->misses++;
+          g_variant_magazines_flush (mags);
+
+          return g_slice_alloc (size);
+        }
+
+      mag->blocks = block;
+      mag->n_blocks = G_VARIANT_MAGAZINE_SIZE;
+      mags->exchanges++;
+      g_variant_magazines_flush (mags);
+    }
+
+  /* flush now and then so that other threads see the counts */
+  if G_UNLIKELY (++mags->hits == 4096)
+    g_variant_magazines_flush (mags);
+
+  block = mag->blocks;
+  mag->blocks = block->next;
+  mag->n_blocks--;
+
+  return block;
+}
+
+static void
+g_variant_magazine_free (gsize    size,
+                         gpointer mem)
+{
+  GVariantMagazineBlock *block = mem;
+  GVariantMagazines *mags;
+  GVariantMagazine *mag;
+
+  if (size < sizeof (GVariantMagazineBlock) ||
+      size > G_VARIANT_MAGAZINE_MAX_BLOCK)
+    {
+      g_slice_free1 (size, mem);
+      return;
+    }
+
+  mags = g_variant_magazines_get ();
+  mag = &mags->magazines[size];
+
+  if G_UNLIKELY (mag->n_blocks == G_VARIANT_MAGAZINE_SIZE)
+    {
+      GVariantMagazineBlock *full = mag->blocks;
+
+      g_static_mutex_lock (&g_variant_depot_lock);
+      full->next_magazine = g_variant_depot[size];
+      g_variant_depot[size] = full;
+      g_static_mutex_unlock (&g_variant_depot_lock);
+
+      mag->blocks = NULL;
+      mag->n_blocks = 0;
+      mags->exchanges++;
+    }
+
+  block->next = mag->blocks;
+  mag->blocks = block;
+  mag->n_blocks++;
+}
+
+/* An arena hands out memory from a few large blocks and releases all
+ * of it at once.  While an arena is current for a thread (see
+ * g_variant_arena_push()) every GVariant allocated by that thread
+ * comes from it, as does the data of any tree that it serialises.
+ *
+ * Each GVariant in an arena is preceded by a pointer back to the arena
+ * and holds a reference on it.  Building a value creates and frees
+ * many temporaries, so a GVariant that is freed by the thread that the
+ * arena is current for goes on a list to be used again.  Otherwise,
+ * freeing one only drops its reference and the memory stays unused
+ * until the last value from the arena is gone.  Memory is only ever
+ * taken from an arena (or put on its list) by the thread that it is
+ * current for.
+ */
+#define G_VARIANT_ARENA_BLOCK_SIZE  65536
+
+typedef struct _GVariantArenaBlock GVariantArenaBlock;
+struct _GVariantArenaBlock
+{
+  GVariantArenaBlock *next;
+};
+
+/* the memory of a block starts this far after its header so that
+ * allocations keep the 8-byte alignment that serialised data needs,
+ * even where a pointer is only 4 bytes.
+ */
+#define G_VARIANT_ARENA_HEADER_SIZE \
+  (MAX (MAX (sizeof (GVariantArenaBlock), 8), G_MEM_ALIGN))
+
+struct OPAQUE_TYPE__GVariantArena
+{
+  gint ref_count;
+  GVariantArenaBlock *blocks;
+  guchar *position;
+  guchar *end;
+
+  GVariant *free_values;
+};
+
+static GStaticPrivate g_variant_current_arena = G_STATIC_PRIVATE_INIT;
+
+/* the number of threads with a current arena.  when it is zero (ie:
+ * almost always) the thread-private lookup is skipped entirely.
+ */
+static gint g_variant_arena_threads;
+
+static GVariantArena *
+g_variant_arena_current (void)
+{
+  if (g_atomic_int_get (&g_variant_arena_threads) == 0)
+    return NULL;
+
+  return g_static_private_get (&g_variant_current_arena);
+}
+
+static void
+g_variant_arena_set_current (GVariantArena *arena)
+{
+  GVariantArena *old;
+
+  old = g_static_private_get (&g_variant_current_arena);
+  g_static_private_set (&g_variant_current_arena, arena, NULL);
+
+  if (old == NULL && arena != NULL)
+    g_atomic_int_inc (&g_variant_arena_threads);
+
+  else if (old != NULL && arena == NULL)
+    g_atomic_int_add (&g_variant_arena_threads, -1);
+}
+
+/* private */
+GVariantArena *
+g_variant_arena_new (void)
+{
+  GVariantArena *arena;
+
+  arena = g_slice_new (GVariantArena);
+  arena->ref_count = 1;
+  arena->blocks = NULL;
+  arena->position = NULL;
+  arena->end = NULL;
+  arena->free_values = NULL;
+
+  return arena;
+}
+
+/* private */
+GVariantArena *
+g_variant_arena_ref (GVariantArena *arena)
+{
+  g_atomic_int_inc (&arena->ref_count);
+
+  return arena;
+}
+
+/* private */
+void
+g_variant_arena_unref (GVariantArena *arena)
+{
+  if (g_atomic_int_dec_and_test (&arena->ref_count))
+    {
+      GVariantArenaBlock *block;
 
+      while ((block = arena->blocks))
+        {
+          arena->blocks = block->next;
+          g_free (block);
+        }
 
+      g_slice_free (GVariantArena, arena);
+    }
+}
 
+/* private
+ *
+ * Makes @arena (which may be %NULL) the current arena for the calling
+ * thread and returns the previous one, to be given to
+ * g_variant_arena_pop().
+ */
+GVariantArena *
+g_variant_arena_push (GVariantArena *arena)
+{
+  GVariantArena *previous;
 
+  previous = g_static_private_get (&g_variant_current_arena);
+  g_variant_arena_set_current (arena);
 
+  return previous;
+}
 
+/* private */
+void
+g_variant_arena_pop (GVariantArena *previous)
+{
+  g_variant_arena_set_current (previous);
+}
+
+static GVariantArenaBlock *
+g_variant_arena_add_block (GVariantArena *arena,
+                           gsize          size)
+{
+  GVariantArenaBlock *block;
+
+  block = g_malloc (G_VARIANT_ARENA_HEADER_SIZE + size);
+  block->next = arena->blocks;
+  arena->blocks = block;
 
+  return block;
+}
 
+static gpointer
+g_variant_arena_alloc (GVariantArena *arena,
+                       gsize          size)
+{
+  gpointer memory;
 
+  size = (size + 7) & ~(gsize) 7;
 
+  /* large requests get a block of their own and leave the current
+   * block as it is.
+   */
+  if G_UNLIKELY (size > G_VARIANT_ARENA_BLOCK_SIZE / 8)
+    memory = (guchar *) g_variant_arena_add_block (arena, size) +
+             G_VARIANT_ARENA_HEADER_SIZE;
 
+  else
+    {
+      if G_UNLIKELY ((gsize) (arena->end - arena->position) < size)
+        {
+          GVariantArenaBlock *block;
+
+          block = g_variant_arena_add_block (arena,
+                                             G_VARIANT_ARENA_BLOCK_SIZE);
+          arena->position = (guchar *) block + G_VARIANT_ARENA_HEADER_SIZE;
+          arena->end = arena->position + G_VARIANT_ARENA_BLOCK_SIZE;
+        }
+
+      memory = arena->position;
+      arena->position += size;
+    }
+
+  g_assert (((gsize) memory & 7) == 0);
+
+  return memory;
+}
+
+static GVariantArena *
+g_variant_get_arena (GVariant *value)
+{
+  return ((GVariantArena **) value)[-1];
+}
+
+static GVariant *
+g_variant_arena_alloc_value (GVariantArena *arena)
+{
+  GVariant *value;
+
+  g_variant_arena_ref (arena);
+
+  if ((value = arena->free_values))
+    {
+      /* the first word of a free value links to the next one */
+      arena->free_values = *(GVariant **) value;
+      return value;
+    }
+  else
+    {
+      GVariantArena **header;
+
+      header = g_variant_arena_alloc (arena, sizeof (GVariantArena *) +
+                                             sizeof (GVariant));
+      *header = arena;
+
+      return (GVariant *) (header + 1);
+    }
+}
+
+static void
+g_variant_arena_free_value (GVariant *value)
+{
+  GVariantArena *arena = g_variant_get_arena (value);
+
+  if (arena == g_variant_arena_current ())
+    {
+      /* the thread that the arena is current for holds a reference of
+       * its own, so this one is never the last.
+       */
+      *(GVariant **) value = arena->free_values;
+      arena->free_values = value;
+      g_atomic_int_add (&arena->ref_count, -1);
+    }
+  else
+    g_variant_arena_unref (arena);
+}
+
+/* allocates the data for a tree that is being serialised.  it comes
+ * from the arena of @value if that arena is current (and therefore
+ * belongs to this thread).
+ */
+static gpointer
+g_variant_alloc_data (GVariant *value,
+                      gsize     size)
+{
+  if (value->state & STATE_ARENA)
+    {
+      GVariantArena *arena = g_variant_get_arena (value);
+
+      if (g_variant_arena_current () == arena)
+        {
+          g_variant_set_state (value, STATE_ARENA_DATA);
+
+          return g_variant_arena_alloc (arena, size);
+        }
+    }
+
+  return g_variant_magazine_alloc (size);
+}
 
 /* this is the only function that ever allocates a new GVariant structure.
  * g_variant_unref() is the only function that ever frees one.
@@ -470,28 +1084,57 @@ static GVariant *
 g_variant_alloc (GVariantTypeInfo *type,
                  guint             initial_state)
 {
+  GVariantArena *arena;
   GVariant *variant;
 
-  variant = g_slice_new (GVariant);
+  if ((arena = g_variant_arena_current ()))
+    {
+      variant = g_variant_arena_alloc_value (arena);
+      initial_state |= STATE_ARENA;
+    }
+  else
+    variant = g_variant_magazine_alloc (sizeof (GVariant));
+
   variant->ref_count = 1;
   variant->type = type;
-  variant->floating = TRUE;
-  variant->state = initial_state;
-  g_static_mutex_init (&variant->lock);
+  variant->state = initial_state | STATE_FLOATING;
 
   return variant;
 }
 
+/* returns the serialised data of @value, with a reference on whatever
+ * keeps it alive in @source (if non-%NULL).  if @state_out is non-%NULL
+ * then the state of @value that the data was chosen by is stored
+ * there: a later look at the state might already see a renormalised
+ * copy that is not the data returned.
+ */
 static GVariantSerialised
 g_variant_get_gvs (GVariant  *value,
-                   GVariant **source)
+                   GVariant **source,
+                   guint     *state_out)
 {
   GVariantSerialised gvs = { value->type };
+  gboolean locked;
+  guint state;
 
-  g_assert (value->state & STATE_SERIALISED);
+  state = g_variant_get_state (value);
+  g_assert (state & STATE_SERIALISED);
+
+  /* a dependent value that is not in native byte order may be made
+   * independent at any moment (changing its data pointer and dropping
+   * its source) so we need the lock to get a stable view of it.  in
+   * all other cases the pointers we are about to read never change.
+   */
+  locked = (state & (STATE_INDEPENDENT | STATE_NATIVE)) == 0;
+
+  if (locked)
+    {
+      g_variant_lock (value);
+      state = value->state;
+    }
 
   /* not independent implies not renormalised */
-  if (g_variant_is_out_of_state (value, STATE_INDEPENDENT))
+  if (~state & STATE_INDEPENDENT)
     {
       /* dependent */
       gvs.data = value->contents.serialised.data;
@@ -499,10 +1142,8 @@ g_variant_get_gvs (GVariant  *value,
 
       if (source)
         *source = g_variant_ref (value->contents.serialised.source);
-
-      g_variant_unlock (value);
     }
-  else if (g_variant_is_out_of_state (value, STATE_RENORMALISED))
+  else if (~state & STATE_RENORMALISED)
     {
       /* independent */
       gvs.data = value->contents.serialised.data;
@@ -510,8 +1151,6 @@ g_variant_get_gvs (GVariant  *value,
 
       if (source)
         *source = g_variant_ref (value);
-
-      g_variant_unlock (value);
     }
   else
     {
@@ -523,6 +1162,12 @@ g_variant_get_gvs (GVariant  *value,
         *source = g_variant_ref (value->contents.serialised.source);
     }
 
+  if (locked)
+    g_variant_unlock (value);
+
+  if (state_out)
+    *state_out = state;
+
   return gvs;
 }
 
@@ -556,6 +1201,86 @@ g_variant_fill_gvs (GVariantSerialised *serialised,
     g_variant_store (value, serialised->data);
 }
 
+/* Used when sizing or serialising a tree whose lock is held.  A child
+ * that is still a tree and has no reference other than the one from
+ * its parent can only be reached through the locked tree, so there is
+ * no need to lock it or to publish its state atomically.  Its size is
+ * computed once (bottom up) by the sizing pass and left in the child
+ * for the writing pass to find.
+ *
+ * Serialised children in machine byte order are copied directly: the
+ * parent keeps them (and their sources) alive, so there is no need to
+ * take a reference on the source as g_variant_store() does.  Anything
+ * else goes the normal way.
+ */
+static void
+g_variant_fill_exclusive (GVariantSerialised *serialised,
+                          gpointer            data)
+{
+  GVariant *value = data;
+  GVariant **children;
+  gsize n_children;
+  guint state;
+
+  state = g_variant_get_state (value);
+
+  if ((state & (STATE_SERIALISED | STATE_NATIVE)) ==
+      (STATE_SERIALISED | STATE_NATIVE))
+    {
+      GVariantSerialised gvs;
+
+      gvs = g_variant_get_gvs (value, NULL, NULL);
+
+      if (serialised->type == NULL)
+        serialised->type = gvs.type;
+
+      if (serialised->size == 0)
+        serialised->size = gvs.size;
+
+      g_assert (serialised->type == gvs.type);
+      g_assert (serialised->size == gvs.size);
+
+      if (serialised->data && serialised->size)
+        memcpy (serialised->data, gvs.data, gvs.size);
+
+      return;
+    }
+
+  if (state & STATE_SERIALISED ||
+      g_atomic_int_get (&value->ref_count) != 1)
+    {
+      g_variant_fill_gvs (serialised, data);
+      return;
+    }
+
+  check (value);
+
+  children = value->contents.tree.children;
+  n_children = value->contents.tree.n_children;
+
+  if (~value->state & STATE_SIZE_KNOWN)
+    {
+      value->size = g_variant_serialiser_needed_size (value->type,
+                                                      &g_variant_fill_exclusive,
+                                                      (gpointer *) children,
+                                                      n_children);
+      value->state |= STATE_SIZE_KNOWN;
+    }
+
+  if (serialised->type == NULL)
+    serialised->type = value->type;
+
+  if (serialised->size == 0)
+    serialised->size = value->size;
+
+  g_assert (serialised->type == value->type);
+  g_assert (serialised->size == value->size);
+
+  if (serialised->data && serialised->size)
+    g_variant_serialiser_serialise (*serialised, &g_variant_fill_exclusive,
+                                    (gpointer *) children, n_children);
+}
+
 static guchar *
 g_variant_get_zeros (gsize size)
 {
@@ -566,22 +1291,136 @@ g_variant_get_zeros (gsize size)
   return zeros;
 }
 
+/*
+ * g_variant_new_inline:
+ * @gvs: the serialised data to copy
+ * @native: %TRUE if @gvs is in machine byte order
+ * @trusted: %TRUE if @gvs is known to be in normal form
+ * @returns: a new #GVariant, or %NULL
+ *
+ * Creates a #GVariant holding a copy of @gvs in the instance itself
+ * rather than in a separately allocated buffer.  This is only done for
+ * basic types with a fixed size of no more than 8 bytes.  The copy is
+ * byteswapped immediately if required and the result is always
+ * independent, native and trusted so it never needs another state
+ * transition.
+ *
+ * Ownership of @gvs.type is only assumed on success.  %NULL is
+ * returned if @gvs is not a small fixed-size basic value or if it is
+ * not in normal form.
+ */
+static GVariant *g_variant_new_inline_copy (GVariantSerialised gvs,
+                                            gboolean           native,
+                                            gboolean           trusted);
+
+/* %TRUE if @gvs is a small fixed-size basic value: see
+ * g_variant_new_inline().  only the type and size are looked at.
+ */
+static gboolean
+g_variant_is_inlinable (GVariantSerialised gvs)
+{
+  gsize fixed_size;
+
+  g_variant_type_info_query (gvs.type, NULL, &fixed_size);
+
+  if (fixed_size == 0 || fixed_size > sizeof (guint64) ||
+      gvs.size != fixed_size || gvs.data == NULL)
+    return FALSE;
+
+  return g_variant_type_class_is_basic (
+           g_variant_type_info_get_type_class (gvs.type));
+}
+
+static GVariant *
+g_variant_new_inline (GVariantSerialised gvs,
+                      gboolean           native,
+                      gboolean           trusted)
+{
+  if (!g_variant_is_inlinable (gvs))
+    return NULL;
+
+  return g_variant_new_inline_copy (gvs, native, trusted);
+}
+
+/* the second half of g_variant_new_inline(), for a @gvs that is known
+ * to be inlinable.
+ */
+static GVariant *
+g_variant_new_inline_copy (GVariantSerialised gvs,
+                           gboolean           native,
+                           gboolean           trusted)
+{
+  GVariant *new;
+
+  if (!trusted && !g_variant_serialised_is_normal (gvs))
+    return NULL;
+
+  new = g_variant_alloc (gvs.type, STATE_SERIALISED | STATE_SIZE_KNOWN |
+                                   STATE_INDEPENDENT | STATE_NATIVE |
+                                   STATE_TRUSTED | STATE_INLINE);
+  new->contents.inlined.unused = NULL;
+  new->contents.inlined.data = (guint8 *) &new->contents.inlined.payload;
+  memcpy (new->contents.inlined.data, gvs.data, gvs.size);
+  new->size = gvs.size;
+
+  if (!native)
+    {
+      gvs.data = new->contents.inlined.data;
+      g_variant_serialised_byteswap (gvs);
+      g_atomic_int_add (&g_variant_stats_bytes_byteswapped, gvs.size);
+    }
+
+  check (new);
+
+  return new;
+}
+
+/* like g_variant_new_inline() for a @gvs that points into the data of
+ * a @source that is not (yet) in native byte order.  the lock on
+ * @source is held so that it can not be byteswapped in place while
+ * the (at most 8) bytes are copied out, and only for that long: other
+ * children of @source are never inlined, so they never take it here.
+ */
+static GVariant *
+g_variant_new_inline_locked (GVariantSerialised  gvs,
+                             GVariant           *source,
+                             gboolean            trusted)
+{
+  gboolean native;
+  guint64 copy;
+
+  if (!g_variant_is_inlinable (gvs))
+    return NULL;
+
+  g_variant_lock (source);
+  native = (source->state & STATE_NATIVE) != 0;
+  memcpy (&copy, gvs.data, gvs.size);
+  g_variant_unlock (source);
+
+  gvs.data = (guchar *) &copy;
+
+  return g_variant_new_inline_copy (gvs, native, trusted);
+}
+
 static GVariant *
 g_variant_from_gvs (GVariantSerialised  gvs,
                     GVariant           *source,
                     gboolean            trusted)
 {
   GVariant *new;
+  guint source_state;
+  guint alignment;
 
-  g_assert (source->state & STATE_INDEPENDENT);
-
-  new = g_variant_alloc (gvs.type, STATE_SERIALISED | STATE_SIZE_KNOWN);
+  source_state = g_variant_get_state (source);
+  g_assert (source_state & STATE_INDEPENDENT);
 
   if (gvs.data == NULL)
     {
+      new = g_variant_alloc (gvs.type, STATE_SERIALISED | STATE_SIZE_KNOWN);
+
       if (gvs.size)
         {
-          g_assert (!(source->state & STATE_TRUSTED));
+          g_assert (!(source_state & STATE_TRUSTED));
           g_assert (!trusted);
 
           new->contents.serialised.data = g_variant_get_zeros (gvs.size);
@@ -597,22 +1436,94 @@ g_variant_from_gvs (GVariantSerialised  gvs,
       if (gvs.size)
         new->state |= STATE_TRUSTED;
     }
+  else if (source_state & STATE_NATIVE &&
+           (new = g_variant_new_inline (gvs, TRUE,
+                                        trusted ||
+                                        source_state & STATE_TRUSTED)))
+    /* small scalars are copied out rather than holding @source */
+    ;
+  else if (~source_state & STATE_NATIVE &&
+           (new = g_variant_new_inline_locked (gvs, source,
+                                               trusted ||
+                                               source_state &
+                                               STATE_TRUSTED)))
+    /* ...and swapped on the way if @source is in the other byte
+     * order, so that reading one scalar out of a lazily byteswapped
+     * value never swaps anything else.
+     */
+    ;
   else
     {
+      new = g_variant_alloc (gvs.type, STATE_SERIALISED | STATE_SIZE_KNOWN);
+
       new->contents.serialised.source = g_variant_ref (source);
       new->contents.serialised.data = gvs.data;
       new->size = gvs.size;
 
-      if (source->state & STATE_NATIVE)
+      g_variant_type_info_query (gvs.type, &alignment, NULL);
+
+      if (source_state & STATE_NATIVE || alignment == 0)
         new->state |= STATE_NATIVE;
 
-      if (trusted || source->state & STATE_TRUSTED)
-        new->state |= STATE_TRUSTED;
+      if (trusted || source_state & STATE_TRUSTED)
+        new->state |= STATE_TRUSTED;
+    }
+
+  check (new);
+
+  return new;
+}
+
+/*
+ * g_variant_get_array_length:
+ * @value: a serialised array #GVariant
+ * @gvs: the serialised data of @value, from g_variant_get_gvs()
+ * @gvs_state: the state that g_variant_get_gvs() returned with @gvs
+ * @length: the number of items in @value
+ * @offset_size: the offset size of @value
+ *
+ * Decodes the length and offset size of an array, caching the result
+ * on @value so that random access to the items of a large array does
+ * not have to decode the offset table each time.
+ *
+ * The cache is only kept for (and only used with) data that is
+ * trusted or already renormalised, since renormalisation could change
+ * the offset size.  This is decided by @gvs_state rather than by the
+ * current state: @value may have been renormalised by another thread
+ * since @gvs was taken from the original data.  Racing threads compute
+ * identical results, so the cache is filled without taking the lock.
+ */
+static void
+g_variant_get_array_length (GVariant           *value,
+                            GVariantSerialised  gvs,
+                            guint               gvs_state,
+                            gsize              *length,
+                            guint              *offset_size)
+{
+  gboolean cacheable;
+  guint state;
+
+  cacheable = (gvs_state & (STATE_TRUSTED | STATE_RENORMALISED)) != 0;
+  state = g_variant_get_state (value);
+
+  if (cacheable && (state & STATE_LENGTH_KNOWN))
+    {
+      *length = value->contents.serialised.length;
+      *offset_size = (state & STATE_OFFSET_SIZE_MASK) >>
+                     STATE_OFFSET_SIZE_SHIFT;
+      return;
     }
 
-  check (new);
+  if G_UNLIKELY (!g_variant_serialised_array_length (gvs, length,
+                                                     offset_size))
+    g_error ("deserialise error on n_children");
 
-  return new;
+  if (cacheable)
+    {
+      value->contents.serialised.length = *length;
+      g_variant_set_state (value, STATE_LENGTH_KNOWN |
+                                  *offset_size << STATE_OFFSET_SIZE_SHIFT);
+    }
 }
 
 /**
@@ -639,7 +1550,7 @@ g_variant_get_child (GVariant *value,
 
   check (value);
 
-  if (g_variant_is_out_of_state (value, STATE_SERIALISED))
+  if (g_variant_lock_tree (value))
     {
       if G_UNLIKELY (index >= value->contents.tree.n_children)
         g_error ("Attempt to access item %d in a container with "
@@ -652,11 +1563,24 @@ g_variant_get_child (GVariant *value,
     {
       GVariantSerialised gvs;
       GVariant *source;
+      guint state;
+
+      gvs = g_variant_get_gvs (value, &source, &state);
 
-      gvs = g_variant_get_gvs (value, &source);
-      gvs = g_variant_serialised_get_child (gvs, index);
-      child = g_variant_from_gvs (gvs, source,
-                                  value->state & STATE_TRUSTED);
+      if (g_variant_get_type_class (value) == G_VARIANT_TYPE_CLASS_ARRAY)
+        {
+          guint offset_size;
+          gsize length;
+
+          g_variant_get_array_length (value, gvs, state,
+                                      &length, &offset_size);
+          gvs = g_variant_serialised_array_child (gvs, length,
+                                                  offset_size, index);
+        }
+      else
+        gvs = g_variant_serialised_get_child (gvs, index);
+
+      child = g_variant_from_gvs (gvs, source, state & STATE_TRUSTED);
       g_variant_unref (source);
     }
 
@@ -690,7 +1614,7 @@ g_variant_n_children (GVariant *value)
 
   check (value);
 
-  if (g_variant_is_out_of_state (value, STATE_SERIALISED))
+  if (g_variant_lock_tree (value))
     {
       n_children = value->contents.tree.n_children;
       g_variant_unlock (value);
@@ -699,9 +1623,20 @@ g_variant_n_children (GVariant *value)
     {
       GVariantSerialised gvs;
       GVariant *source;
+      guint state;
+
+      gvs = g_variant_get_gvs (value, &source, &state);
+
+      if (g_variant_get_type_class (value) == G_VARIANT_TYPE_CLASS_ARRAY)
+        {
+          guint offset_size;
+
+          g_variant_get_array_length (value, gvs, state,
+                                      &n_children, &offset_size);
+        }
+      else
+        n_children = g_variant_serialised_n_children (gvs);
 
-      gvs = g_variant_get_gvs (value, &source);
-      n_children = g_variant_serialised_n_children (gvs);
       g_variant_unref (source);
     }
 
@@ -712,14 +1647,14 @@ gsize
 g_variant_get_size (GVariant *value)
 {
   g_variant_require_state (value, STATE_VISIBLE);
-  return g_variant_get_gvs (value, NULL).size;
+  return g_variant_get_gvs (value, NULL, NULL).size;
 }
 
 gconstpointer
 g_variant_get_data (GVariant *value)
 {
   g_variant_require_state (value, STATE_VISIBLE);
-  return g_variant_get_gvs (value, NULL).data;
+  return g_variant_get_gvs (value, NULL, NULL).data;
 }
 
 /**
@@ -746,7 +1681,7 @@ g_variant_store (GVariant *value,
 
   g_variant_require_state (value, STATE_SIZE_KNOWN | STATE_NATIVE);
 
-  if (g_variant_is_out_of_state (value, STATE_SERIALISED))
+  if (g_variant_lock_tree (value))
     {
       GVariantSerialised gvs;
       GVariant **children;
@@ -763,18 +1698,202 @@ g_variant_store (GVariant *value,
                                       &g_variant_fill_gvs,
                                       (gpointer *) children,
                                       n_children);
+      g_variant_unlock (value);
     }
   else
     {
       GVariantSerialised gvs;
       GVariant *source;
 
-      gvs = g_variant_get_gvs (value, &source);
+      gvs = g_variant_get_gvs (value, &source, NULL);
       memcpy (data, gvs.data, gvs.size);
       g_variant_unref (source);
   }
 }
 
+/* The sink calls the user's write function, which may well look at
+ * @value (or block for a long time), so the lock on a tree is only
+ * held long enough to take references on its children.  They are then
+ * streamed from that snapshot, which stays valid even if @value is
+ * serialised by another thread in the meantime.
+ */
+static void
+g_variant_stream (gpointer                data,
+                  GVariantSerialiserSink *sink)
+{
+  GVariant *value = data;
+
+  check (value);
+
+  g_variant_require_state (value, STATE_SIZE_KNOWN | STATE_NATIVE);
+
+  if (g_variant_lock_tree (value))
+    {
+      GVariantSerialised gvs;
+      GVariant **children;
+      gsize n_children;
+      gsize i;
+
+      gvs.type = value->type;
+      gvs.data = NULL;
+      gvs.size = value->size;
+
+      n_children = value->contents.tree.n_children;
+      children = g_new (GVariant *, n_children);
+      for (i = 0; i < n_children; i++)
+        children[i] = g_variant_ref (value->contents.tree.children[i]);
+
+      g_variant_unlock (value);
+
+      g_variant_serialiser_stream (gvs, &g_variant_fill_gvs,
+                                   &g_variant_stream,
+                                   (gpointer *) children, n_children,
+                                   sink);
+
+      for (i = 0; i < n_children; i++)
+        g_variant_unref (children[i]);
+      g_free (children);
+    }
+  else
+    {
+      GVariantSerialised gvs;
+      GVariant *source;
+
+      gvs = g_variant_get_gvs (value, &source, NULL);
+      g_variant_serialiser_sink_write (sink, gvs.data, gvs.size);
+      g_variant_unref (source);
+    }
+}
+
+/**
+ * g_variant_store_stream:
+ * @value: the #GVariant to store
+ * @write_func: a #GVariantWriteFunc
+ * @user_data: user data for @write_func
+ * @error: a #GError, or %NULL
+ * @returns: %TRUE on success
+ *
+ * Writes the same data as g_variant_store() would, in order, by
+ * calling @write_func with consecutive chunks of it.
+ *
+ * Unlike g_variant_store() and g_variant_get_data(), the serialised
+ * form of @value is never held in memory all at once.  Values built
+ * with a #GVariantBuilder are serialised as they are written, so at
+ * most the offset tables of the containers that are being written
+ * need to be kept.  The serialised form of @value is not cached.
+ *
+ * No lock on @value is held while @write_func runs, so @write_func
+ * may use @value (or any part of it) and other threads are not held
+ * up by slow writes.
+ *
+ * If @write_func fails then it is not called again, %FALSE is
+ * returned and @error is set by @write_func.
+ **/
+gboolean
+g_variant_store_stream (GVariant          *value,
+                        GVariantWriteFunc  write_func,
+                        gpointer           user_data,
+                        GError           **error)
+{
+  GVariantSerialiserSink sink;
+
+  g_variant_serialiser_sink_init (&sink, write_func, user_data, error);
+  g_variant_stream (value, &sink);
+
+  return g_variant_serialiser_sink_finish (&sink);
+}
+
+static gboolean
+g_variant_write_file (gconstpointer   data,
+                      gsize           size,
+                      gpointer        user_data,
+                      GError        **error)
+{
+  if (fwrite (data, 1, size, user_data) != size)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "error writing serialised data: %s",
+                   g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * g_variant_store_file:
+ * @value: the #GVariant to store
+ * @filename: the name of the file to write
+ * @error: a #GError, or %NULL
+ * @returns: %TRUE on success
+ *
+ * Writes the serialised form of @value to @filename (replacing any
+ * existing file) using g_variant_store_stream().  The file can be
+ * loaded again with g_variant_map_file().
+ *
+ * On error, %FALSE is returned, @error is set and the contents of
+ * @filename are undefined.
+ **/
+gboolean
+g_variant_store_file (GVariant     *value,
+                      const gchar  *filename,
+                      GError      **error)
+{
+  gboolean success;
+  FILE *file;
+
+  if ((file = fopen (filename, "wb")) == NULL)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "error opening '%s' for writing: %s",
+                   filename, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  success = g_variant_store_stream (value, &g_variant_write_file,
+                                    file, error);
+
+  if (fclose (file) != 0 && success)
+    {
+      gint saved_errno = errno;
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   "error writing '%s': %s",
+                   filename, g_strerror (saved_errno));
+      success = FALSE;
+    }
+
+  return success;
+}
+
+/**
+ * g_variant_normalise:
+ * @value: a #GVariant
+ *
+ * Ensures that the serialised data of @value is in fully-normalised
+ * form.
+ *
+ * Data loaded from an untrusted source is first checked.  If it is
+ * already normal then it becomes trusted.  Otherwise, a normalised
+ * copy of the data is made and used for all future accesses to the
+ * data of @value.  Values that were constructed locally or loaded
+ * with %G_VARIANT_TRUSTED are always normal.
+ *
+ * This function is approximately O(n) in the size of @value.
+ **/
+void
+g_variant_normalise (GVariant *value)
+{
+  check (value);
+
+  if (!g_variant_try_state (value, STATE_TRUSTED))
+    g_variant_require_state (value, STATE_RENORMALISED);
+}
+
 /**
  * g_variant_get_fixed:
  * @value: a #GVariant
@@ -849,6 +1968,171 @@ g_variant_get_fixed_array (GVariant *value,
   return g_variant_get_data (value);
 }
 
+/* %TRUE if every possible sequence of bytes of the right size is a
+ * normal serialised value of the fixed-size @type.  that's the case
+ * unless it contains a boolean, a unit or some padding.
+ */
+static gboolean
+g_variant_fixed_type_is_dense (GVariantTypeInfo *type)
+{
+  const gchar *string;
+  gsize fixed_size;
+  gsize size = 0;
+
+  g_variant_type_info_query (type, NULL, &fixed_size);
+
+  for (string = g_variant_type_info_get_string (type); *string; string++)
+    switch (*string)
+    {
+      case 'y':
+        size += 1;
+        break;
+
+      case 'n': case 'q':
+        size += 2;
+        break;
+
+      case 'i': case 'u':
+        size += 4;
+        break;
+
+      case 'x': case 't': case 'd':
+        size += 8;
+        break;
+
+      case '(': case '{':
+        if (string[1] == ')')
+          return FALSE;
+        break;
+
+      case ')': case '}':
+        break;
+
+      default:
+        return FALSE;
+    }
+
+  return size == fixed_size;
+}
+
+/* checks @elem_size and returns the array type to use (which must be
+ * freed) and the flags for loading it.
+ */
+static GVariantType *
+g_variant_fixed_array_type (const GVariantType *elem_type,
+                            gsize               elem_size,
+                            GVariantFlags      *flags)
+{
+  GVariantTypeInfo *element;
+  gsize fixed_elem_size;
+
+  element = g_variant_type_info_get (elem_type);
+  g_variant_type_info_query (element, NULL, &fixed_elem_size);
+  g_assert (fixed_elem_size);
+
+  g_assert_cmpint (elem_size, ==, fixed_elem_size);
+
+  *flags = g_variant_fixed_type_is_dense (element) ? G_VARIANT_TRUSTED : 0;
+  g_variant_type_info_unref (element);
+
+  return g_variant_type_new_array (elem_type);
+}
+
+/**
+ * g_variant_new_fixed_array:
+ * @elem_type: the #GVariantType of the array elements
+ * @elements: a pointer to the elements
+ * @n_elements: the number of elements
+ * @elem_size: the size of one element
+ * @returns: a new array #GVariant instance
+ *
+ * Creates an array of fixed-size elements from a C array of the
+ * equivalent C type, in machine byte order.  This is the inverse of
+ * g_variant_get_fixed_array().  The data is copied (once).
+ *
+ * @elem_size must be equal to the fixed size of @elem_type.  As with
+ * g_variant_get_fixed_array(), it serves as a sanity check.
+ *
+ * Unless @elem_type contains booleans or padding (in which case the
+ * data is checked when it is accessed) the result is trusted.
+ *
+ * It is a programmer error for @elem_size to be zero or for the size
+ * of the array (@elem_size times @n_elements) not to fit in a #gsize.
+ * In that case a critical warning is emitted and %NULL is returned.
+ **/
+GVariant *
+g_variant_new_fixed_array (const GVariantType *elem_type,
+                           gconstpointer       elements,
+                           gsize               n_elements,
+                           gsize               elem_size)
+{
+  GVariantType *type;
+  GVariantFlags flags;
+  GVariant *value;
+  gpointer slice;
+  gsize size;
+
+  g_return_val_if_fail (elem_size > 0, NULL);
+  g_return_val_if_fail (n_elements <= G_MAXSIZE / elem_size, NULL);
+
+  type = g_variant_fixed_array_type (elem_type, elem_size, &flags);
+
+  size = elem_size * n_elements;
+  if (size)
+    {
+      slice = g_slice_alloc (size);
+      memcpy (slice, elements, size);
+    }
+  else
+    slice = NULL;
+
+  value = g_variant_from_slice (type, slice, size, flags);
+  g_variant_type_free (type);
+
+  return value;
+}
+
+/**
+ * g_variant_new_fixed_array_full:
+ * @elem_type: the #GVariantType of the array elements
+ * @elements: a pointer to the elements
+ * @n_elements: the number of elements
+ * @elem_size: the size of one element
+ * @notify: a #GDestroyNotify, or %NULL
+ * @user_data: data for @notify
+ * @returns: a new array #GVariant instance
+ *
+ * Like g_variant_new_fixed_array(), but without copying the data.
+ * @elements must remain unmodified until @notify is called with
+ * @user_data, which happens when neither the returned value nor any
+ * value taken from it exists anymore (see g_variant_from_data()).
+ *
+ * As with g_variant_new_fixed_array(), %NULL is returned if @elem_size
+ * is zero or if the size of the array does not fit in a #gsize.
+ **/
+GVariant *
+g_variant_new_fixed_array_full (const GVariantType *elem_type,
+                                gconstpointer       elements,
+                                gsize               n_elements,
+                                gsize               elem_size,
+                                GDestroyNotify      notify,
+                                gpointer            user_data)
+{
+  GVariantType *type;
+  GVariantFlags flags;
+  GVariant *value;
+
+  g_return_val_if_fail (elem_size > 0, NULL);
+  g_return_val_if_fail (n_elements <= G_MAXSIZE / elem_size, NULL);
+
+  type = g_variant_fixed_array_type (elem_type, elem_size, &flags);
+  value = g_variant_from_data (type, elements, elem_size * n_elements,
+                               flags, notify, user_data);
+  g_variant_type_free (type);
+
+  return value;
+}
+
 /*
  * g_variant_apply_flags:
  * @value: a fresh #GVariant instance
@@ -863,6 +2147,7 @@ g_variant_apply_flags (GVariant      *value,
                        GVariantFlags  flags)
 {
   guint16 byte_order = flags;
+  guint alignment;
 
   if (byte_order == 0)
     byte_order = G_BYTE_ORDER;
@@ -870,11 +2155,27 @@ g_variant_apply_flags (GVariant      *value,
   g_assert (byte_order == G_LITTLE_ENDIAN ||
             byte_order == G_BIG_ENDIAN);
 
-  if (byte_order == G_BYTE_ORDER)
+  if (flags & G_VARIANT_TRUSTED)
+    value->state |= STATE_TRUSTED;
+
+  /* without alignment there is nothing to swap */
+  g_variant_type_info_query (value->type, &alignment, NULL);
+
+  if (byte_order == G_BYTE_ORDER || alignment == 0)
     value->state |= STATE_NATIVE;
 
-  else if (!flags & G_VARIANT_LAZY_BYTESWAP)
-    g_variant_require_state (value, STATE_NATIVE);
+  /* the marker of data from g_variant_from_data() is the source of
+   * all children taken from @value, so it must describe the data too.
+   */
+  if (~value->state & STATE_INDEPENDENT)
+    value->contents.serialised.source->state |=
+      value->state & (STATE_NATIVE | STATE_TRUSTED);
+
+  /* untrusted data that is not in normal form never reaches
+   * STATE_NATIVE.  it is left as it is until it is renormalised.
+   */
+  if (~value->state & STATE_NATIVE && !(flags & G_VARIANT_LAZY_BYTESWAP))
+    g_variant_try_state (value, STATE_NATIVE);
 
   check (value);
 
@@ -900,15 +2201,23 @@ g_variant_unref (GVariant *value)
         g_variant_type_info_unref (value->type);
 
       /* free the data */
-      if (value->state & STATE_SERIALISED)
+      if (value->state & STATE_NOTIFY)
+        {
+          /* the marker for data from g_variant_from_data() */
+          if (value->contents.notify.callback)
+            value->contents.notify.callback (value->contents.notify.user_data);
+        }
+      else if (value->state & STATE_SERIALISED)
         {
           if (value->state & STATE_RENORMALISED ||
               !(value->state & STATE_INDEPENDENT))
             g_variant_unref (value->contents.serialised.source);
 
           if (value->state & STATE_INDEPENDENT &&
-              !(value->state & STATE_ZERO))
-            g_slice_free1 (value->size, value->contents.serialised.data);
+              !(value->state & (STATE_ZERO | STATE_INLINE |
+                                STATE_ARENA_DATA)))
+            g_variant_magazine_free (value->size,
+                                     value->contents.serialised.data);
         }
       else
         {
@@ -922,11 +2231,14 @@ g_variant_unref (GVariant *value)
           for (i = 0; i < n_children; i++)
             g_variant_unref (children[i]);
 
-          g_slice_free1 (sizeof (GVariant *) * n_children, children);
+          g_free (children);
         }
 
       /* free the structure itself */
-      g_slice_free (GVariant, value);
+      if (value->state & STATE_ARENA)
+        g_variant_arena_free_value (value);
+      else
+        g_variant_magazine_free (sizeof (GVariant), value);
     }
 }
 
@@ -961,7 +2273,7 @@ g_variant_ref_sink (GVariant *value)
   check (value);
 
   g_variant_ref (value);
-  if (g_atomic_int_compare_and_exchange (&value->floating, 1, 0))
+  if (g_variant_clear_state (value, STATE_FLOATING))
     g_variant_unref (value);
 
   return value;
@@ -977,7 +2289,7 @@ g_variant_ensure_floating (GVariant *value)
   if (value->ref_count == 1)
     /* it is exclusively ours */
     {
-      value->floating = TRUE;
+      g_variant_set_state (value, STATE_FLOATING);
 
       return value;
     }
@@ -1018,6 +2330,24 @@ g_variant_new_tree (const GVariantType  *type,
   return new;
 }
 
+static GVariant *
+g_variant_new_slice (GVariantTypeInfo *type,
+                     gpointer          slice,
+                     gsize             size,
+                     GVariantFlags     flags)
+{
+  GVariant *new;
+
+  new = g_variant_alloc (type, STATE_SERIALISED | STATE_INDEPENDENT |
+                               STATE_SIZE_KNOWN);
+
+  new->contents.serialised.source = NULL;
+  new->contents.serialised.data = slice;
+  new->size = size;
+
+  return g_variant_apply_flags (new, flags);
+}
+
 /**
  * g_variant_from_slice:
  * @type: the #GVariantType of the new variant
@@ -1039,17 +2369,8 @@ g_variant_from_slice (const GVariantType *type,
                       gsize               size,
                       GVariantFlags       flags)
 {
-  GVariant *new;
-
-  new = g_variant_alloc (g_variant_type_info_get (type),
-                         STATE_SERIALISED | STATE_INDEPENDENT |
-                         STATE_SIZE_KNOWN);
-
-  new->contents.serialised.source = NULL;
-  new->contents.serialised.data = slice;
-  new->size = size;
-
-  return g_variant_apply_flags (new, flags);
+  return g_variant_new_slice (g_variant_type_info_get (type),
+                              slice, size, flags);
 }
 
 GVariant *
@@ -1077,7 +2398,7 @@ g_variant_from_data (const GVariantType *type,
     {
       GVariant *marker;
 
-      marker = g_variant_alloc (NULL, STATE_NOTIFY);
+      marker = g_variant_alloc (NULL, STATE_NOTIFY | STATE_INDEPENDENT);
       marker->contents.notify.callback = notify;
       marker->contents.notify.user_data = user_data;
 
@@ -1091,6 +2412,74 @@ g_variant_from_data (const GVariantType *type,
     }
 }
 
+/**
+ * g_variant_map_file:
+ * @type: the #GVariantType of the new variant, or %NULL
+ * @filename: the name of the file to map
+ * @flags: zero or more #GVariantFlags
+ * @error: a #GError, or %NULL
+ * @returns: a new #GVariant instance, or %NULL on error
+ *
+ * Creates a #GVariant instance from the contents of @filename, which
+ * is mapped into memory read-only.  The mapping is kept for as long
+ * as the returned instance, or any value taken from it, exists.  The
+ * file must not be modified during that time.
+ *
+ * The mapped data is never copied unless it needs to be byteswapped
+ * or renormalised.  With %G_VARIANT_LAZY_BYTESWAP, only the parts of
+ * the data that are accessed are ever copied.  Unless
+ * %G_VARIANT_TRUSTED is given, each child is only checked for normal
+ * form when it is accessed.
+ *
+ * If @type is %NULL then the file contains a variant, as for
+ * g_variant_load().
+ *
+ * If the file can not be mapped, or if it has the wrong size for a
+ * fixed-sized @type, %NULL is returned and @error is set.
+ **/
+GVariant *
+g_variant_map_file (const GVariantType *type,
+                    const gchar        *filename,
+                    GVariantFlags       flags,
+                    GError            **error)
+{
+  GMappedFile *mapped;
+  gsize size;
+
+  mapped = g_mapped_file_new (filename, FALSE, error);
+
+  if (mapped == NULL)
+    return NULL;
+
+  size = g_mapped_file_get_length (mapped);
+
+  if (type != NULL)
+    {
+      GVariantTypeInfo *info;
+      gsize fixed_size;
+
+      info = g_variant_type_info_get (type);
+      g_variant_type_info_query (info, NULL, &fixed_size);
+      g_variant_type_info_unref (info);
+
+      if (fixed_size && size != fixed_size)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "file '%s' has a size of %lu bytes but type '%s' "
+                       "has a fixed size of %lu bytes", filename,
+                       (gulong) size, g_variant_type_peek_string (type),
+                       (gulong) fixed_size);
+          g_mapped_file_free (mapped);
+
+          return NULL;
+        }
+    }
+
+  return g_variant_from_data (type, g_mapped_file_get_contents (mapped),
+                              size, flags,
+                              (GDestroyNotify) g_mapped_file_free, mapped);
+}
+
 GVariant *
 g_variant_load (const GVariantType *type,
                 gconstpointer       data,
@@ -1111,12 +2500,27 @@ g_variant_load (const GVariantType *type,
     }
   else
     {
+      GVariantSerialised gvs;
+      guint16 byte_order = flags;
       gpointer slice;
 
-      slice = g_slice_alloc (size);
+      gvs.type = g_variant_type_info_get (type);
+      gvs.data = (gpointer) data;
+      gvs.size = size;
+
+      if (byte_order == 0)
+        byte_order = G_BYTE_ORDER;
+
+      new = g_variant_new_inline (gvs, byte_order == G_BYTE_ORDER,
+                                  flags & G_VARIANT_TRUSTED);
+
+      if (new != NULL)
+        return new;
+
+      slice = g_variant_magazine_alloc (size);
       memcpy (slice, data, size);
 
-      return g_variant_from_slice (type, slice, size, flags);
+      return g_variant_new_slice (gvs.type, slice, size, flags);
     }
 }
 
@@ -1228,8 +2632,95 @@ g_variant_assert_invariant (GVariant *value)
 #endif
 }
 
+/**
+ * g_variant_get_stats:
+ * @stats: a #GVariantStats to fill in
+ *
+ * Gets counters describing the work done by this library since it was
+ * loaded (or since the last call to g_variant_reset_stats()).  The
+ * counters are shared by all threads.
+ *
+ * @bytes_byteswapped is the total size of all of the values that have
+ * been converted to machine byte order.
+ *
+ * @magazine_hits is the number of allocations of #GVariant structures
+ * and small serialised data that were served from the allocating
+ * thread's own cache of free blocks, and @magazine_misses the number
+ * that were not.  @magazine_exchanges is the number of times that a
+ * thread handed a full cache to another thread, or took one.  These
+ * are mostly high when values are created and freed by different
+ * threads.  The magazine counters of other threads are only added up
+ * now and then, so they may lag behind slightly.
+ *
+ * @type_cache_hits is the number of times that the type of the child
+ * of a serialised variant was found in the thread's cache of recently
+ * seen type strings, and @type_cache_misses the number of times that
+ * it had to be parsed and looked up.  These lag behind in the same way.
+ **/
+void
+g_variant_get_stats (GVariantStats *stats)
+{
+  GVariantMagazines *mags;
+
+  if ((mags = g_static_private_get (&g_variant_magazines)))
+    g_variant_magazines_flush (mags);
+
+  stats->bytes_byteswapped =
+    g_atomic_int_get (&g_variant_stats_bytes_byteswapped);
+  stats->magazine_hits =
+    g_atomic_int_get (&g_variant_stats_magazine_hits);
+  stats->magazine_misses =
+    g_atomic_int_get (&g_variant_stats_magazine_misses);
+  stats->magazine_exchanges =
+    g_atomic_int_get (&g_variant_stats_magazine_exchanges);
+  g_variant_type_info_cache_stats (&stats->type_cache_hits,
+                                   &stats->type_cache_misses, FALSE);
+}
+
+/**
+ * g_variant_reset_stats:
+ *
+ * Sets all of the counters returned by g_variant_get_stats() to zero.
+ **/
+void
+g_variant_reset_stats (void)
+{
+  GVariantMagazines *mags;
+
+  if ((mags = g_static_private_get (&g_variant_magazines)))
+    g_variant_magazines_flush (mags);
+
+  g_atomic_int_set (&g_variant_stats_bytes_byteswapped, 0);
+  g_atomic_int_set (&g_variant_stats_magazine_hits, 0);
+  g_atomic_int_set (&g_variant_stats_magazine_misses, 0);
+  g_atomic_int_set (&g_variant_stats_magazine_exchanges, 0);
+  g_variant_type_info_cache_stats (NULL, NULL, TRUE);
+}
+
 gboolean
 g_variant_is_trusted (GVariant *value)
 {
-  return !!(value->state & STATE_TRUSTED);
+  return !!(g_variant_get_state (value) & STATE_TRUSTED);
+}
+
+/* private
+ *
+ * If @value is serialised, trusted and in native byte order then its
+ * children can be read straight out of its data without any further
+ * checks.  In that case, stores the serialised form of @value in @gvs
+ * and returns %TRUE.  The data remains valid for as long as @value
+ * exists.
+ */
+gboolean
+g_variant_get_trusted_gvs (GVariant           *value,
+                           GVariantSerialised *gvs)
+{
+  const guint required = STATE_SERIALISED | STATE_NATIVE | STATE_TRUSTED;
+
+  if ((g_variant_get_state (value) & required) != required)
+    return FALSE;
+
+  *gvs = g_variant_get_gvs (value, NULL, NULL);
+
+  return TRUE;
 }
@@ -21,6 +21,23 @@ typedef enum
   G_VARIANT_LAZY_BYTESWAP       = 0x00020000,
 } GVariantFlags;
 
+typedef gboolean (*GVariantWriteFunc) (gconstpointer   data,
+                                       gsize           size,
+                                       gpointer        user_data,
+                                       GError        **error);
+
+typedef struct
+{
+  guint bytes_byteswapped;
+
+  guint magazine_hits;
+  guint magazine_misses;
+  guint magazine_exchanges;
+
+  guint type_cache_hits;
+  guint type_cache_misses;
+} GVariantStats;
+
 GVariant                       *g_variant_load                          (const GVariantType *type,
                                                                          gconstpointer       data,
                                                                          gsize               size,
@@ -35,14 +52,28 @@ GVariant                       *g_variant_from_data                     (const G
                                                                          GVariantFlags       flags,
                                                                          GDestroyNotify      notify,
                                                                          gpointer            user_data);
+GVariant                       *g_variant_map_file                      (const GVariantType *type,
+                                                                         const gchar        *filename,
+                                                                         GVariantFlags       flags,
+                                                                         GError            **error);
 
 void                            g_variant_store                         (GVariant           *value,
                                                                          gpointer            data);
+gboolean                        g_variant_store_stream                  (GVariant           *value,
+                                                                         GVariantWriteFunc   write_func,
+                                                                         gpointer            user_data,
+                                                                         GError            **error);
+gboolean                        g_variant_store_file                    (GVariant           *value,
+                                                                         const gchar        *filename,
+                                                                         GError            **error);
 gconstpointer                   g_variant_get_data                      (GVariant           *value);
 gsize                           g_variant_get_size                      (GVariant           *value);
 
 void                            g_variant_normalise                     (GVariant           *value);
 
+void                            g_variant_get_stats                     (GVariantStats      *stats);
+void                            g_variant_reset_stats                   (void);
+
 #pragma GCC visibility pop
 
 #endif /* _gvariant_loadstore_h_ */
@@ -12,9 +12,17 @@
 #define _gvariant_private_h_
 
 #include "gvariant-loadstore.h"
+#include "gvariant-serialiser.h"
 #include "gvarianttypeinfo.h"
 
+typedef struct OPAQUE_TYPE__GVariantArena GVariantArena;
+
 /* gvariant-core.c */
+GVariantArena                  *g_variant_arena_new                     (void);
+GVariantArena                  *g_variant_arena_ref                     (GVariantArena       *arena);
+void                            g_variant_arena_unref                   (GVariantArena       *arena);
+GVariantArena                  *g_variant_arena_push                    (GVariantArena       *arena);
+void                            g_variant_arena_pop                     (GVariantArena       *previous);
 GVariant                       *g_variant_new_tree                      (const GVariantType  *type,
                                                                          GVariant           **children,
                                                                          gsize                n_children,
@@ -22,7 +30,14 @@ GVariant                       *g_variant_new_tree                      (const G
 void                            g_variant_ensure_native_endian          (GVariant            *value);
 void                            g_variant_assert_invariant              (GVariant            *value);
 gboolean                        g_variant_is_trusted                    (GVariant            *value);
+gboolean                        g_variant_get_trusted_gvs               (GVariant            *value,
+                                                                         GVariantSerialised  *gvs);
 GVariant                       *g_variant_ensure_floating               (GVariant            *value);
 void                            g_variant_dump_data                     (GVariant            *value);
 
+/* gvariant-util.c */
+GVariantArena                  *g_variant_builder_get_arena             (GVariantBuilder     *builder);
+gpointer                        g_variant_builder_append_fixed          (GVariantBuilder     *builder,
+                                                                         const GVariantType  *type);
+
 #endif /* _gvariant_private_h_ */
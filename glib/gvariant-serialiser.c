@@ -9,6 +9,7 @@
  */
 
 #include "gvariant-serialiser.h"
+#include "gvariant-vector.h"
 
 #include <glib/gtestutils.h>
 
@@ -61,84 +62,160 @@ g_variant_serialiser_offset_size (GVariantSerialised container)
   return 8;
 }
 
-#define do_case(_ofs_size, body) \
-  {                                                             \
-    guint offset_size = (_ofs_size);                            \
-    body                                                        \
-  }
-
-#define check_case(max, _ofs_size, body) \
-  if (container.size <= max)                                    \
-    do_case (_ofs_size, body)
-
-#define check_cases(init_val, zero_case, else_case, use_val) \
-  G_STMT_START {                                                \
-    guchar *bytes;                                              \
-    union                                                       \
-    {                                                           \
-      guchar bytes[GLIB_SIZEOF_SIZE_T];                         \
-      gsize integer;                                            \
-    } tmpvalue;                                                 \
-                                                                \
-    bytes = container.data + container.size;                    \
-    tmpvalue.integer = init_val;                                \
-                                                                \
-    if (container.size == 0) { zero_case }                      \
-    else check_case (G_MAXUINT8, 1, else_case)                  \
-    else check_case (G_MAXUINT16, 2, else_case)                 \
-    else check_case (G_MAXUINT32, 4, else_case)                 \
-    else do_case (8, else_case)                                 \
-    use_val;                                                    \
-  } G_STMT_END
-
 static gboolean
 g_variant_serialiser_dereference (GVariantSerialised container,
                                   gsize              index,
                                   gsize             *result)
 {
-  check_cases (0,,
-               {
-                 if (index >= container.size / offset_size)
-                   return FALSE;
+  guint offset_size;
+
+  offset_size = g_variant_serialiser_offset_size (container);
 
-                 bytes -= (index + 1) * offset_size;
-                 memcpy (tmpvalue.bytes, bytes, offset_size);
-               },
-               *result = GSIZE_TO_LE (tmpvalue.integer));
+  if (offset_size == 0 || index >= container.size / offset_size)
+    return FALSE;
+
+  *result = g_variant_serialiser_read_offset (container.data +
+                                              container.size -
+                                              (index + 1) * offset_size,
+                                              offset_size);
 
   return G_LIKELY (*result <= container.size);
 }
 
-static gboolean
-g_variant_serialiser_array_length (GVariantSerialised  container,
-                                   gsize              *length_ret)
+/*
+ * g_variant_serialised_array_length:
+ * @container: a #GVariantSerialised array
+ * @length: the number of items in the array
+ * @offset_size: the size of each entry in the offset table
+ * @returns: %FALSE if the array is malformed
+ *
+ * Decodes the information that is needed to randomly access the items
+ * of an array.  For arrays of fixed-sized items, @offset_size is set
+ * to zero.  The results may be kept by the caller and passed to
+ * g_variant_serialised_array_child() any number of times, avoiding the
+ * need to decode them again for each item.
+ */
+gboolean
+g_variant_serialised_array_length (GVariantSerialised  container,
+                                   gsize              *length,
+                                   guint              *offset_size)
 {
-  gsize divider;
+  gsize fixed_size;
+
+  *offset_size = 0;
+  *length = 0;
+
+  /* an array with a length of zero always has a size of zero.
+   * an array with a size of zero always has a length of zero.
+   */
+  if (container.size == 0)
+    return TRUE;
+
+  g_variant_type_info_query_element (container.type, NULL, &fixed_size);
 
-  check_cases (0, g_assert_not_reached ();,
-               {
-                 bytes -= offset_size;
-                 memcpy (tmpvalue.bytes, bytes, offset_size);
-                 divider = offset_size;
-               },
-               {
-                 gsize length;
+  if (fixed_size)
+    {
+      if G_UNLIKELY (container.size % fixed_size > 0)
+        return FALSE;
 
-                 length = GSIZE_TO_LE (tmpvalue.integer);
+      *length = container.size / fixed_size;
+    }
+  else
+    /* case where array contains variable-sized elements
+     * or fixed-size elements of size 0 (treated as variable)
+     */
+    {
+      gsize boundary;
+      guint size;
 
-                 if (length > container.size)
-                   return FALSE;
+      size = g_variant_serialiser_offset_size (container);
+      boundary = g_variant_serialiser_read_offset (container.data +
+                                                   container.size - size,
+                                                   size);
 
-                 length = container.size - length;
-                 if G_UNLIKELY (length % divider != 0)
-                   return FALSE;
+      if G_UNLIKELY (boundary > container.size ||
+                     (container.size - boundary) % size != 0)
+        return FALSE;
 
-                 *length_ret = length / divider;
-               });
+      *length = (container.size - boundary) / size;
+      *offset_size = size;
+    }
 
   return TRUE;
 }
 
+/*
+ * g_variant_serialised_array_child:
+ * @container: a #GVariantSerialised array
+ * @length: the length from g_variant_serialised_array_length()
+ * @offset_size: the offset size from g_variant_serialised_array_length()
+ * @index: the index of the child to fetch
+ * @returns: a #GVariantSerialised for the child
+ *
+ * Extracts a child from a serialised array given the result of a
+ * previous call to g_variant_serialised_array_length().  This is O(1)
+ * and involves no decoding beyond the two offsets of the child itself.
+ *
+ * The same error cases apply as for g_variant_serialised_get_child().
+ */
+GVariantSerialised
+g_variant_serialised_array_child (GVariantSerialised container,
+                                  gsize              length,
+                                  guint              offset_size,
+                                  gsize              index)
+{
+  GVariantSerialised child;
+  gsize fixed_size;
+  guint alignment;
+
+  if G_UNLIKELY (index >= length)
+    g_error ("Attempt to access item %d in a container with only %d items",
+             index, length);
+
+  child.type = g_variant_type_info_element (container.type);
+  g_variant_type_info_ref (child.type);
+
+  if (offset_size == 0)
+    {
+      g_variant_type_info_query (child.type, NULL, &fixed_size);
+
+      child.data = container.data + fixed_size * index;
+      child.size = fixed_size;
+    }
+  else
+    {
+      const guchar *offsets;
+      gsize start, end;
+
+      g_variant_type_info_query (child.type, &alignment, NULL);
+      offsets = container.data + container.size - length * offset_size;
+
+      if (index)
+        start = g_variant_serialiser_read_offset (offsets +
+                                                  (index - 1) * offset_size,
+                                                  offset_size);
+      else
+        start = 0;
+
+      end = g_variant_serialiser_read_offset (offsets + index * offset_size,
+                                              offset_size);
+
+      start += (-start) & alignment;
+
+      if (start < end && end <= container.size)
+        {
+          child.data = container.data + start;
+          child.size = end - start;
+        }
+      else
+        {
+          child.data = NULL;
+          child.size = 0;
+        }
+    }
+
+  return child;
+}
 
 gsize
 g_variant_serialised_n_children (GVariantSerialised container)
@@ -173,36 +250,14 @@ g_variant_serialised_n_children (GVariantSerialised container)
 
     case G_VARIANT_TYPE_CLASS_ARRAY:
       {
-        gsize fixed_size;
-
-        /* an array with a length of zero always has a size of zero.
-         * an array with a size of zero always has a length of zero.
-         */
-        if (container.size == 0)
-          return 0;
-
-        g_variant_type_info_query_element (container.type, NULL, &fixed_size);
-
-        if (!fixed_size)
-          /* case where array contains variable-sized elements
-           * or fixed-size elements of size 0 (treated as variable)
-           */
-          {
-            gsize length;
-
-            if G_UNLIKELY (!g_variant_serialiser_array_length (container, &length))
-              break;
+        guint offset_size;
+        gsize length;
 
-            return length;
-         }
-        else
-          /* case where array contains fixed-sized elements */
-          {
-            if G_UNLIKELY (container.size % fixed_size > 0)
-              break;
+        if G_UNLIKELY (!g_variant_serialised_array_length (container, &length,
+                                                           &offset_size))
+          break;
 
-            return container.size / fixed_size;
-          }
+        return length;
       }
 
     default:
@@ -251,31 +306,21 @@ g_variant_serialised_get_child (GVariantSerialised container,
          * 1) we found a '\0'.   ((good.))
          * 2) we hit the start.  ((only good if there's a '\0' there))
          */
-        if (container.data[child.size] == '\0')
+        if (container.size && container.data[child.size] == '\0')
           {
-            gchar *str = (gchar *) container.data + child.size + 1;
+            const gchar *str = (gchar *) container.data + child.size + 1;
+            gsize length = container.size - child.size - 1;
 
             /* in the case that we're accessing a shared memory buffer,
-             * someone could change the  string under us and cause us
-             * to access out-of-bounds memory.
-             *
-             * if we carefully make our own copy then we avoid that.
+             * someone could change the string under us, so it is only
+             * ever looked at by way of the (careful) per-thread cache.
              */
-            str = g_strndup (str, container.size - child.size - 1);
-            if (g_variant_type_string_is_valid (str))
-              child.type = g_variant_type_info_get (G_VARIANT_TYPE (str));
-
-            g_free (str);
+            child.type = g_variant_type_info_get_for_string (str, length);
           }
 
+        /* no valid type: the child is the unit, filled in below */
         if G_UNLIKELY (child.type == NULL)
-          {
-            child.type = NULL;
-            child.data = NULL;
-            child.size = 0;
-
-            return child;
-          }
+          child.type = g_variant_type_info_get (G_VARIANT_TYPE_UNIT);
 
         {
           gsize fixed_size;
@@ -329,71 +374,16 @@ g_variant_serialised_get_child (GVariantSerialised container,
 
     case G_VARIANT_TYPE_CLASS_ARRAY:
       {
-        GVariantSerialised child;
-        gsize fixed_size;
-        guint alignment;
-
-        child.type = g_variant_type_info_element (container.type);
-        g_variant_type_info_ref (child.type);
-
-        g_variant_type_info_query (child.type, &alignment, &fixed_size);
-
-        if (fixed_size)
-          {
-            if G_UNLIKELY (container.size % fixed_size != 0 ||
-                           fixed_size * (index + 1) > container.size)
-              break;
-           
-            child.data = container.data + fixed_size * index;
-            child.size = fixed_size; 
-
-            return child;
-          }
-
-        else
-          {
-            gsize boundary = 0, start = 0, end = 0;
-            guint offset_size;
-
-            offset_size = g_variant_serialiser_offset_size (container);
-            memcpy (&boundary,
-                    container.data + container.size - offset_size,
-                    offset_size);
-            boundary = GSIZE_FROM_LE (boundary);
-            
-            if G_UNLIKELY (boundary > container.size ||
-                          (container.size - boundary) % offset_size ||
-                          boundary + index * offset_size >= container.size)
-              break;
-
-            if (index)
-              {
-                memcpy (&start,
-                        container.data + boundary + (index - 1) * offset_size,
-                        offset_size);
-                start = GSIZE_FROM_LE (start);
-              }
-
-            memcpy (&end,
-                    container.data + boundary + index * offset_size,
-                    offset_size);
-            end = GSIZE_FROM_LE (end);
-
-            start += (-start) & alignment;
+        guint offset_size;
+        gsize length;
 
-            if (start < end && end <= container.size)
-              {
-                child.data = container.data + start;
-                child.size = end - start;
-              }
-            else
-              {
-                child.data = NULL;
-                child.size = 0;
-              }
-          }
+        if G_UNLIKELY (!g_variant_serialised_array_length (container, &length,
+                                                           &offset_size) ||
+                       index >= length)
+          break;
 
-        return child;
+        return g_variant_serialised_array_child (container, length,
+                                                 offset_size, index);
       }
 
     case G_VARIANT_TYPE_CLASS_STRUCT:
@@ -420,10 +410,11 @@ g_variant_serialised_get_child (GVariantSerialised container,
             if (offset_size * (info->i + 1) > container.size)
               return child;
 
-            memcpy (&start,
-                    container.data + container.size - offset_size * (info->i + 1),
-                    offset_size);
-            start = GSIZE_FROM_LE (start);
+            start = g_variant_serialiser_read_offset (container.data +
+                                                      container.size -
+                                                      offset_size *
+                                                      (info->i + 1),
+                                                      offset_size);
           }
 
         start += info->a;
@@ -445,10 +436,11 @@ g_variant_serialised_get_child (GVariantSerialised container,
             if (offset_size * (info->i + 2) > container.size)
               return child;
 
-            memcpy (&end,
-                    container.data + container.size - offset_size * (info->i + 2),
-                    offset_size);
-            end = GSIZE_FROM_LE (end);
+            end = g_variant_serialiser_read_offset (container.data +
+                                                    container.size -
+                                                    offset_size *
+                                                    (info->i + 2),
+                                                    offset_size);
           }
 
         if (start < end && end <= container.size)
@@ -663,105 +655,416 @@ g_variant_serialiser_serialise (GVariantSerialised        container,
   }
 }
 
-gsize
-g_variant_serialiser_needed_size (GVariantTypeInfo         *type,
-                                  GVariantSerialisedFiller  gvs_filler,
-                                  const gpointer           *children,
-                                  gsize                     n_children)
+/* == streaming ==
+ *
+ * Every part of a serialised value is written in order from start to
+ * finish: the content of a container comes first and its offsets are
+ * at the end.  Since the size of each child is known before it is
+ * written (from the size-only form of the filler callback) the exact
+ * same bytes as g_variant_serialiser_serialise() produces can be sent
+ * to a sink in one pass, holding only the offsets of the containers
+ * that are currently open.
+ */
+#define G_VARIANT_SERIALISER_SINK_BUFFER 65536
+
+static const guchar g_variant_serialiser_zeros[8];
+
+/*
+ * g_variant_serialiser_sink_init:
+ * @sink: a #GVariantSerialiserSink
+ * @write_func: the function to pass the data to
+ * @user_data: user data for @write_func
+ * @error: the #GError for @write_func, or %NULL
+ *
+ * Prepares @sink for use.  Small writes are collected in a buffer so
+ * that @write_func is called with reasonably sized chunks.
+ * g_variant_serialiser_sink_finish() must be called afterwards.
+ */
+void
+g_variant_serialiser_sink_init (GVariantSerialiserSink       *sink,
+                                GVariantSerialiserWriteFunc   write_func,
+                                gpointer                      user_data,
+                                GError                      **error)
 {
-  switch (g_variant_type_info_get_type_class (type))
+  sink->write_func = write_func;
+  sink->user_data = user_data;
+  sink->error = error;
+  sink->buffer = g_malloc (G_VARIANT_SERIALISER_SINK_BUFFER);
+  sink->buffered = 0;
+  sink->position = 0;
+  sink->failed = FALSE;
+}
+
+static gboolean
+g_variant_serialiser_sink_flush (GVariantSerialiserSink *sink)
+{
+  if (sink->buffered && !sink->failed)
+    sink->failed = !sink->write_func (sink->buffer, sink->buffered,
+                                      sink->user_data, sink->error);
+  sink->buffered = 0;
+
+  return !sink->failed;
+}
+
+/*
+ * g_variant_serialiser_sink_write:
+ * @sink: a #GVariantSerialiserSink
+ * @data: the data to write
+ * @size: the size of @data
+ * @returns: %FALSE if a previous write has failed
+ *
+ * Writes @size bytes from @data to @sink.  Once a write has failed,
+ * all further writes are ignored.
+ */
+gboolean
+g_variant_serialiser_sink_write (GVariantSerialiserSink *sink,
+                                 gconstpointer           data,
+                                 gsize                   size)
+{
+  sink->position += size;
+
+  if (sink->failed)
+    return FALSE;
+
+  if (sink->buffered + size <= G_VARIANT_SERIALISER_SINK_BUFFER)
+    {
+      memcpy (sink->buffer + sink->buffered, data, size);
+      sink->buffered += size;
+
+      return TRUE;
+    }
+
+  /* big enough to skip the buffer */
+  if (!g_variant_serialiser_sink_flush (sink))
+    return FALSE;
+
+  if (size >= G_VARIANT_SERIALISER_SINK_BUFFER)
+    {
+      sink->failed = !sink->write_func (data, size, sink->user_data,
+                                        sink->error);
+      return !sink->failed;
+    }
+
+  memcpy (sink->buffer, data, size);
+  sink->buffered = size;
+
+  return TRUE;
+}
+
+/*
+ * g_variant_serialiser_sink_finish:
+ * @sink: a #GVariantSerialiserSink
+ * @returns: %TRUE if all of the data was written
+ *
+ * Writes any buffered data and frees the buffer.
+ */
+gboolean
+g_variant_serialiser_sink_finish (GVariantSerialiserSink *sink)
+{
+  gboolean success;
+
+  success = g_variant_serialiser_sink_flush (sink);
+  g_free (sink->buffer);
+
+  return success;
+}
+
+static void
+g_variant_serialiser_sink_pad (GVariantSerialiserSink *sink,
+                               gsize                   start,
+                               guint                   alignment)
+{
+  g_variant_serialiser_sink_write (sink, g_variant_serialiser_zeros,
+                                   (-(sink->position - start)) & alignment);
+}
+
+/*
+ * g_variant_serialiser_stream:
+ * @container: the type and size of the container to write
+ * @gvs_filler: the filler, only ever called to get the size of a child
+ * @gvs_streamer: writes a child to the sink
+ * @children: the children of the container
+ * @n_children: the number of children
+ * @sink: the #GVariantSerialiserSink to write to
+ * @returns: %FALSE if writing to @sink failed
+ *
+ * Writes the same data to @sink as g_variant_serialiser_serialise()
+ * would write to @container.data.  @container.data is ignored.
+ */
+gboolean
+g_variant_serialiser_stream (GVariantSerialised          container,
+                             GVariantSerialisedFiller    gvs_filler,
+                             GVariantSerialisedStreamer  gvs_streamer,
+                             const gpointer             *children,
+                             gsize                       n_children,
+                             GVariantSerialiserSink     *sink)
+{
+  gsize start = sink->position;
+
+  switch (g_variant_type_info_get_type_class (container.type))
   {
     case G_VARIANT_TYPE_CLASS_VARIANT:
       {
-        GVariantSerialised child = {};
+        GVariantSerialised child = { NULL, NULL, 0 };
         const gchar *type_string;
 
         g_assert_cmpint (n_children, ==, 1);
+
         gvs_filler (&child, children[0]);
+        gvs_streamer (children[0], sink);
 
         type_string = g_variant_type_info_get_string (child.type);
-
-        return child.size + 1 + strlen (type_string);
+        g_variant_serialiser_sink_write (sink, "", 1);
+        g_variant_serialiser_sink_write (sink, type_string,
+                                         strlen (type_string));
+        break;
       }
 
     case G_VARIANT_TYPE_CLASS_MAYBE:
       {
-        GVariantSerialised child = { g_variant_type_info_element (type) };
-        gsize fixed_size;
-
-        g_assert_cmpint (n_children, <=, 1);
-
-        if (n_children == 0)
-          return 0;
+        g_assert_cmpint (n_children, ==, (container.size > 0));
 
-        gvs_filler (&child, children[0]);
-        g_variant_type_info_query (child.type, NULL, &fixed_size);
+        if (n_children)
+          {
+            gsize fixed_size;
 
-        if (fixed_size)
-          /* double check */
-          g_assert (child.size == fixed_size);
-        else
-          /* room for the padding byte */
-          child.size++;
+            g_variant_type_info_query_element (container.type, NULL,
+                                               &fixed_size);
+            gvs_streamer (children[0], sink);
 
-        return child.size;
+            if (!fixed_size)
+              g_variant_serialiser_sink_write (sink, "", 1);
+          }
+        break;
       }
 
     case G_VARIANT_TYPE_CLASS_ARRAY:
       {
-        GVariantTypeInfo *elem_type;
-        gsize fixed_size;
-        guint alignment;
-
-        if (n_children == 0)
-          return 0;
-
-        elem_type = g_variant_type_info_element (type);
-        g_variant_type_info_query (elem_type, &alignment, &fixed_size);
+        g_assert_cmpint ((n_children > 0), ==, (container.size > 0));
 
-        if (!fixed_size)
+        if (n_children)
           {
-            gsize offset;
+            GVariantTypeInfo *elem_type;
+            guint offset_size, alignment;
+            guchar *offsets = NULL;
+            gsize content_end;
+            gsize fixed_size;
             gsize i;
 
-            offset = 0;
+            elem_type = g_variant_type_info_element (container.type);
+            g_variant_type_info_query (elem_type, &alignment, &fixed_size);
+            offset_size = g_variant_serialiser_offset_size (container);
+            content_end = container.size;
+
+            /* the only part of the array that is held in memory */
+            if (!fixed_size)
+              {
+                offsets = g_malloc (offset_size * n_children);
+                content_end -= offset_size * n_children;
+              }
 
             for (i = 0; i < n_children; i++)
               {
-                GVariantSerialised child = {};
+                GVariantSerialised child = { NULL, NULL, 0 };
 
                 gvs_filler (&child, children[i]);
                 g_assert (child.type == elem_type);
 
-                if (child.size)
-                  offset += (-offset) & alignment;
-                offset += child.size;
+                /* even empty items are aligned, except at the end */
+                if (sink->position - start < content_end)
+                  g_variant_serialiser_sink_pad (sink, start, alignment);
+
+                gvs_streamer (children[i], sink);
+
+                if (!fixed_size)
+                  {
+                    gsize offset = GSIZE_TO_LE (sink->position - start);
+                    memcpy (offsets + i * offset_size, &offset, offset_size);
+                  }
               }
 
-            return g_variant_serialiser_determine_size (offset,
-                                                        n_children,
-                                                        TRUE);
+            if (!fixed_size)
+              {
+                g_variant_serialiser_sink_write (sink, offsets,
+                                                 offset_size * n_children);
+                g_free (offsets);
+              }
           }
-        else
-          return fixed_size * n_children;
+        break;
       }
 
     case G_VARIANT_TYPE_CLASS_STRUCT:
     case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
       {
-        gsize n_offsets;
-        gsize offset;
-        gsize i;
+        if (n_children)
+          {
+            const GVariantMemberInfo *info;
+            guchar offsets[64], *heap_offsets = NULL;
+            guchar *offsets_ptr;
+            gsize n_offsets, i;
+            guint offset_size;
+            guint alignment;
+            gsize fixed_size;
 
-        g_assert_cmpint (g_variant_type_info_n_members (type), ==, n_children);
+            info = g_variant_type_info_member_info (container.type, 0);
+            offset_size = g_variant_serialiser_offset_size (container);
+            n_offsets = info[n_children - 1].i + 1;
 
-        {
-          gsize fixed_size;
+            /* the offsets are stored in reverse order at the end */
+            if (n_offsets * offset_size > sizeof offsets)
+              offsets_ptr = heap_offsets = g_malloc (n_offsets * offset_size);
+            else
+              offsets_ptr = offsets;
+            offsets_ptr += n_offsets * offset_size;
 
-          g_variant_type_info_query (type, NULL, &fixed_size);
+            for (i = 0; i < n_children; i++)
+              {
+                GVariantSerialised child = { info[i].type, NULL, 0 };
 
-          if (fixed_size)
-            return fixed_size;
+                g_variant_type_info_query (child.type, &alignment,
+                                           &fixed_size);
+                gvs_filler (&child, children[i]);
+
+                if (child.size)
+                  g_variant_serialiser_sink_pad (sink, start, alignment);
+
+                gvs_streamer (children[i], sink);
+
+                if (!fixed_size && i != n_children - 1)
+                  {
+                    gsize offset = GSIZE_TO_LE (sink->position - start);
+
+                    offsets_ptr -= offset_size;
+                    memcpy (offsets_ptr, &offset, offset_size);
+                  }
+              }
+
+            g_variant_type_info_query (container.type, &alignment,
+                                       &fixed_size);
+
+            if (fixed_size)
+              g_variant_serialiser_sink_pad (sink, start, alignment);
+
+            g_variant_serialiser_sink_write (sink, offsets_ptr,
+                                             n_offsets * offset_size);
+            g_free (heap_offsets);
+          }
+        else
+          /* () */
+          g_variant_serialiser_sink_write (sink, "", 1);
+
+        break;
+      }
+
+    default:
+      g_assert_not_reached ();
+  }
+
+  /* make sure that it all adds up */
+  g_assert_cmpint (sink->position - start, ==, container.size);
+
+  return !sink->failed;
+}
+
+gsize
+g_variant_serialiser_needed_size (GVariantTypeInfo         *type,
+                                  GVariantSerialisedFiller  gvs_filler,
+                                  const gpointer           *children,
+                                  gsize                     n_children)
+{
+  switch (g_variant_type_info_get_type_class (type))
+  {
+    case G_VARIANT_TYPE_CLASS_VARIANT:
+      {
+        GVariantSerialised child = {};
+        const gchar *type_string;
+
+        g_assert_cmpint (n_children, ==, 1);
+        gvs_filler (&child, children[0]);
+
+        type_string = g_variant_type_info_get_string (child.type);
+
+        return child.size + 1 + strlen (type_string);
+      }
+
+    case G_VARIANT_TYPE_CLASS_MAYBE:
+      {
+        GVariantSerialised child = { g_variant_type_info_element (type) };
+        gsize fixed_size;
+
+        g_assert_cmpint (n_children, <=, 1);
+
+        if (n_children == 0)
+          return 0;
+
+        gvs_filler (&child, children[0]);
+        g_variant_type_info_query (child.type, NULL, &fixed_size);
+
+        if (fixed_size)
+          /* double check */
+          g_assert (child.size == fixed_size);
+        else
+          /* room for the padding byte */
+          child.size++;
+
+        return child.size;
+      }
+
+    case G_VARIANT_TYPE_CLASS_ARRAY:
+      {
+        GVariantTypeInfo *elem_type;
+        gsize fixed_size;
+        guint alignment;
+
+        if (n_children == 0)
+          return 0;
+
+        elem_type = g_variant_type_info_element (type);
+        g_variant_type_info_query (elem_type, &alignment, &fixed_size);
+
+        if (!fixed_size)
+          {
+            gsize offset;
+            gsize i;
+
+            offset = 0;
+
+            for (i = 0; i < n_children; i++)
+              {
+                GVariantSerialised child = {};
+
+                gvs_filler (&child, children[i]);
+                g_assert (child.type == elem_type);
+
+                if (child.size)
+                  offset += (-offset) & alignment;
+                offset += child.size;
+              }
+
+            return g_variant_serialiser_determine_size (offset,
+                                                        n_children,
+                                                        TRUE);
+          }
+        else
+          return fixed_size * n_children;
+      }
+
+    case G_VARIANT_TYPE_CLASS_STRUCT:
+    case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
+      {
+        gsize n_offsets;
+        gsize offset;
+        gsize i;
+
+        g_assert_cmpint (g_variant_type_info_n_members (type), ==, n_children);
+
+        {
+          gsize fixed_size;
+
+          g_variant_type_info_query (type, NULL, &fixed_size);
+
+          if (fixed_size)
+            return fixed_size;
         }
 
         n_offsets = 0;
@@ -810,11 +1113,171 @@ g_variant_serialiser_needed_size (GVariantTypeInfo         *type,
   }
 }
 
+/* == byteswapping ==
+ *
+ * The integers inside of a fixed-sized type are always at the same
+ * offsets, so a swap plan listing runs of same-sized integers is built
+ * once from the type info and then applied to each item.  This avoids
+ * visiting the children of fixed-sized structures and arrays one at a
+ * time.  Where the plan is a single run covering the entire item (as
+ * for 'at' or 'a(iiu)') the whole array is swapped as one run by the
+ * vector code.
+ */
+#define G_VARIANT_SWAP_MAX_RUNS 32
+
+typedef struct
+{
+  gsize offset;
+  gsize count;
+  guint size;
+} GVariantSwapRun;
+
+typedef struct
+{
+  GVariantSwapRun runs[G_VARIANT_SWAP_MAX_RUNS];
+  guint n_runs;
+} GVariantSwapPlan;
+
+/* adds the integers of the fixed-sized @type at @base to @plan.
+ * returns %FALSE if the plan has too many runs.
+ */
+static gboolean
+g_variant_swap_plan_add (GVariantSwapPlan *plan,
+                         GVariantTypeInfo *type,
+                         gsize             base)
+{
+  GVariantSwapRun *run;
+  gsize fixed_size;
+  guint alignment;
+
+  g_variant_type_info_query (type, &alignment, &fixed_size);
+  if (!alignment)
+    return TRUE;
+
+  switch (g_variant_type_info_get_type_class (type))
+  {
+    case G_VARIANT_TYPE_CLASS_STRUCT:
+    case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
+      {
+        gsize n_members, i;
+
+        n_members = g_variant_type_info_n_members (type);
+        for (i = 0; i < n_members; i++)
+          {
+            const GVariantMemberInfo *info;
+            gsize start;
+
+            info = g_variant_type_info_member_info (type, i);
+            start = ((info->a & info->b) | info->c);
+
+            if (!g_variant_swap_plan_add (plan, info->type, base + start))
+              return FALSE;
+          }
+
+        return TRUE;
+      }
+
+    default:
+      g_assert_cmpint (alignment + 1, ==, fixed_size);
+      break;
+  }
+
+  /* extend the previous run if this integer directly follows it */
+  if (plan->n_runs)
+    {
+      run = &plan->runs[plan->n_runs - 1];
+
+      if (run->size == fixed_size &&
+          run->offset + run->count * run->size == base)
+        {
+          run->count++;
+          return TRUE;
+        }
+    }
+
+  if (plan->n_runs == G_VARIANT_SWAP_MAX_RUNS)
+    return FALSE;
+
+  run = &plan->runs[plan->n_runs++];
+  run->offset = base;
+  run->count = 1;
+  run->size = fixed_size;
+
+  return TRUE;
+}
+
+static void
+g_variant_swap_run (guchar *data,
+                    gsize   count,
+                    guint   size)
+{
+  gsize i;
+
+  switch (size)
+  {
+    case 2:
+      for (i = 0; i < count; i++)
+        {
+          guint16 *ptr = (guint16 *) data + i;
+          *ptr = GUINT16_SWAP_LE_BE (*ptr);
+        }
+      break;
+
+    case 4:
+      for (i = 0; i < count; i++)
+        {
+          guint32 *ptr = (guint32 *) data + i;
+          *ptr = GUINT32_SWAP_LE_BE (*ptr);
+        }
+      break;
+
+    case 8:
+      for (i = 0; i < count; i++)
+        {
+          guint64 *ptr = (guint64 *) data + i;
+          *ptr = GUINT64_SWAP_LE_BE (*ptr);
+        }
+      break;
+
+    default:
+      g_assert_not_reached ();
+  }
+}
+
+/* swaps @n_items consecutive items of @item_size according to @plan */
+static void
+g_variant_swap_plan_apply (const GVariantSwapPlan *plan,
+                           guchar                 *data,
+                           gsize                   n_items,
+                           gsize                   item_size)
+{
+  const GVariantSwapRun *run = plan->runs;
+  gsize i, j;
+
+  if (plan->n_runs == 0)
+    return;
+
+  if (plan->n_runs == 1 && run->offset == 0 &&
+      run->count * run->size == item_size)
+    {
+      g_variant_vector_byteswap (data, n_items * run->count, run->size);
+      return;
+    }
+
+  /* the runs within one item are too short to be worth vectorising */
+  for (i = 0; i < n_items; i++)
+    for (j = 0; j < plan->n_runs; j++)
+      g_variant_swap_run (data + i * item_size + run[j].offset,
+                          run[j].count, run[j].size);
+}
+
 void
 g_variant_serialised_byteswap (GVariantSerialised value)
 {
+  GVariantSwapPlan plan;
   gsize fixed_size;
   guint alignment;
+  gsize children, i;
 
   if (!value.data)
     return;
@@ -826,62 +1289,57 @@ g_variant_serialised_byteswap (GVariantSerialised value)
   if (!alignment)
     return;
 
-  /* if fixed size and alignment are equal then we are down
-   * to the base integer type and we should swap it.  the
-   * only exception to this is if we have a struct with a
-   * single item, and then swapping it will be OK anyway.
-   */
-  if (alignment + 1 == fixed_size)
+  plan.n_runs = 0;
+
+  /* a single fixed-sized value: an integer or a structure of them */
+  if (fixed_size)
     {
-      switch (fixed_size)
-      {
-        case 2:
-          {
-            guint16 *ptr = (guint16 *) value.data;
+      g_assert_cmpint (value.size, ==, fixed_size);
 
-            g_assert_cmpint (value.size, ==, 2);
-            *ptr = GUINT16_SWAP_LE_BE (*ptr);
-          }
+      if (g_variant_swap_plan_add (&plan, value.type, 0))
+        {
+          g_variant_swap_plan_apply (&plan, value.data, 1, fixed_size);
           return;
+        }
+    }
 
-        case 4:
-          {
-            guint32 *ptr = (guint32 *) value.data;
-
-            g_assert_cmpint (value.size, ==, 4);
-            *ptr = GUINT32_SWAP_LE_BE (*ptr);
-          }
-          return;
+  /* an array of fixed-sized items */
+  else if (g_variant_type_info_get_type_class (value.type) ==
+           G_VARIANT_TYPE_CLASS_ARRAY)
+    {
+      GVariantTypeInfo *element;
+      guint offset_size;
+      gsize length;
 
-        case 8:
-          {
-            guint64 *ptr = (guint64 *) value.data;
+      element = g_variant_type_info_element (value.type);
+      g_variant_type_info_query (element, NULL, &fixed_size);
 
-            g_assert_cmpint (value.size, ==, 8);
-            *ptr = GUINT64_SWAP_LE_BE (*ptr);
-          }
-          return;
+      if (fixed_size)
+        {
+          if (!g_variant_serialised_array_length (value, &length,
+                                                  &offset_size))
+            return;
 
-        default:
-          g_assert_not_reached ();
-      }
+          if (g_variant_swap_plan_add (&plan, element, 0))
+            {
+              g_variant_swap_plan_apply (&plan, value.data,
+                                         length, fixed_size);
+              return;
+            }
+        }
     }
 
   /* else, we have a container that potentially contains
    * some children that need to be byteswapped.
    */
-  else
+  children = g_variant_serialised_n_children (value);
+  for (i = 0; i < children; i++)
     {
-      gsize children, i;
-      
-      children = g_variant_serialised_n_children (value);
-      for (i = 0; i < children; i++)
-        {
-          GVariantSerialised child;
+      GVariantSerialised child;
 
-          child = g_variant_serialised_get_child (value, i);
-          g_variant_serialised_byteswap (child);
-        }
+      child = g_variant_serialised_get_child (value, i);
+      g_variant_serialised_byteswap (child);
+      g_variant_type_info_unref (child.type);
     }
 }
 
@@ -901,162 +1359,504 @@ g_variant_serialised_assert_invariant (GVariantSerialised value)
     g_assert_cmpint (value.size, ==, fixed_size);
 }
 
-gboolean
-g_variant_serialised_is_normal (GVariantSerialised value)
+/* == normal form checking ==
+ *
+ * Checking is done in a single pass from the start of the buffer to
+ * the end.  Containers are visited using an explicit stack of frames
+ * instead of C recursion so that deeply nested (possibly malicious)
+ * data can not exhaust the C stack.
+ */
+typedef struct
 {
-  switch (g_variant_type_info_get_type_class (value.type))
-  {
-    case G_VARIANT_TYPE_CLASS_BYTE:
-    case G_VARIANT_TYPE_CLASS_INT16:
-    case G_VARIANT_TYPE_CLASS_UINT16:
-    case G_VARIANT_TYPE_CLASS_INT32:
-    case G_VARIANT_TYPE_CLASS_UINT32:
-    case G_VARIANT_TYPE_CLASS_INT64:
-    case G_VARIANT_TYPE_CLASS_UINT64:
-    case G_VARIANT_TYPE_CLASS_DOUBLE:
-      return TRUE;
+  GVariantSerialised  container;
+  GVariantTypeInfo   *owned;        /* type to unref when popped */
+  gsize               index;        /* the next child to visit */
+  gsize               length;       /* the number of children */
+  gsize               cursor;       /* the end of the previous child */
+  gsize               end;          /* the end of all of the children */
+  guint               offset_size;
+} GVariantNormalFrame;
+
+typedef struct
+{
+  GVariantNormalFrame *frames;
+  gsize                depth;
+  gsize                allocated;
+  GVariantNormalFrame  initial[16];
+
+  /* the type most recently found inside of a variant */
+  GVariantTypeInfo    *variant_type;
+} GVariantNormalStack;
+
+static GVariantNormalFrame *
+g_variant_normal_push (GVariantNormalStack *stack,
+                       GVariantSerialised   container,
+                       GVariantTypeInfo    *owned)
+{
+  GVariantNormalFrame *frame;
 
-    case G_VARIANT_TYPE_CLASS_BOOLEAN:
-      return value.data[0] == FALSE || value.data[0] == TRUE;
+  if G_UNLIKELY (stack->depth == stack->allocated)
+    {
+      GVariantNormalFrame *frames;
 
-    case G_VARIANT_TYPE_CLASS_STRING:
-      return value.size > 0 && value.data[value.size - 1] == '\0' &&
-             strlen ((const char *) value.data) + 1 == value.size;
+      frames = g_new (GVariantNormalFrame, stack->allocated * 2);
+      memcpy (frames, stack->frames,
+              sizeof (GVariantNormalFrame) * stack->depth);
 
-    case G_VARIANT_TYPE_CLASS_MAYBE:
+      if (stack->frames != stack->initial)
+        g_free (stack->frames);
+
+      stack->frames = frames;
+      stack->allocated *= 2;
+    }
+
+  frame = &stack->frames[stack->depth++];
+  frame->container = container;
+  frame->owned = owned;
+  frame->index = 0;
+  frame->length = 0;
+  frame->cursor = 0;
+  frame->end = container.size;
+  frame->offset_size = 0;
+
+  return frame;
+}
+
+static void
+g_variant_normal_pop (GVariantNormalStack *stack)
+{
+  GVariantNormalFrame *frame = &stack->frames[--stack->depth];
+
+  if (frame->owned)
+    g_variant_type_info_unref (frame->owned);
+}
+
+/*
+ * g_variant_normal_enter:
+ * @stack: the stack
+ * @value: the value to start checking
+ * @owned: a reference to the type of @value to release, or %NULL
+ * @returns: %FALSE if @value is found not to be normal
+ *
+ * Checks everything about @value that can be checked without looking
+ * at its children.  If @value has children to check then a frame is
+ * pushed for it and ownership of @owned passes to the frame.
+ * Otherwise, @owned is released immediately.
+ */
+static gboolean
+g_variant_normal_enter (GVariantNormalStack *stack,
+                        GVariantSerialised   value,
+                        GVariantTypeInfo    *owned)
+{
+  GVariantNormalFrame *frame;
+  gboolean normal = TRUE;
+
+  /* maybes are unwrapped here instead of getting their own frame */
+  while (normal)
+    switch (g_variant_type_info_get_type_class (value.type))
+    {
+      case G_VARIANT_TYPE_CLASS_BYTE:
+      case G_VARIANT_TYPE_CLASS_INT16:
+      case G_VARIANT_TYPE_CLASS_UINT16:
+      case G_VARIANT_TYPE_CLASS_INT32:
+      case G_VARIANT_TYPE_CLASS_UINT32:
+      case G_VARIANT_TYPE_CLASS_INT64:
+      case G_VARIANT_TYPE_CLASS_UINT64:
+      case G_VARIANT_TYPE_CLASS_DOUBLE:
+        goto done;
+
+      case G_VARIANT_TYPE_CLASS_BOOLEAN:
+        normal = value.size == 1 &&
+                 (value.data[0] == FALSE || value.data[0] == TRUE);
+        goto done;
+
+      case G_VARIANT_TYPE_CLASS_STRING:
+      case G_VARIANT_TYPE_CLASS_OBJECT_PATH:
+      case G_VARIANT_TYPE_CLASS_SIGNATURE:
+        normal = value.size > 0 &&
+                 g_variant_vector_find_nul (value.data,
+                                            value.size) == value.size - 1;
+        goto done;
+
+      case G_VARIANT_TYPE_CLASS_MAYBE:
+        {
+          gsize fixed_size;
+
+          /* Nothing case */
+          if (value.size == 0)
+            goto done;
+
+          /* Just case */
+          value.type = g_variant_type_info_element (value.type);
+          g_variant_type_info_query (value.type, NULL, &fixed_size);
+
+          if (fixed_size)
+            /* if element is fixed size, Just must be the same */
+            normal = value.size == fixed_size;
+
+          else
+            /* if element is variable size, we have a zero pad */
+            normal = value.data[--value.size] == '\0';
+
+          /* and the element itself should check out */
+          break;
+        }
+
+      case G_VARIANT_TYPE_CLASS_VARIANT:
+        /* all of the work is done when visiting the child */
+        frame = g_variant_normal_push (stack, value, owned);
+        frame->length = 1;
+        return TRUE;
+
+      case G_VARIANT_TYPE_CLASS_ARRAY:
+        {
+          GVariantTypeInfo *element;
+          gsize fixed_size, end;
+          guint offset_size;
+
+          if (value.size == 0)
+            goto done;
+
+          element = g_variant_type_info_element (value.type);
+          g_variant_type_info_query (element, NULL, &fixed_size);
+
+          if (fixed_size)
+            {
+              if (value.size % fixed_size)
+                {
+                  normal = FALSE;
+                  goto done;
+                }
+
+              /* check the common cases in bulk */
+              switch (g_variant_type_info_get_type_class (element))
+              {
+                case G_VARIANT_TYPE_CLASS_BOOLEAN:
+                  normal = g_variant_vector_check_booleans (value.data,
+                                                            value.size);
+                  goto done;
+
+                case G_VARIANT_TYPE_CLASS_BYTE:
+                case G_VARIANT_TYPE_CLASS_INT16:
+                case G_VARIANT_TYPE_CLASS_UINT16:
+                case G_VARIANT_TYPE_CLASS_INT32:
+                case G_VARIANT_TYPE_CLASS_UINT32:
+                case G_VARIANT_TYPE_CLASS_INT64:
+                case G_VARIANT_TYPE_CLASS_UINT64:
+                case G_VARIANT_TYPE_CLASS_DOUBLE:
+                  goto done;
+
+                default:
+                  break;
+              }
+
+              frame = g_variant_normal_push (stack, value, owned);
+              frame->length = value.size / fixed_size;
+
+              return TRUE;
+            }
+
+          offset_size = g_variant_serialiser_offset_size (value);
+          g_assert (offset_size > 0);
+
+          /* the last offset is the end of the content */
+          end = g_variant_serialiser_read_offset (value.data + value.size -
+                                                  offset_size, offset_size);
+
+          /* make sure we have an integer number of offsets, that the
+           * smallest possible offset size was chosen and that all of
+           * the offsets are in order and in bounds.
+           */
+          if (end > value.size || (value.size - end) % offset_size ||
+              value.size != g_variant_serialiser_determine_size (end,
+                                                (value.size - end) /
+                                                offset_size, TRUE) ||
+              !g_variant_vector_check_offsets (value.data + end,
+                                               (value.size - end) /
+                                               offset_size,
+                                               offset_size, end))
+            {
+              normal = FALSE;
+              goto done;
+            }
+
+          frame = g_variant_normal_push (stack, value, owned);
+          frame->length = (value.size - end) / offset_size;
+          frame->end = end;
+          frame->offset_size = offset_size;
+
+          return TRUE;
+        }
+
+      case G_VARIANT_TYPE_CLASS_STRUCT:
+      case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
+        {
+          const GVariantMemberInfo *info;
+          gsize n_members, n_offsets;
+          gsize fixed_size;
+          guint offset_size;
+
+          n_members = g_variant_type_info_n_members (value.type);
+          g_variant_type_info_query (value.type, NULL, &fixed_size);
+
+          /* () */
+          if (n_members == 0)
+            {
+              normal = value.size == 1 && value.data[0] == '\0';
+              goto done;
+            }
+
+          if (fixed_size && value.size != fixed_size)
+            {
+              normal = FALSE;
+              goto done;
+            }
+
+          /* one offset for each variable-sized member except the last */
+          info = g_variant_type_info_member_info (value.type, n_members - 1);
+          offset_size = g_variant_serialiser_offset_size (value);
+          n_offsets = info->i + 1;
+
+          if (n_offsets * offset_size > value.size)
+            {
+              normal = FALSE;
+              goto done;
+            }
+
+          frame = g_variant_normal_push (stack, value, owned);
+          frame->length = n_members;
+          frame->end = value.size - n_offsets * offset_size;
+          frame->offset_size = offset_size;
+
+          /* ensure that the smallest possible offset size was chosen */
+          if (!fixed_size &&
+              value.size != g_variant_serialiser_determine_size (frame->end,
+                                                                 n_offsets,
+                                                                 FALSE))
+            return FALSE;
+
+          return TRUE;
+        }
+
+      default:
+        g_assert_not_reached ();
+    }
+
+ done:
+  if (owned)
+    g_variant_type_info_unref (owned);
+
+  return normal;
+}
+
+/* checks that the padding between @start and @end is all zeros */
+static gboolean
+g_variant_normal_padding (const guchar *data,
+                          gsize         start,
+                          gsize         end)
+{
+  while (start < end)
+    if (data[start++] != '\0')
+      return FALSE;
+
+  return TRUE;
+}
+
+/*
+ * g_variant_normal_next:
+ * @stack: the stack
+ * @child: the next child to check
+ * @owned: a reference that the caller must take ownership of, or %NULL
+ * @returns: %FALSE if the container is found not to be normal
+ *
+ * Finds the next child of the container at the top of @stack, checking
+ * the framing (offsets and padding) around it.  When there are no more
+ * children, @child->type is set to %NULL.
+ */
+static gboolean
+g_variant_normal_next (GVariantNormalStack *stack,
+                       GVariantSerialised  *child,
+                       GVariantTypeInfo   **owned)
+{
+  GVariantNormalFrame *frame = &stack->frames[stack->depth - 1];
+  GVariantSerialised value = frame->container;
+
+  *owned = NULL;
+  child->type = NULL;
+
+  switch (g_variant_type_info_get_type_class (value.type))
+  {
+    case G_VARIANT_TYPE_CLASS_VARIANT:
       {
-        GVariantTypeInfo *element;
+        const gchar *type_string;
         gsize fixed_size;
+        gsize nul;
 
-        /* Nothing case */
-        if (value.size == 0)
+        if (frame->index++)
           return TRUE;
 
-        /* Just case */
-        element = g_variant_type_info_element (value.type);
-        g_variant_type_info_query (element, NULL, &fixed_size);
+        /* the type string follows the last '\0' */
+        nul = value.size;
+        while (nul && value.data[--nul]);
 
-        if (fixed_size)
-          {
-            /* if element is fixed size, Just must be the same */
-            return value.size == fixed_size;
-          }
-        else
+        if (nul == value.size || value.data[nul] != '\0')
+          return FALSE;
+
+        /* variants in the same container very often have the same
+         * type, so save looking it up again each time.
+         */
+        type_string = (const gchar *) value.data + nul + 1;
+
+        if (stack->variant_type == NULL ||
+            strlen (g_variant_type_info_get_string (stack->variant_type)) !=
+              value.size - nul - 1 ||
+            memcmp (g_variant_type_info_get_string (stack->variant_type),
+                    type_string, value.size - nul - 1) != 0)
           {
-            /* if element is variable size, we have a zero pad */
-            if (value.data[value.size - 1] != '\0')
+            GVariantTypeInfo *info;
+
+            info = g_variant_type_info_get_for_string (type_string,
+                                                       value.size - nul - 1);
+
+            if (info == NULL)
               return FALSE;
 
-            /* and the element itself should check out */
-            value.type = element;
-            value.size--;
+            if (stack->variant_type)
+              g_variant_type_info_unref (stack->variant_type);
 
-            return g_variant_serialised_is_normal (value);
+            stack->variant_type = info;
           }
+
+        *owned = g_variant_type_info_ref (stack->variant_type);
+
+        g_variant_type_info_query (*owned, NULL, &fixed_size);
+        child->type = *owned;
+        child->data = value.data;
+        child->size = nul;
+
+        return fixed_size == 0 || fixed_size == nul;
       }
 
     case G_VARIANT_TYPE_CLASS_ARRAY:
       {
-        GVariantSerialised child = { g_variant_type_info_element (value.type),
-                                     value.data,
-                                     0 };
-        gsize fixed_size;
+        gsize fixed_size, start;
         guint alignment;
 
-        if (value.size == 0)
-          return TRUE;
+        if (frame->index == frame->length)
+          {
+            g_assert (frame->offset_size == 0 || frame->cursor == frame->end);
+            return TRUE;
+          }
 
-        g_variant_type_info_query (child.type, &alignment, &fixed_size);
+        child->type = g_variant_type_info_element (value.type);
+        g_variant_type_info_query (child->type, &alignment, &fixed_size);
 
         if (fixed_size)
           {
-            gsize i;
-
-            if (value.size % fixed_size)
-              return FALSE;
+            child->data = value.data + frame->index++ * fixed_size;
+            child->size = fixed_size;
 
-            child.size = fixed_size;
+            return TRUE;
+          }
 
-            for (i = 0; i < value.size / fixed_size; i++)
-              {
-                if (!g_variant_serialised_is_normal (child))
-                  return FALSE;
+        /* this element starts past the end of the last one... */
+        start = frame->cursor;
 
-                child.data += child.size;
-              }
+        /* ...after adding padding bytes for the alignment (except
+         * that empty items at the very end are not padded)
+         */
+        while (start < frame->end && (start & alignment))
+          if (value.data[start++] != '\0')
+            return FALSE;
 
-            g_assert (child.data == value.data + value.size);
+        /* it ends at the offset given in the offsets (which have
+         * already been checked to be in order and in bounds)
+         */
+        frame->cursor =
+          g_variant_serialiser_read_offset (value.data + frame->end +
+                                            frame->index++ *
+                                            frame->offset_size,
+                                            frame->offset_size);
 
-            return TRUE;
-          }
-        else
-          {
-            gsize child_start, child_end;
-            gsize length, end, index;
-            guint offset_size;
+        /* it can't end before it starts (due to the padding) */
+        if (frame->cursor < start)
+          return FALSE;
 
-            /* we will need this to check on some things manually */
-            offset_size = g_variant_serialiser_offset_size (value);
-            g_assert (offset_size > 0);
+        child->data = value.data + start;
+        child->size = frame->cursor - start;
 
-            /* make sure the end offset is in-bounds */
-            if (!g_variant_serialiser_dereference (value, 0, &end))
-              return FALSE;
+        return TRUE;
+      }
 
-            /* make sure we have an integer number of offsets */
-            if ((value.size - end) % offset_size)
-              return FALSE;
+    case G_VARIANT_TYPE_CLASS_STRUCT:
+    case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
+      {
+        const GVariantMemberInfo *info;
+        gsize fixed_size, start, end;
+        guint alignment;
 
-            /* number of offsets = length of the array */
-            length = (value.size - end) / offset_size;
+        if (frame->index == frame->length)
+          {
+            g_variant_type_info_query (value.type, NULL, &fixed_size);
 
-            /* ensure that the smallest possible offset size was chosen */
-            if (value.size !=
-                g_variant_serialiser_determine_size (end, length, TRUE))
-              return FALSE;
+            /* fixed sized structures are padded out to their size */
+            if (fixed_size)
+              return g_variant_normal_padding (value.data,
+                                               frame->cursor, value.size);
 
-            child_end = 0;
-            index = 0;
-            while (length--)
-              {
-                GVariantSerialised child;
+            return frame->cursor == frame->end;
+          }
 
-                /* this element starts past the end of the last one... */
-                child_start = child_end;
+        info = g_variant_type_info_member_info (value.type, frame->index);
+        g_variant_type_info_query (info->type, &alignment, &fixed_size);
 
-                /* ...after adding padding bytes for the alignment */
-                while (child_start < end && (child_start & alignment))
-                  if (value.data[child_start++] != '\0')
-                    return FALSE;
+        /* where a reader will find the start of this member */
+        start = 0;
+        if (info->i != -1l)
+          start = g_variant_serialiser_read_offset (value.data + value.size -
+                                                    frame->offset_size *
+                                                    (info->i + 1),
+                                                    frame->offset_size);
+        start += info->a;
+        start &= info->b;
+        start |= info->c;
 
-                /* ended before alignment, due to cut off buffer */
-                if (child_start & alignment)
-                  return FALSE;
+        if (fixed_size)
+          end = start + fixed_size;
 
-                /* it ends at the offset given in the offsets */
-                if (!g_variant_serialiser_dereference (value,
-                                                       length,
-                                                       &child_end))
-                  return FALSE;
+        else if (frame->index == frame->length - 1)
+          end = frame->end;
 
-                /* it can't end before it starts... */
-                if (child_end < child_start)
-                  return FALSE;
+        else
+          end = g_variant_serialiser_read_offset (value.data + value.size -
+                                                  frame->offset_size *
+                                                  (info->i + 2),
+                                                  frame->offset_size);
 
-                child.data = &value.data[child_start];
-                child.size = child_end - child_start;
+        frame->index++;
 
-                if (!g_variant_serialised_is_normal (child))
-                  return FALSE;
-              }
+        /* an empty variable-sized member gets no padding */
+        if (!fixed_size && end == frame->cursor)
+          {
+            child->type = info->type;
+            child->data = NULL;
+            child->size = 0;
 
-            g_assert (child_end == end);
+            return TRUE;
           }
-      }
 
-    case G_VARIANT_TYPE_CLASS_STRUCT:
-    case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
-      {
+        /* otherwise it must start exactly after the padding */
+        if (start != frame->cursor + ((-frame->cursor) & alignment) ||
+            start >= end || end > frame->end ||
+            !g_variant_normal_padding (value.data, frame->cursor, start))
+          return FALSE;
+
+        frame->cursor = end;
+
+        child->type = info->type;
+        child->data = value.data + start;
+        child->size = end - start;
+
         return TRUE;
       }
 
@@ -1064,3 +1864,53 @@ g_variant_serialised_is_normal (GVariantSerialised value)
       g_assert_not_reached ();
   }
 }
+
+/*
+ * g_variant_serialised_is_normal:
+ * @value: a #GVariantSerialised
+ * @returns: %TRUE if @value is in normal form
+ *
+ * Determines if @value is exactly what the serialiser would have
+ * produced for the value that a reader would find in it.
+ */
+gboolean
+g_variant_serialised_is_normal (GVariantSerialised value)
+{
+  GVariantNormalStack stack;
+  gboolean normal;
+
+  stack.frames = stack.initial;
+  stack.allocated = G_N_ELEMENTS (stack.initial);
+  stack.depth = 0;
+  stack.variant_type = NULL;
+
+  normal = g_variant_normal_enter (&stack, value, NULL);
+
+  while (normal && stack.depth)
+    {
+      GVariantTypeInfo *owned;
+      GVariantSerialised child;
+
+      normal = g_variant_normal_next (&stack, &child, &owned);
+
+      if (child.type == NULL)
+        g_variant_normal_pop (&stack);
+
+      else if (normal)
+        normal = g_variant_normal_enter (&stack, child, owned);
+
+      else if (owned)
+        g_variant_type_info_unref (owned);
+    }
+
+  while (stack.depth)
+    g_variant_normal_pop (&stack);
+
+  if (stack.variant_type)
+    g_variant_type_info_unref (stack.variant_type);
+
+  if (stack.frames != stack.initial)
+    g_free (stack.frames);
+
+  return normal;
+}
@@ -13,6 +13,9 @@
 
 #include "gvarianttypeinfo.h"
 
+#include <glib/gerror.h>
+#include <string.h>
+
 typedef struct
 {
   GVariantTypeInfo *type;
@@ -25,6 +28,15 @@ gsize                           g_variant_serialised_n_children         (GVarian
 GVariantSerialised              g_variant_serialised_get_child          (GVariantSerialised        container,
                                                                          gsize                     index);
 
+/* random access into arrays */
+gboolean                        g_variant_serialised_array_length       (GVariantSerialised        container,
+                                                                         gsize                    *length,
+                                                                         guint                    *offset_size);
+GVariantSerialised              g_variant_serialised_array_child        (GVariantSerialised        container,
+                                                                         gsize                     length,
+                                                                         guint                     offset_size,
+                                                                         gsize                     index);
+
 /* serialisation */
 typedef void                  (*GVariantSerialisedFiller)               (GVariantSerialised       *serialised,
                                                                          gpointer                  data);
@@ -39,6 +51,95 @@ void                            g_variant_serialiser_serialise          (GVarian
                                                                          const gpointer           *children,
                                                                          gsize                     n_children);
 
+/* streaming serialisation */
+typedef gboolean              (*GVariantSerialiserWriteFunc)            (gconstpointer             data,
+                                                                         gsize                     size,
+                                                                         gpointer                  user_data,
+                                                                         GError                  **error);
+
+typedef struct
+{
+  GVariantSerialiserWriteFunc write_func;
+  gpointer user_data;
+  GError **error;
+
+  guchar *buffer;
+  gsize buffered;
+  gsize position;
+  gboolean failed;
+} GVariantSerialiserSink;
+
+typedef void                  (*GVariantSerialisedStreamer)             (gpointer                  data,
+                                                                         GVariantSerialiserSink   *sink);
+
+void                            g_variant_serialiser_sink_init          (GVariantSerialiserSink   *sink,
+                                                                         GVariantSerialiserWriteFunc write_func,
+                                                                         gpointer                  user_data,
+                                                                         GError                  **error);
+gboolean                        g_variant_serialiser_sink_write         (GVariantSerialiserSink   *sink,
+                                                                         gconstpointer             data,
+                                                                         gsize                     size);
+gboolean                        g_variant_serialiser_sink_finish        (GVariantSerialiserSink   *sink);
+gboolean                        g_variant_serialiser_stream             (GVariantSerialised        container,
+                                                                         GVariantSerialisedFiller  gvs_filler,
+                                                                         GVariantSerialisedStreamer gvs_streamer,
+                                                                         const gpointer           *children,
+                                                                         gsize                     n_children,
+                                                                         GVariantSerialiserSink   *sink);
+
+/* offsets */
+/*
+ * g_variant_serialiser_read_offset:
+ * @bytes: a pointer to a little endian offset
+ * @offset_size: 0, 1, 2, 4 or 8
+ * @returns: the offset
+ *
+ * Reads a single entry from an offset table.  Each width gets its own
+ * case so that the read is a single (possibly unaligned) load of the
+ * correct size, rather than a variable-length copy.  The offset size
+ * of an empty container is zero, and reads as zero.
+ *
+ * This is inline (and so lives here) because it is used in the inner
+ * loops of both the serialiser and the vectorised kernels.
+ */
+static inline gsize
+g_variant_serialiser_read_offset (const guchar *bytes,
+                                  guint         offset_size)
+{
+  switch (offset_size)
+  {
+    case 0:
+      return 0;
+
+    case 1:
+      return bytes[0];
+
+    case 2:
+      {
+        guint16 value;
+
+        memcpy (&value, bytes, 2);
+        return GUINT16_FROM_LE (value);
+      }
+
+    case 4:
+      {
+        guint32 value;
+
+        memcpy (&value, bytes, 4);
+        return GUINT32_FROM_LE (value);
+      }
+
+    default:
+      {
+        guint64 value;
+
+        memcpy (&value, bytes, 8);
+        return GUINT64_FROM_LE (value);
+      }
+  }
+}
+
 /* misc */
 void                            g_variant_serialised_assert_invariant   (GVariantSerialised        value);
 gboolean                        g_variant_serialised_is_normal          (GVariantSerialised        value);
@@ -12,6 +12,7 @@
 #include <glib.h>
 
 #include "gvariant-private.h"
+#include "gvariant-vector.h"
 
 /**
  * GVariantIter:
@@ -36,6 +37,10 @@ typedef struct
   gsize length;
   gsize offset;
   gboolean cancelled;
+
+  /* only used by g_variant_iter_next_fixed() */
+  const guchar *data;
+  gsize stride;
 } GVariantIterReal;
 
 /**
@@ -72,6 +77,7 @@ g_variant_iter_init (GVariantIter *iter,
   real->length = g_variant_n_children (value);
   real->offset = 0;
   real->child = NULL;
+  real->data = NULL;
 
   if (real->length)
     real->value = g_variant_ref (value);
@@ -113,6 +119,15 @@ g_variant_iter_next (GVariantIter *iter)
   if (real->value == NULL)
     return NULL;
 
+  if (real->offset == real->length)
+    {
+      /* g_variant_iter_next_fixed() returned the last item */
+      g_variant_unref (real->value);
+      real->value = NULL;
+
+      return NULL;
+    }
+
   real->child = g_variant_get_child (real->value, real->offset++);
 
   if (real->offset == real->length)
@@ -124,6 +139,65 @@ g_variant_iter_next (GVariantIter *iter)
   return real->child;
 }
 
+/**
+ * g_variant_iter_next_fixed:
+ * @iter: a #GVariantIter on an array of fixed-sized items
+ * @elem_size: the size of one array element
+ * @returns: a pointer to the next item, or %NULL
+ *
+ * Retreives a pointer to the data of the next item in @iter without
+ * creating a #GVariant instance for it.  This pointer can be treated
+ * as a pointer to the equivalent C structure type and accessed
+ * directly.  The data is in machine byte order.  In the event that no
+ * more items exist, %NULL is returned and @iter drops its reference to
+ * the value that it was created with.
+ *
+ * @iter must have been initialised on an array of fixed-sized items
+ * and @elem_size must be equal to the fixed size of those items, as
+ * with g_variant_get_fixed_array().  Since the items are simply laid
+ * out one after the other, visiting each of them is nothing more than
+ * a walk over the serialised data of the array.
+ *
+ * The returned pointer is valid until the next call to
+ * g_variant_iter_next_fixed() returns %NULL.  For this reason, it is
+ * important to ensure that you call this function one last time, even
+ * if you know the number of items in the array (or else to use
+ * g_variant_iter_cancel()).
+ **/
+gconstpointer
+g_variant_iter_next_fixed (GVariantIter *iter,
+                           gsize         elem_size)
+{
+  GVariantIterReal *real = (GVariantIterReal *) iter;
+
+  if (real->child)
+    {
+      g_variant_unref (real->child);
+      real->child = NULL;
+    }
+
+  if (real->value == NULL)
+    return NULL;
+
+  if (real->offset == real->length)
+    {
+      g_variant_unref (real->value);
+      real->value = NULL;
+
+      return NULL;
+    }
+
+  if G_UNLIKELY (real->data == NULL)
+    {
+      real->data = g_variant_get_fixed_array (real->value, elem_size, NULL);
+      real->stride = elem_size;
+    }
+
+  g_assert_cmpint (elem_size, ==, real->stride);
+
+  return real->data + real->stride * real->offset++;
+}
+
 /**
  * g_variant_iter_cancel:
  * @iter: a #GVariantIter
@@ -440,6 +514,13 @@ gboolean
 g_variant_is_signature (const gchar *string)
 {
   gsize first_invalid;
+  gsize length;
+
+  /* a leading run of single-character types (often the whole
+   * signature) is valid as it is and needs no scanning.
+   */
+  length = strlen (string);
+  string += g_variant_vector_span_basic ((const guchar *) string, length);
 
   /* make sure no non-concrete characters appear */
   first_invalid = strspn (string, "ybnqiuxtdvmasog(){}");
@@ -467,7 +548,7 @@ g_variant_new_variant (GVariant *value)
 {
   GVariant **children;
 
-  children = g_slice_new (GVariant *);
+  children = g_new (GVariant *, 1);
   children[0] = value;
 
   return g_variant_new_tree (G_VARIANT_TYPE_VARIANT,
@@ -753,16 +834,34 @@ struct OPAQUE_TYPE__GVariantBuilder
   GVariantBuilder *parent;
 
   GVariantTypeClass class;
-  GVariantType *type;
+  const GVariantType *type;
   const GVariantType *expected;
 
+  /* references that keep @type (and, for arrays, @expected) canonical
+   * so that adding values can compare types by address.
+   */
+  GVariantTypeInfo *type_info;
+  GVariantTypeInfo *expected_info;
+
+  GVariantArena *arena;
+
+  /* arrays of fixed-size elements keep the serialised elements in
+   * @data instead of having @children.  @children_allocated and
+   * @offset then count elements.
+   */
+  gsize element_size;
+  guchar *data;
+
   GVariant **children;
-  int children_allocated;
+  gsize children_allocated;
   int offset : 30;
   int has_child : 1;
   int trusted : 1;
 };
 
+/* the most children that @offset can count */
+#define G_VARIANT_BUILDER_MAX_CHILDREN ((1 << 29) - 1)
+
 /**
  * G_VARIANT_BUILDER_ERROR:
  *
@@ -787,24 +886,67 @@ struct OPAQUE_TYPE__GVariantBuilder
 
 static void
 g_variant_builder_resize (GVariantBuilder *builder,
-                          int              new_allocated)
+                          gsize            new_allocated)
 {
-  GVariant **new_children;
-  int i;
-
-  g_assert_cmpint (builder->offset, <=, new_allocated);
+  g_assert_cmpuint (builder->offset, <=, new_allocated);
 
-  new_children = g_slice_alloc (sizeof (GVariant *) * new_allocated);
+  if (new_allocated == builder->children_allocated)
+    return;
 
-  for (i = 0; i < builder->offset; i++)
-    new_children[i] = builder->children[i];
+  if (builder->element_size)
+    {
+      guchar *new_data;
+
+      new_data = g_slice_alloc (builder->element_size * new_allocated);
+      memcpy (new_data, builder->data,
+              builder->element_size * builder->offset);
+      g_slice_free1 (builder->element_size * builder->children_allocated,
+                     builder->data);
+      builder->data = new_data;
+    }
+  else
+    /* the array is given to g_variant_new_tree() as-is, so it is
+     * allocated with g_malloc() and can grow (or shrink, at the end)
+     * in place.
+     */
+    builder->children = g_renew (GVariant *, builder->children,
+                                 new_allocated);
 
-  g_slice_free1 (sizeof (GVariant **) * builder->children_allocated,
-                 builder->children);
-  builder->children = new_children;
   builder->children_allocated = new_allocated;
 }
 
+/**
+ * g_variant_builder_reserve:
+ * @builder: a #GVariantBuilder
+ * @n_children: the expected total number of children
+ *
+ * Hints to @builder that it will contain @n_children children in
+ * total.  Space for that many children is allocated at once, instead
+ * of growing the space as children are added.
+ *
+ * This is only a hint: adding more (or fewer) children than
+ * @n_children is not an error.  It is most useful for large arrays,
+ * particularly arrays of fixed-size elements, which otherwise copy
+ * their elements each time the space grows and once more at
+ * g_variant_builder_end() to trim it to size.
+ *
+ * A builder can hold at most 2<superscript>29</superscript> - 1
+ * children, so it is an error for @n_children to be larger than that.
+ **/
+void
+g_variant_builder_reserve (GVariantBuilder *builder,
+                           gsize            n_children)
+{
+  g_assert (builder != NULL);
+  g_assert (builder->has_child == FALSE);
+  g_return_if_fail (n_children <= G_VARIANT_BUILDER_MAX_CHILDREN);
+  g_return_if_fail (builder->element_size == 0 ||
+                    n_children <= G_MAXSIZE / builder->element_size);
+
+  if (n_children > builder->children_allocated)
+    g_variant_builder_resize (builder, n_children);
+}
+
 static gboolean
 g_variant_builder_check_add_value (GVariantBuilder  *builder,
                                    GVariant         *value,
@@ -849,7 +991,48 @@ g_variant_builder_add_value (GVariantBuilder *builder,
   if (builder->offset == builder->children_allocated)
     g_variant_builder_resize (builder, builder->children_allocated * 2);
 
-  builder->children[builder->offset++] = g_variant_ref_sink (value);
+  if (builder->element_size)
+    {
+      guchar *item;
+
+      item = builder->data + builder->element_size * builder->offset++;
+
+      /* an untrusted value of a fixed-size type can have the wrong
+       * size.  its value is then all zeros (as the serialiser does
+       * for such children) and it must not be stored as it is.
+       */
+      g_variant_ref_sink (value);
+      if G_LIKELY (g_variant_get_size (value) == builder->element_size)
+        g_variant_store (value, item);
+      else
+        memset (item, 0, builder->element_size);
+      g_variant_unref (value);
+    }
+  else
+    builder->children[builder->offset++] = g_variant_ref_sink (value);
+}
+
+/* private
+ *
+ * If @builder is building an array of fixed-size elements of type
+ * @type, returns a pointer to the space for one more element, which
+ * the caller must fill in with a normal serialised value in machine
+ * byte order.  Otherwise, returns %NULL.
+ */
+gpointer
+g_variant_builder_append_fixed (GVariantBuilder    *builder,
+                                const GVariantType *type)
+{
+  if (builder->element_size == 0 ||
+      !g_variant_type_equal (builder->expected, type))
+    return NULL;
+
+  g_assert (builder->has_child == FALSE);
+
+  if (builder->offset == builder->children_allocated)
+    g_variant_builder_resize (builder, builder->children_allocated * 2);
+
+  return builder->data + builder->element_size * builder->offset++;
 }
 
 /**
@@ -894,6 +1077,9 @@ g_variant_builder_open (GVariantBuilder    *parent,
   parent->has_child = TRUE;
   child->parent = parent;
 
+  if (parent->arena)
+    child->arena = g_variant_arena_ref (parent->arena);
+
   return child;
 }
 
@@ -953,6 +1139,12 @@ g_variant_builder_close (GVariantBuilder *child)
  *
  * After all the child values are added, g_variant_builder_end() ends
  * the process. 
+ *
+ * If @class is %G_VARIANT_TYPE_CLASS_ARRAY and @type is given with a
+ * fixed-size element type (such as "ai" or "a(yu)") then the elements
+ * are stored in serialised form as they are added and no child
+ * #GVariant instances are kept.  g_variant_builder_add() with a format
+ * string equal to the element type writes the element directly.
  **/
 GVariantBuilder *
 g_variant_builder_new (GVariantTypeClass   class,
@@ -967,10 +1159,17 @@ g_variant_builder_new (GVariantTypeClass   class,
 
   builder = g_slice_new (GVariantBuilder);
   builder->parent = NULL;
+  builder->arena = NULL;
+  builder->element_size = 0;
+  builder->data = NULL;
+  builder->children = NULL;
   builder->offset = 0;
   builder->has_child = FALSE;
   builder->class = class;
-  builder->type = type ? g_variant_type_copy (type) : NULL;
+  builder->type_info = type ? g_variant_type_info_get (type) : NULL;
+  builder->type = type ? g_variant_type_info_get_type (builder->type_info)
+                       : NULL;
+  builder->expected_info = NULL;
   builder->expected = NULL;
   builder->trusted = TRUE;
 
@@ -984,7 +1183,14 @@ g_variant_builder_new (GVariantTypeClass   class,
     case G_VARIANT_TYPE_CLASS_ARRAY:
       builder->children_allocated = 8;
       if (builder->type)
-        builder->expected = g_variant_type_element (builder->type);
+        {
+          GVariantTypeInfo *info;
+
+          info = g_variant_type_info_get (g_variant_type_element (builder->type));
+          builder->expected_info = info;
+          builder->expected = g_variant_type_info_get_type (info);
+          g_variant_type_info_query (info, NULL, &builder->element_size);
+        }
       break;
 
     case G_VARIANT_TYPE_CLASS_MAYBE:
@@ -1009,12 +1215,79 @@ g_variant_builder_new (GVariantTypeClass   class,
       g_error ("g_variant_builder_new() works only with container types");
    }
 
-  builder->children = g_slice_alloc (sizeof (GVariant *) *
-                                     builder->children_allocated);
+  if (builder->element_size)
+    builder->data = g_slice_alloc (builder->element_size *
+                                   builder->children_allocated);
+  else
+    builder->children = g_new (GVariant *, builder->children_allocated);
+
+  return builder;
+}
+
+/**
+ * g_variant_builder_new_arena:
+ * @class: a container #GVariantTypeClass
+ * @type: a type contained in @class, or %NULL
+ * @returns: a #GVariantBuilder
+ *
+ * Creates a new #GVariantBuilder, exactly as g_variant_builder_new()
+ * does, except that the values created by the builder are allocated
+ * from an arena: a few large blocks of memory that are freed all at
+ * once.
+ *
+ * This covers the containers made by the builder (and by any builders
+ * opened from it), the values created by g_variant_builder_add() and
+ * their serialised data.  Values given to
+ * g_variant_builder_add_value() are not copied.
+ *
+ * Memory in the arena is not reused when a value from it is freed.
+ * It is only returned once every value allocated from the arena has
+ * been freed.  An arena builder is therefore best used to build a
+ * large value that is kept in one piece and then freed as a whole.
+ **/
+GVariantBuilder *
+g_variant_builder_new_arena (GVariantTypeClass   class,
+                             const GVariantType *type)
+{
+  GVariantBuilder *builder;
+
+  builder = g_variant_builder_new (class, type);
+  builder->arena = g_variant_arena_new ();
 
   return builder;
 }
 
+/* private */
+GVariantArena *
+g_variant_builder_get_arena (GVariantBuilder *builder)
+{
+  return builder->arena;
+}
+
+static void
+g_variant_builder_release_types (GVariantBuilder *builder)
+{
+  if (builder->expected_info)
+    g_variant_type_info_unref (builder->expected_info);
+
+  if (builder->type_info)
+    g_variant_type_info_unref (builder->type_info);
+}
+
+static GVariant *
+g_variant_builder_make_value (GVariantBuilder    *builder,
+                              const GVariantType *type)
+{
+  if (builder->element_size)
+    /* already serialised */
+    return g_variant_from_slice (type, builder->data,
+                                 builder->element_size * builder->offset,
+                                 builder->trusted ? G_VARIANT_TRUSTED : 0);
+
+  return g_variant_new_tree (type, builder->children,
+                             builder->offset, builder->trusted);
+}
+
 /**
  * g_variant_builder_end:
  * @builder: a #GVariantBuilder
@@ -1031,7 +1304,8 @@ g_variant_builder_new (GVariantTypeClass   class,
 GVariant *
 g_variant_builder_end (GVariantBuilder *builder)
 {
-  GVariantType *my_type;
+  const GVariantType *my_type;
+  GVariantType *new_type = NULL;
   GError *error = NULL;
   GVariant *value;
 
@@ -1043,48 +1317,61 @@ g_variant_builder_end (GVariantBuilder *builder)
   g_variant_builder_resize (builder, builder->offset);
 
   if (builder->class == G_VARIANT_TYPE_CLASS_VARIANT)
-    {
-      my_type = g_variant_type_copy (G_VARIANT_TYPE_VARIANT);
-      if (builder->type)
-        g_variant_type_free (builder->type);
-    }
+    my_type = G_VARIANT_TYPE_VARIANT;
   else
     my_type = builder->type;
 
   if (my_type == NULL)
-    switch (builder->class)
     {
-      case G_VARIANT_TYPE_CLASS_ARRAY:
-        my_type = g_variant_type_new_array (
-                    g_variant_get_type (builder->children[0]));
-        break;
-
-      case G_VARIANT_TYPE_CLASS_MAYBE:
-        my_type = g_variant_type_new_maybe (
-                    g_variant_get_type (builder->children[0]));
-        break;
-
-      case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
-        my_type = g_variant_type_new_dict_entry (
-                    g_variant_get_type (builder->children[0]),
-                    g_variant_get_type (builder->children[1]));
-        break;
-
-      case G_VARIANT_TYPE_CLASS_STRUCT:
-        my_type = g_variant_type_new_struct (builder->children,
-                                             g_variant_get_type,
-                                             builder->offset);
-        break;
-
-      default:
-        g_assert_not_reached ();
+      switch (builder->class)
+      {
+        case G_VARIANT_TYPE_CLASS_ARRAY:
+          new_type = g_variant_type_new_array (
+                       g_variant_get_type (builder->children[0]));
+          break;
+
+        case G_VARIANT_TYPE_CLASS_MAYBE:
+          new_type = g_variant_type_new_maybe (
+                       g_variant_get_type (builder->children[0]));
+          break;
+
+        case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
+          new_type = g_variant_type_new_dict_entry (
+                       g_variant_get_type (builder->children[0]),
+                       g_variant_get_type (builder->children[1]));
+          break;
+
+        case G_VARIANT_TYPE_CLASS_STRUCT:
+          new_type = g_variant_type_new_struct (builder->children,
+                                                g_variant_get_type,
+                                                builder->offset);
+          break;
+
+        default:
+          g_assert_not_reached ();
+      }
+
+      my_type = new_type;
     }
 
-  value = g_variant_new_tree (my_type, builder->children,
-                              builder->offset, builder->trusted);
+  if (builder->arena)
+    {
+      GVariantArena *previous;
+
+      previous = g_variant_arena_push (builder->arena);
+      value = g_variant_builder_make_value (builder, my_type);
+      g_variant_arena_pop (previous);
 
+      g_variant_arena_unref (builder->arena);
+    }
+  else
+    value = g_variant_builder_make_value (builder, my_type);
+
+  g_variant_builder_release_types (builder);
   g_slice_free (GVariantBuilder, builder);
-  g_variant_type_free (my_type);
+
+  if (new_type)
+    g_variant_type_free (new_type);
 
   return value;
 }
@@ -1229,6 +1516,8 @@ g_variant_builder_check_add (GVariantBuilder     *builder,
                              const GVariantType  *type,
                              GError             **error)
 {
+  gboolean exact;
+
   g_assert (builder != NULL);
   g_assert (builder->has_child == FALSE);
   g_assert (class != G_VARIANT_TYPE_CLASS_INVALID);
@@ -1236,7 +1525,13 @@ g_variant_builder_check_add (GVariantBuilder     *builder,
   if (class == G_VARIANT_TYPE_CLASS_VARIANT)
     type = NULL;
 
-  if (type && !g_variant_type_is_concrete (type))
+  /* the type of a value and the element type of an array builder are
+   * both canonical, so adding a value of exactly the expected type is
+   * usually spotted by comparing addresses.
+   */
+  exact = type != NULL && type == builder->expected;
+
+  if (type && !exact && !g_variant_type_is_concrete (type))
     {
       gchar *type_str;
 
@@ -1261,7 +1556,7 @@ g_variant_builder_check_add (GVariantBuilder     *builder,
     }
   /* we now know that class is the natural class of a concrete type */
 
-  if (builder->expected &&
+  if (builder->expected && !exact &&
       !g_variant_type_is_in_class (builder->expected, class))
     {
       g_set_error (error, G_VARIANT_BUILDER_ERROR,
@@ -1272,7 +1567,7 @@ g_variant_builder_check_add (GVariantBuilder     *builder,
       return FALSE;
     }
 
-  if (builder->expected && type &&
+  if (builder->expected && type && !exact &&
       !g_variant_type_matches (type, builder->expected))
     {
       gchar *expected_str, *type_str;
@@ -1302,6 +1597,7 @@ g_variant_builder_check_add (GVariantBuilder     *builder,
 
     case G_VARIANT_TYPE_CLASS_ARRAY:
       if (builder->expected == NULL && type && builder->offset &&
+          g_variant_get_type (builder->children[0]) != type &&
           !g_variant_matches (builder->children[0], type))
         /* builder type not explicitly specified, but the array has
          * one item in it already, so the others must match...
@@ -1386,15 +1682,21 @@ g_variant_builder_cancel (GVariantBuilder *builder)
     {
       gsize i;
 
-      for (i = 0; i < builder->offset; i++)
-        g_variant_unref (builder->children[i]);
+      if (builder->element_size)
+        g_slice_free1 (builder->element_size * builder->children_allocated,
+                       builder->data);
+      else
+        {
+          for (i = 0; i < builder->offset; i++)
+            g_variant_unref (builder->children[i]);
 
-      g_slice_free1 (sizeof (GVariant *) * builder->children_allocated,
-                     builder->children);
+          g_free (builder->children);
+        }
 
-      if (builder->type)
-        g_variant_type_free (builder->type);
+      if (builder->arena)
+        g_variant_arena_unref (builder->arena);
 
+      g_variant_builder_release_types (builder);
       parent = builder->parent;
       g_slice_free (GVariantBuilder, builder);
     }
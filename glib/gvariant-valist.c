@@ -12,6 +12,8 @@
 
 #include <glib/gtestutils.h>
 #include <glib/gmessages.h>
+#include <glib/gstrfuncs.h>
+#include <glib/gthread.h>
 #include <string.h>
 
 /**
@@ -51,75 +53,115 @@
 gboolean
 g_variant_format_string_scan (const gchar **format_string)
 {
-  switch (*(*format_string)++)
-  {
-    case '\0':
-      return FALSE;
+  const gchar *string = *format_string;
+  guint64 dict_entries = 0;   /* bit 0 is the innermost container */
+  gboolean prefixed = FALSE;
+  guint depth = 0;
 
-    case '(':
-      while (**format_string != ')')
-        if (!g_variant_format_string_scan (format_string))
-          return FALSE;
+  /* the same single pass as g_variant_type_string_scan() */
+  while (TRUE)
+    {
+      switch (*string++)
+      {
+        case 'b': case 'y': case 'n': case 'q': case 'i': case 'u':
+        case 'x': case 't': case 'd': case 's': case 'o': case 'g':
+        case 'v': case '*': case '?':
+          break;
 
-      (*format_string)++; /* ')' */
+        case 'm':
+          prefixed = TRUE;
+          continue;
 
-      return TRUE;
+        case 'a':
+          string--;
+          /* fall through */
 
-    case '{':
-      if (**format_string == '\0')
-        return FALSE;
+        case '@':
+          if (!g_variant_type_string_scan (&string, NULL))
+            return FALSE;
+          break;
 
-      /* key may only be a basic type.  three posibilities for that:
-       */
-      if (strchr ("bynqiuxtdsog?", **format_string))
-        *format_string += 1;
+        case '&':
+          {
+            const gchar *type = string;
 
-      else if ((*format_string)[0] == '@' &&
-               strchr ("bynqiuxtdsog?", (*format_string)[1]))
-        *format_string += 2;
+            if (!g_variant_type_string_scan (&string, NULL))
+              return FALSE;
 
-      else if ((*format_string)[0] == '&' &&
-               strchr ("bynqiuxtdsog", (*format_string)[1]))
-        *format_string += 2;
+            if (type + strspn (type, "bynqiuxtd(){}") != string)
+              return FALSE;
+          }
+          break;
 
-      else
-        return FALSE;
+        case '(':
+          if (depth == G_VARIANT_TYPE_MAX_NESTING)
+            return FALSE;
 
-      if (!g_variant_format_string_scan (format_string))    /* value */
-        return FALSE;
+          dict_entries <<= 1;
+          depth++;
+          prefixed = FALSE;
+          continue;
 
-      if (*(*format_string)++ != '}')
-        return FALSE;
+        case '{':
+          if (depth == G_VARIANT_TYPE_MAX_NESTING)
+            return FALSE;
 
-      return TRUE;
+          /* key may only be a basic type, possibly after a '@' or
+           * (if it is not '?') a '&'.
+           */
+          if (string[0] == '@' || (string[0] == '&' && string[1] != '?'))
+            string++;
 
-    case 'm':
-      return g_variant_format_string_scan (format_string);
+          switch (*string++)
+          {
+            case 'b': case 'y': case 'n': case 'q': case 'i': case 'u':
+            case 'x': case 't': case 'd': case 's': case 'o': case 'g':
+            case '?':
+              break;
 
-    case 'a':
-    case '@':
-      return g_variant_type_string_scan (format_string, NULL);
+            default:
+              return FALSE;
+          }
 
-    case '&':
-      {
-        const gchar *start;
+          dict_entries = (dict_entries << 1) | 1;
+          depth++;
+          prefixed = FALSE;
+          continue;
 
-        start = *format_string;
-        if (!g_variant_type_string_scan (format_string, NULL))
-          return FALSE;
+        case ')':
+          /* not after 'm' and not in a dictionary entry */
+          if (depth == 0 || prefixed || (dict_entries & 1))
+            return FALSE;
+
+          dict_entries >>= 1;
+          depth--;
+          break;
 
-        if (start + strspn (start, "bynqiuxtd(){}") != *format_string)
+        default:
           return FALSE;
       }
 
-    case 'b': case 'y': case 'n': case 'q': case 'i': case 'u':
-    case 'x': case 't': case 'd': case 's': case 'o': case 'g':
-    case 'v': case '*': case '?':
-      return TRUE;
+      /* a complete format string was found.  it was the value of any
+       * dictionary entries that it ends.
+       */
+      prefixed = FALSE;
+
+      while (dict_entries & 1)
+        {
+          if (*string++ != '}')
+            return FALSE;
 
-    default:
-      return FALSE;
-  }
+          dict_entries >>= 1;
+          depth--;
+        }
+
+      if (depth == 0)
+        break;
+    }
+
+  *format_string = string;
+
+  return TRUE;
 }
 
 #if 0
@@ -154,6 +196,241 @@ g_variant_format_string_get_type (const gchar **format_string)
   return (GVariantType *) G_VARIANT_TYPE (new);
 }
 
+/* compiled format strings
+ *
+ * Scanning a format string and working out its type (which involves a
+ * g_malloc()) is done once per format string per thread.  The result
+ * is kept in a small direct-mapped cache, private to each thread so
+ * that no locking is needed, keyed on the address of the format
+ * string.  Since the same address might later hold a different format
+ * string (one built with g_strdup_printf(), for example) a copy of the
+ * string is kept as well and compared on each lookup.
+ */
+#define G_VARIANT_FORMAT_CACHE_SIZE 64
+
+typedef struct
+{
+  const gchar *format_string;
+  gchar *copy;
+  gsize length;
+
+  /* a concrete @type is the canonical one from @info, so that
+   * g_variant_builder_append_fixed() can compare it by address.
+   * otherwise @info is %NULL and @type is owned by the plan.
+   */
+  const GVariantType *type;
+  GVariantTypeInfo *info;
+  gboolean is_type_string;
+  gboolean is_flat_struct;
+} GVariantFormatPlan;
+
+static void
+g_variant_format_plan_clear (GVariantFormatPlan *plan)
+{
+  if (plan->info)
+    g_variant_type_info_unref (plan->info);
+  else if (plan->type)
+    g_variant_type_free ((GVariantType *) plan->type);
+
+  g_free (plan->copy);
+}
+
+static GStaticPrivate g_variant_format_cache = G_STATIC_PRIVATE_INIT;
+
+static void
+g_variant_format_cache_free (gpointer data)
+{
+  GVariantFormatPlan *cache = data;
+  gint i;
+
+  for (i = 0; i < G_VARIANT_FORMAT_CACHE_SIZE; i++)
+    g_variant_format_plan_clear (&cache[i]);
+
+  g_free (cache);
+}
+
+/* returns the plan for the format string at @format_string (which
+ * need not be nul-terminated).  the plan belongs to the cache and is
+ * only valid until the next call.
+ */
+static const GVariantFormatPlan *
+g_variant_format_string_compile (const gchar *format_string)
+{
+  GVariantFormatPlan *cache, *plan;
+  GVariantType *type;
+  const gchar *end;
+  gsize key;
+
+  cache = g_static_private_get (&g_variant_format_cache);
+
+  if G_UNLIKELY (cache == NULL)
+    {
+      cache = g_new0 (GVariantFormatPlan, G_VARIANT_FORMAT_CACHE_SIZE);
+      g_static_private_set (&g_variant_format_cache, cache,
+                            &g_variant_format_cache_free);
+    }
+
+  key = (gsize) format_string;
+  plan = &cache[(key ^ (key >> 6)) % G_VARIANT_FORMAT_CACHE_SIZE];
+
+  if G_LIKELY (plan->format_string == format_string &&
+               strncmp (plan->copy, format_string, plan->length) == 0)
+    return plan;
+
+  g_variant_format_plan_clear (plan);
+
+  end = format_string;
+  type = g_variant_format_string_get_type (&end);
+  if (g_variant_type_is_concrete (type))
+    {
+      plan->info = g_variant_type_info_get (type);
+      plan->type = g_variant_type_info_get_type (plan->info);
+      g_variant_type_free (type);
+    }
+  else
+    {
+      plan->info = NULL;
+      plan->type = type;
+    }
+  plan->length = end - format_string;
+  plan->copy = g_strndup (format_string, plan->length);
+  plan->format_string = format_string;
+
+  /* no '@' or '&' was removed to get the type */
+  plan->is_type_string =
+    g_variant_type_get_string_length (plan->type) == plan->length;
+
+  /* a structure or dictionary entry made of only basic types and
+   * other such structures.  see g_variant_valist_get_serialised().
+   */
+  plan->is_flat_struct = plan->is_type_string &&
+                         (format_string[0] == '(' ||
+                          format_string[0] == '{') &&
+                         strspn (plan->copy, "bynqiuxtdsog(){}") ==
+                         plan->length;
+
+  return plan;
+}
+
+/* the alignment of a fixed-size type, given as a format string */
+static gsize
+g_variant_valist_fixed_alignment (const gchar *format_string)
+{
+  gsize alignment = 1;
+  gint depth = 0;
+
+  do
+    switch (*format_string++)
+    {
+      case '(': case '{':
+        depth++;
+        break;
+
+      case ')': case '}':
+        depth--;
+        break;
+
+      case 'n': case 'q':
+        alignment = MAX (alignment, 2);
+        break;
+
+      case 'i': case 'u':
+        alignment = MAX (alignment, 4);
+        break;
+
+      case 'x': case 't': case 'd':
+        alignment = MAX (alignment, 8);
+        break;
+    }
+  while (depth);
+
+  return alignment;
+}
+
+/* stores the serialised form of a value of a fixed-size type (basic
+ * types and structures of them) collected from @app at @data, with
+ * @offset being the position in @data.  padding is zero-filled.
+ */
+static void
+g_variant_valist_store (const gchar **format_string,
+                        guchar       *data,
+                        gsize        *offset,
+                        va_list      *app)
+{
+  gsize alignment;
+  gpointer item;
+
+  alignment = g_variant_valist_fixed_alignment (*format_string);
+  while (*offset & (alignment - 1))
+    data[(*offset)++] = '\0';
+
+  item = data + *offset;
+
+  switch (*(*format_string)++)
+  {
+    case '(': case '{':
+      if (**format_string == ')')
+        /* unit */
+        data[(*offset)++] = '\0';
+
+      while (**format_string != ')' && **format_string != '}')
+        g_variant_valist_store (format_string, data, offset, app);
+      (*format_string)++;
+
+      while (*offset & (alignment - 1))
+        data[(*offset)++] = '\0';
+      return;
+
+    case 'b':
+      *(guint8 *) item = va_arg (*app, gboolean) != FALSE;
+      *offset += 1;
+      return;
+
+    case 'y':
+      *(guint8 *) item = va_arg (*app, guint);
+      *offset += 1;
+      return;
+
+    case 'n':
+      *(gint16 *) item = va_arg (*app, gint);
+      *offset += 2;
+      return;
+
+    case 'q':
+      *(guint16 *) item = va_arg (*app, guint);
+      *offset += 2;
+      return;
+
+    case 'i':
+      *(gint32 *) item = va_arg (*app, gint);
+      *offset += 4;
+      return;
+
+    case 'u':
+      *(guint32 *) item = va_arg (*app, guint);
+      *offset += 4;
+      return;
+
+    case 'x':
+      *(gint64 *) item = va_arg (*app, gint64);
+      *offset += 8;
+      return;
+
+    case 't':
+      *(guint64 *) item = va_arg (*app, guint64);
+      *offset += 8;
+      return;
+
+    case 'd':
+      *(gdouble *) item = va_arg (*app, gdouble);
+      *offset += 8;
+      return;
+
+    default:
+      g_assert_not_reached ();
+  }
+}
+
 static GVariant *
 g_variant_valist_new (const gchar **format_string,
                       va_list      *app)
@@ -221,15 +498,16 @@ g_variant_valist_new (const gchar **format_string,
 
     case 'm':
       {
+        const GVariantFormatPlan *plan;
         GVariantBuilder *builder;
         const gchar *string;
-        GVariantType *type;
         GVariant *value;
 
+        plan = g_variant_format_string_compile (*format_string);
+        builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_MAYBE,
+                                         plan->type);
         string = (*format_string) + 1;
-        type = g_variant_format_string_get_type (format_string);
-        builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_MAYBE, type);
-        g_variant_type_free (type);
+        *format_string += plan->length;
 
         switch (*((*format_string) + 1))
         {
@@ -535,6 +813,80 @@ typedef guchar gbyte;
   }
 }
 
+/* like g_variant_valist_get(), but reads a trusted value in native
+ * byte order straight out of its serialised form, without creating a
+ * #GVariant for each member.  only basic types and structures and
+ * dictionary entries of them are supported.
+ */
+static void
+g_variant_valist_get_serialised (GVariantSerialised   gvs,
+                                 const gchar        **format_string,
+                                 va_list             *app)
+{
+#define serialised_case(char, type) \
+    case char:                                          \
+      {                                                 \
+        type *ptr = va_arg (*app, type *);              \
+                                                        \
+        if (ptr)                                        \
+          memcpy (ptr, gvs.data, sizeof (type));        \
+        return;                                         \
+      }
+
+  switch (*(*format_string)++)
+  {
+    case 'b':
+      {
+        gboolean *ptr = va_arg (*app, gboolean *);
+
+        if (ptr)
+          *ptr = gvs.data[0];
+        return;
+      }
+
+    serialised_case ('y', guchar);
+    serialised_case ('n', gint16);
+    serialised_case ('q', guint16);
+    serialised_case ('i', gint32);
+    serialised_case ('u', guint32);
+    serialised_case ('x', gint64);
+    serialised_case ('t', guint64);
+    serialised_case ('d', gdouble);
+
+    case 's':
+    case 'o':
+    case 'g':
+      {
+        const gchar **ptr = va_arg (*app, const gchar **);
+
+        if (ptr)
+          *ptr = (const gchar *) gvs.data;
+        return;
+      }
+
+    case '(':
+    case '{':
+      {
+        GVariantSerialised child;
+        gsize i = 0;
+
+        while (**format_string != ')' && **format_string != '}')
+          {
+            child = g_variant_serialised_get_child (gvs, i++);
+            g_variant_valist_get_serialised (child, format_string, app);
+            g_variant_type_info_unref (child.type);
+          }
+        (*format_string)++;
+
+        return;
+      }
+
+    default:
+      g_assert_not_reached ();
+  }
+#undef serialised_case
+}
+
 /**
  * g_variant_new:
  * @format_string: a #GVariant format string
@@ -767,16 +1119,20 @@ g_variant_get_va (GVariant     *value,
                   const gchar **format_string,
                   va_list      *app)
 {
-  GVariantType *type;
-  const gchar *fmt;
+  const GVariantFormatPlan *plan;
+  GVariantSerialised gvs;
+  gboolean flat;
 
-  fmt = *format_string;
-  type = g_variant_format_string_get_type (&fmt);
-  g_assert (g_variant_matches (value, type));
-  g_variant_type_free (type);
+  plan = g_variant_format_string_compile (*format_string);
+  g_assert (g_variant_matches (value, plan->type));
+  flat = plan->is_flat_struct;
 
   g_variant_flatten (value);
-  g_variant_valist_get (value, FALSE, format_string, app);
+
+  if (flat && g_variant_get_trusted_gvs (value, &gvs))
+    g_variant_valist_get_serialised (gvs, format_string, app);
+  else
+    g_variant_valist_get (value, FALSE, format_string, app);
 }
 
 /**
@@ -874,13 +1230,41 @@ g_variant_builder_add (GVariantBuilder *builder,
                        const gchar     *format_string,
                        ...)
 {
+  const GVariantFormatPlan *plan;
+  GVariantArena *arena, *previous;
   GVariant *variant;
+  gpointer item;
   va_list ap;
 
+  /* a fixed-size value going into an array of the same type goes
+   * straight into the array's data.  that's only possible if the
+   * format string is plainly the type string (ie: no '@', '&', etc).
+   */
+  plan = g_variant_format_string_compile (format_string);
+  if (plan->is_type_string && format_string[plan->length] == '\0' &&
+      (item = g_variant_builder_append_fixed (builder, plan->type)))
+    {
+      gsize offset = 0;
+
+      va_start (ap, format_string);
+      g_variant_valist_store (&format_string, item, &offset, &ap);
+      va_end (ap);
+
+      return;
+    }
+
+  arena = g_variant_builder_get_arena (builder);
+
+  if (arena)
+    previous = g_variant_arena_push (arena);
+
   va_start (ap, format_string);
   variant = g_variant_new_va (&format_string, &ap);
   g_assert (*format_string == '\0');
   va_end (ap);
 
+  if (arena)
+    g_variant_arena_pop (previous);
+
   g_variant_builder_add_value (builder, variant);
 }
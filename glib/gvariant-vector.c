@@ -0,0 +1,664 @@
+/*
+ * Copyright © 2008 Ryan Lortie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ */
+
+/* Vectorised kernels for the hot loops of the serialiser and of
+ * signature checking.
+ *
+ * Each kernel has a portable scalar implementation and, on x86, SSE2
+ * and AVX2 implementations.  The best implementation supported by the
+ * CPU is chosen the first time that any kernel is used.  Setting
+ * GVARIANT_VECTOR to "scalar" or "sse2" in the environment limits the
+ * choice, which is useful for testing and benchmarking.
+ */
+
+#include "gvariant-vector.h"
+#include "gvariant-serialiser.h"
+
+#include <glib/gatomic.h>
+#include <glib/gutils.h>
+
+#include <string.h>
+
+#if defined (__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined (__x86_64__) || defined (__i386__))
+# define G_VARIANT_VECTOR_X86
+# include <immintrin.h>
+# define SSE2 __attribute__ ((target ("sse2")))
+# define AVX2 __attribute__ ((target ("avx2")))
+#endif
+
+typedef struct
+{
+  gboolean (*check_booleans) (const guchar *data,
+                              gsize         size);
+  gsize    (*find_nul)       (const guchar *data,
+                              gsize         size);
+  gboolean (*check_offsets)  (const guchar *offsets,
+                              gsize         n_offsets,
+                              guint         offset_size);
+  void     (*byteswap)       (guchar       *data,
+                              gsize         n_items,
+                              guint         item_size);
+  gsize    (*span_basic)     (const guchar *data,
+                              gsize         size);
+} GVariantVectorKernels;
+
+/* the type characters that are complete concrete types on their own */
+static const gchar basic_types[] = "bynqiuxtdsogv";
+
+/* == scalar == */
+static gboolean
+scalar_check_booleans (const guchar *data,
+                       gsize         size)
+{
+  guchar bad = 0;
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    bad |= data[i] & ~1;
+
+  return bad == 0;
+}
+
+static gsize
+scalar_find_nul (const guchar *data,
+                 gsize         size)
+{
+  const guchar *nul;
+
+  nul = memchr (data, '\0', size);
+
+  return nul ? nul - data : size;
+}
+
+/* checks that the @n_offsets offsets are non-decreasing */
+static gboolean
+scalar_check_offsets (const guchar *offsets,
+                      gsize         n_offsets,
+                      guint         offset_size)
+{
+  gsize previous, i;
+
+  if (n_offsets == 0)
+    return TRUE;
+
+  previous = g_variant_serialiser_read_offset (offsets, offset_size);
+
+  for (i = 1; i < n_offsets; i++)
+    {
+      gsize offset;
+
+      offset = g_variant_serialiser_read_offset (offsets + i * offset_size,
+                                                 offset_size);
+
+      if (offset < previous)
+        return FALSE;
+
+      previous = offset;
+    }
+
+  return TRUE;
+}
+
+static void
+scalar_byteswap (guchar *data,
+                 gsize   n_items,
+                 guint   item_size)
+{
+  gsize i;
+
+  switch (item_size)
+  {
+    case 2:
+      {
+        guint16 *items = (guint16 *) data;
+
+        for (i = 0; i < n_items; i++)
+          items[i] = GUINT16_SWAP_LE_BE (items[i]);
+      }
+      break;
+
+    case 4:
+      {
+        guint32 *items = (guint32 *) data;
+
+        for (i = 0; i < n_items; i++)
+          items[i] = GUINT32_SWAP_LE_BE (items[i]);
+      }
+      break;
+
+    default:
+      {
+        guint64 *items = (guint64 *) data;
+
+        for (i = 0; i < n_items; i++)
+          items[i] = GUINT64_SWAP_LE_BE (items[i]);
+      }
+      break;
+  }
+}
+
+static gsize
+scalar_span_basic (const guchar *data,
+                   gsize         size)
+{
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    if (data[i] == '\0' || strchr (basic_types, data[i]) == NULL)
+      break;
+
+  return i;
+}
+
+static const GVariantVectorKernels scalar_kernels =
+{
+  scalar_check_booleans,
+  scalar_find_nul,
+  scalar_check_offsets,
+  scalar_byteswap,
+  scalar_span_basic
+};
+
+#ifdef G_VARIANT_VECTOR_X86
+/* == SSE2 == */
+SSE2 static gboolean
+sse2_check_booleans (const guchar *data,
+                     gsize         size)
+{
+  const __m128i ones = _mm_set1_epi8 (1);
+  __m128i bad = _mm_setzero_si128 ();
+  gsize i;
+
+  /* saturating subtraction of 1 leaves non-zero only for bytes > 1 */
+  for (i = 0; i + 16 <= size; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (data + i));
+      bad = _mm_or_si128 (bad, _mm_subs_epu8 (v, ones));
+    }
+
+  if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (bad, _mm_setzero_si128 ()))
+      != 0xffff)
+    return FALSE;
+
+  return scalar_check_booleans (data + i, size - i);
+}
+
+SSE2 static gsize
+sse2_find_nul (const guchar *data,
+               gsize         size)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  gsize i;
+
+  for (i = 0; i + 16 <= size; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (data + i));
+      gint mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero));
+
+      if (mask)
+        return i + __builtin_ctz (mask);
+    }
+
+  return i + scalar_find_nul (data + i, size - i);
+}
+
+/* each step compares the vector of offsets starting at i against the
+ * same vector shifted by one offset; every offset must be no greater
+ * than its successor.  the last vector overlaps with the scalar tail.
+ */
+SSE2 static gboolean
+sse2_check_offsets (const guchar *offsets,
+                    gsize         n_offsets,
+                    guint         offset_size)
+{
+  const __m128i sign = _mm_set1_epi32 (0x80000000);
+  __m128i bad = _mm_setzero_si128 ();
+  gsize per_vector, i;
+
+  if (offset_size == 8)
+    /* no 64 bit comparisons in SSE2 */
+    return scalar_check_offsets (offsets, n_offsets, offset_size);
+
+  per_vector = 16 / offset_size;
+
+  for (i = 0; i + per_vector + 1 <= n_offsets; i += per_vector)
+    {
+      const guchar *ptr = offsets + i * offset_size;
+      __m128i a = _mm_loadu_si128 ((const __m128i *) ptr);
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (ptr + offset_size));
+
+      switch (offset_size)
+      {
+        case 1:
+          bad = _mm_or_si128 (bad, _mm_subs_epu8 (a, b));
+          break;
+
+        case 2:
+          bad = _mm_or_si128 (bad, _mm_subs_epu16 (a, b));
+          break;
+
+        default:
+          bad = _mm_or_si128 (bad,
+                              _mm_cmpgt_epi32 (_mm_xor_si128 (a, sign),
+                                               _mm_xor_si128 (b, sign)));
+          break;
+      }
+    }
+
+  if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (bad, _mm_setzero_si128 ()))
+      != 0xffff)
+    return FALSE;
+
+  return scalar_check_offsets (offsets + i * offset_size,
+                               n_offsets - i, offset_size);
+}
+
+/* SSE2 has no byte shuffle, so the words within each item are
+ * reversed with the 16 bit shuffles and then the two bytes of each
+ * word are swapped with shifts.
+ */
+SSE2 static void
+sse2_byteswap (guchar *data,
+               gsize   n_items,
+               guint   item_size)
+{
+  gsize per_vector, i;
+
+  per_vector = 16 / item_size;
+
+  for (i = 0; i + per_vector <= n_items; i += per_vector)
+    {
+      __m128i *ptr = (__m128i *) (data + i * item_size);
+      __m128i v = _mm_loadu_si128 (ptr);
+
+      switch (item_size)
+      {
+        case 4:
+          v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+          v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+          break;
+
+        case 8:
+          v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (0, 1, 2, 3));
+          v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (0, 1, 2, 3));
+          break;
+      }
+
+      v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+      _mm_storeu_si128 (ptr, v);
+    }
+
+  scalar_byteswap (data + i * item_size, n_items - i, item_size);
+}
+
+/* each byte is compared against every basic type character */
+SSE2 static gsize
+sse2_span_basic (const guchar *data,
+                 gsize         size)
+{
+  gsize i;
+
+  for (i = 0; i + 16 <= size; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (data + i));
+      __m128i basic = _mm_setzero_si128 ();
+      gint mask, j;
+
+      for (j = 0; basic_types[j]; j++)
+        basic = _mm_or_si128 (basic,
+                              _mm_cmpeq_epi8 (v, _mm_set1_epi8 (basic_types[j])));
+
+      mask = _mm_movemask_epi8 (basic) ^ 0xffff;
+
+      if (mask)
+        return i + __builtin_ctz (mask);
+    }
+
+  return i + scalar_span_basic (data + i, size - i);
+}
+
+static const GVariantVectorKernels sse2_kernels =
+{
+  sse2_check_booleans,
+  sse2_find_nul,
+  sse2_check_offsets,
+  sse2_byteswap,
+  sse2_span_basic
+};
+
+/* == AVX2 == */
+/* the upper halves of the ymm registers are always cleared before
+ * leaving these functions (or calling the scalar code) to avoid the
+ * penalty for mixing AVX and legacy SSE instructions.
+ */
+AVX2 static gboolean
+avx2_check_booleans (const guchar *data,
+                     gsize         size)
+{
+  const __m256i ones = _mm256_set1_epi8 (1);
+  __m256i bad = _mm256_setzero_si256 ();
+  gboolean ok;
+  gsize i;
+
+  for (i = 0; i + 32 <= size; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (data + i));
+      bad = _mm256_or_si256 (bad, _mm256_subs_epu8 (v, ones));
+    }
+
+  ok = _mm256_testz_si256 (bad, bad);
+  _mm256_zeroupper ();
+
+  if (!ok)
+    return FALSE;
+
+  return scalar_check_booleans (data + i, size - i);
+}
+
+AVX2 static gsize
+avx2_find_nul (const guchar *data,
+               gsize         size)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  gsize i;
+
+  for (i = 0; i + 32 <= size; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (data + i));
+      guint mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, zero));
+
+      if (mask)
+        {
+          _mm256_zeroupper ();
+          return i + __builtin_ctz (mask);
+        }
+    }
+
+  _mm256_zeroupper ();
+
+  return i + scalar_find_nul (data + i, size - i);
+}
+
+AVX2 static gboolean
+avx2_check_offsets (const guchar *offsets,
+                    gsize         n_offsets,
+                    guint         offset_size)
+{
+  const __m256i sign32 = _mm256_set1_epi32 (0x80000000);
+  const __m256i sign64 = _mm256_set1_epi64x (G_GINT64_CONSTANT (1) << 63);
+  __m256i bad = _mm256_setzero_si256 ();
+  gsize per_vector, i;
+  gboolean ok;
+
+  per_vector = 32 / offset_size;
+
+  for (i = 0; i + per_vector + 1 <= n_offsets; i += per_vector)
+    {
+      const guchar *ptr = offsets + i * offset_size;
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) ptr);
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (ptr + offset_size));
+
+      switch (offset_size)
+      {
+        case 1:
+          bad = _mm256_or_si256 (bad, _mm256_subs_epu8 (a, b));
+          break;
+
+        case 2:
+          bad = _mm256_or_si256 (bad, _mm256_subs_epu16 (a, b));
+          break;
+
+        case 4:
+          bad = _mm256_or_si256 (bad,
+                                 _mm256_cmpgt_epi32 (_mm256_xor_si256 (a, sign32),
+                                                     _mm256_xor_si256 (b, sign32)));
+          break;
+
+        default:
+          bad = _mm256_or_si256 (bad,
+                                 _mm256_cmpgt_epi64 (_mm256_xor_si256 (a, sign64),
+                                                     _mm256_xor_si256 (b, sign64)));
+          break;
+      }
+    }
+
+  ok = _mm256_testz_si256 (bad, bad);
+  _mm256_zeroupper ();
+
+  if (!ok)
+    return FALSE;
+
+  return scalar_check_offsets (offsets + i * offset_size,
+                               n_offsets - i, offset_size);
+}
+
+AVX2 static void
+avx2_byteswap (guchar *data,
+               gsize   n_items,
+               guint   item_size)
+{
+  gsize per_vector, i;
+  __m256i shuffle;
+
+  switch (item_size)
+  {
+    case 2:
+      shuffle = _mm256_setr_epi8 (1, 0, 3, 2, 5, 4, 7, 6,
+                                  9, 8, 11, 10, 13, 12, 15, 14,
+                                  1, 0, 3, 2, 5, 4, 7, 6,
+                                  9, 8, 11, 10, 13, 12, 15, 14);
+      break;
+
+    case 4:
+      shuffle = _mm256_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4,
+                                  11, 10, 9, 8, 15, 14, 13, 12,
+                                  3, 2, 1, 0, 7, 6, 5, 4,
+                                  11, 10, 9, 8, 15, 14, 13, 12);
+      break;
+
+    default:
+      shuffle = _mm256_setr_epi8 (7, 6, 5, 4, 3, 2, 1, 0,
+                                  15, 14, 13, 12, 11, 10, 9, 8,
+                                  7, 6, 5, 4, 3, 2, 1, 0,
+                                  15, 14, 13, 12, 11, 10, 9, 8);
+      break;
+  }
+
+  per_vector = 32 / item_size;
+
+  for (i = 0; i + per_vector <= n_items; i += per_vector)
+    {
+      __m256i *ptr = (__m256i *) (data + i * item_size);
+
+      _mm256_storeu_si256 (ptr, _mm256_shuffle_epi8 (_mm256_loadu_si256 (ptr),
+                                                     shuffle));
+    }
+
+  _mm256_zeroupper ();
+
+  scalar_byteswap (data + i * item_size, n_items - i, item_size);
+}
+
+AVX2 static gsize
+avx2_span_basic (const guchar *data,
+                 gsize         size)
+{
+  gsize i;
+
+  for (i = 0; i + 32 <= size; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (data + i));
+      __m256i basic = _mm256_setzero_si256 ();
+      guint mask;
+      gint j;
+
+      for (j = 0; basic_types[j]; j++)
+        basic = _mm256_or_si256 (basic,
+                                 _mm256_cmpeq_epi8 (v,
+                                   _mm256_set1_epi8 (basic_types[j])));
+
+      mask = ~(guint) _mm256_movemask_epi8 (basic);
+
+      if (mask)
+        {
+          _mm256_zeroupper ();
+          return i + __builtin_ctz (mask);
+        }
+    }
+
+  _mm256_zeroupper ();
+
+  return i + scalar_span_basic (data + i, size - i);
+}
+
+static const GVariantVectorKernels avx2_kernels =
+{
+  avx2_check_booleans,
+  avx2_find_nul,
+  avx2_check_offsets,
+  avx2_byteswap,
+  avx2_span_basic
+};
+#endif /* G_VARIANT_VECTOR_X86 */
+
+/* == dispatch == */
+static const GVariantVectorKernels *
+g_variant_vector_select (void)
+{
+  const gchar *limit;
+  gboolean sse2, avx2;
+
+  limit = g_getenv ("GVARIANT_VECTOR");
+  sse2 = limit == NULL || strcmp (limit, "scalar") != 0;
+  avx2 = sse2 && (limit == NULL || strcmp (limit, "sse2") != 0);
+
+#ifdef G_VARIANT_VECTOR_X86
+  __builtin_cpu_init ();
+
+  if (avx2 && __builtin_cpu_supports ("avx2"))
+    return &avx2_kernels;
+
+  if (sse2 && __builtin_cpu_supports ("sse2"))
+    return &sse2_kernels;
+#endif
+
+  return &scalar_kernels;
+}
+
+static const GVariantVectorKernels *
+g_variant_vector_get_kernels (void)
+{
+  static gpointer kernels;
+  gpointer selected;
+
+  selected = g_atomic_pointer_get (&kernels);
+
+  if G_UNLIKELY (selected == NULL)
+    {
+      /* racing threads all make the same choice */
+      selected = (gpointer) g_variant_vector_select ();
+      g_atomic_pointer_compare_and_exchange (&kernels, NULL, selected);
+    }
+
+  return selected;
+}
+
+/*
+ * g_variant_vector_check_booleans:
+ * @data: a pointer to an array of booleans
+ * @size: the number of booleans
+ * @returns: %TRUE if each byte is either 0 or 1
+ */
+gboolean
+g_variant_vector_check_booleans (const guchar *data,
+                                 gsize         size)
+{
+  return g_variant_vector_get_kernels ()->check_booleans (data, size);
+}
+
+/*
+ * g_variant_vector_find_nul:
+ * @data: a pointer to some bytes
+ * @size: the number of bytes at @data
+ * @returns: the index of the first nul byte, or @size
+ *
+ * Like memchr() for '\0', but returning an index.
+ */
+gsize
+g_variant_vector_find_nul (const guchar *data,
+                           gsize         size)
+{
+  return g_variant_vector_get_kernels ()->find_nul (data, size);
+}
+
+/*
+ * g_variant_vector_check_offsets:
+ * @offsets: a pointer to an offset table
+ * @n_offsets: the number of offsets in the table
+ * @offset_size: the size of each offset (1, 2, 4 or 8)
+ * @limit: the largest permissible offset
+ * @returns: %TRUE if the offsets are ordered and within bounds
+ *
+ * Checks that the little endian offsets at @offsets are in
+ * non-decreasing order and that none of them exceed @limit.
+ */
+gboolean
+g_variant_vector_check_offsets (const guchar *offsets,
+                                gsize         n_offsets,
+                                guint         offset_size,
+                                gsize         limit)
+{
+  if (n_offsets == 0)
+    return TRUE;
+
+  /* if they are in order then the last one is the largest */
+  if (g_variant_serialiser_read_offset (offsets +
+                                        (n_offsets - 1) * offset_size,
+                                        offset_size) > limit)
+    return FALSE;
+
+  return g_variant_vector_get_kernels ()->check_offsets (offsets, n_offsets,
+                                                         offset_size);
+}
+
+/*
+ * g_variant_vector_byteswap:
+ * @data: a pointer to an array of integers
+ * @n_items: the number of integers
+ * @item_size: the size of each integer (2, 4 or 8)
+ *
+ * Reverses the byte order of each of the @n_items integers at @data,
+ * in place.  @data must be aligned to @item_size.
+ */
+void
+g_variant_vector_byteswap (guchar *data,
+                           gsize   n_items,
+                           guint   item_size)
+{
+  g_variant_vector_get_kernels ()->byteswap (data, n_items, item_size);
+}
+
+/*
+ * g_variant_vector_span_basic:
+ * @data: a pointer to some bytes
+ * @size: the number of bytes at @data
+ * @returns: the length of the initial run of basic type characters
+ *
+ * Like strspn() with the characters that are each a complete concrete
+ * type on their own ("bynqiuxtdsogv"), but limited to @size bytes.
+ */
+gsize
+g_variant_vector_span_basic (const guchar *data,
+                             gsize         size)
+{
+  return g_variant_vector_get_kernels ()->span_basic (data, size);
+}
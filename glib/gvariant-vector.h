@@ -0,0 +1,35 @@
+/*
+ * Copyright © 2008 Ryan Lortie
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of version 3 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * See the included COPYING file for more information.
+ */
+
+#ifndef _gvariant_vector_h_
+#define _gvariant_vector_h_
+
+#include <glib/gtypes.h>
+
+/* validation */
+gboolean                        g_variant_vector_check_booleans         (const guchar *data,
+                                                                         gsize         size);
+gsize                           g_variant_vector_find_nul               (const guchar *data,
+                                                                         gsize         size);
+gboolean                        g_variant_vector_check_offsets          (const guchar *offsets,
+                                                                         gsize         n_offsets,
+                                                                         guint         offset_size,
+                                                                         gsize         limit);
+
+/* signatures */
+gsize                           g_variant_vector_span_basic             (const guchar *data,
+                                                                         gsize         size);
+
+/* byteswapping */
+void                            g_variant_vector_byteswap               (guchar       *data,
+                                                                         gsize         n_items,
+                                                                         guint         item_size);
+
+#endif /* _gvariant_vector_h_ */
@@ -92,6 +92,16 @@ gconstpointer                   g_variant_get_fixed                     (GVarian
 gconstpointer                   g_variant_get_fixed_array               (GVariant             *value,
                                                                          gsize                 elem_size,
                                                                          gsize                *length);
+GVariant                       *g_variant_new_fixed_array               (const GVariantType   *elem_type,
+                                                                         gconstpointer         elements,
+                                                                         gsize                 n_elements,
+                                                                         gsize                 elem_size);
+GVariant                       *g_variant_new_fixed_array_full          (const GVariantType   *elem_type,
+                                                                         gconstpointer         elements,
+                                                                         gsize                 n_elements,
+                                                                         gsize                 elem_size,
+                                                                         GDestroyNotify        notify,
+                                                                         gpointer              user_data);
 GVariant                       *g_variant_get_child                     (GVariant             *value,
                                                                          gsize                 index);
 gsize                           g_variant_n_children                    (GVariant             *value);
@@ -100,6 +110,8 @@ gsize                           g_variant_n_children                    (GVarian
 gsize                           g_variant_iter_init                     (GVariantIter         *iter,
                                                                          GVariant             *value);
 GVariant                       *g_variant_iter_next                     (GVariantIter         *iter);
+gconstpointer                   g_variant_iter_next_fixed               (GVariantIter         *iter,
+                                                                         gsize                 elem_size);
 void                            g_variant_iter_cancel                   (GVariantIter         *iter);
 gboolean                        g_variant_iter_was_cancelled            (GVariantIter         *iter);
 gboolean                        g_variant_iterate                       (GVariantIter         *iter,
@@ -124,6 +136,10 @@ gboolean                        g_variant_builder_check_end             (GVarian
                                                                          GError              **error);
 GVariantBuilder                *g_variant_builder_new                   (GVariantTypeClass     class,
                                                                          const GVariantType   *type);
+GVariantBuilder                *g_variant_builder_new_arena             (GVariantTypeClass     class,
+                                                                         const GVariantType   *type);
+void                            g_variant_builder_reserve               (GVariantBuilder      *builder,
+                                                                         gsize                 n_children);
 GVariant                       *g_variant_builder_end                   (GVariantBuilder      *builder);
 void                            g_variant_builder_cancel                (GVariantBuilder      *builder);
 
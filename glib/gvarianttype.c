@@ -90,6 +90,36 @@ g_variant_type_check (const GVariantType *type)
   return g_variant_type_string_scan (&type_string, NULL);
 }
 
+/* the type string scanners work from this table.  CHAR_KEY is any
+ * type that may be the key of a dictionary entry.
+ */
+enum
+{
+  CHAR_INVALID,
+  CHAR_KEY,
+  CHAR_TYPE,
+  CHAR_PREFIX,
+  CHAR_OPEN_STRUCT,
+  CHAR_CLOSE_STRUCT,
+  CHAR_OPEN_DICT_ENTRY,
+  CHAR_CLOSE_DICT_ENTRY
+};
+
+static const guchar g_variant_type_char_class[256] =
+{
+  ['b'] = CHAR_KEY, ['y'] = CHAR_KEY, ['n'] = CHAR_KEY, ['q'] = CHAR_KEY,
+  ['i'] = CHAR_KEY, ['u'] = CHAR_KEY, ['x'] = CHAR_KEY, ['t'] = CHAR_KEY,
+  ['d'] = CHAR_KEY, ['s'] = CHAR_KEY, ['o'] = CHAR_KEY, ['g'] = CHAR_KEY,
+  ['?'] = CHAR_KEY,
+
+  ['v'] = CHAR_TYPE, ['r'] = CHAR_TYPE, ['*'] = CHAR_TYPE,
+
+  ['a'] = CHAR_PREFIX, ['m'] = CHAR_PREFIX,
+
+  ['('] = CHAR_OPEN_STRUCT, [')'] = CHAR_CLOSE_STRUCT,
+  ['{'] = CHAR_OPEN_DICT_ENTRY, ['}'] = CHAR_CLOSE_DICT_ENTRY
+};
+
 /**
  * g_variant_type_string_scan:
  * @type_string: a pointer to any string
@@ -108,6 +138,10 @@ g_variant_type_check (const GVariantType *type)
  * the type string does not end before @limit then %FALSE is returned
  * and the state of the @type_string pointer is undefined.
  *
+ * Structures and dictionary entries may be nested at most
+ * %G_VARIANT_TYPE_MAX_NESTING deep.  The scan is done in a single pass
+ * with no recursion.
+ *
  * For the simple case of checking if a string is a valid type string,
  * see g_variant_type_string_is_valid().
  **/
@@ -115,52 +149,87 @@ gboolean
 g_variant_type_string_scan (const gchar **type_string,
                             const gchar  *limit)
 {
-  if (*type_string == limit)
-    return FALSE;
+  const gchar *string = *type_string;
+  guint64 dict_entries = 0;   /* bit 0 is the innermost container */
+  gboolean prefixed = FALSE;
+  guint depth = 0;
+
+  /* the common case of a single basic type */
+  if G_LIKELY (string != limit &&
+               g_variant_type_char_class[(guchar) *string] == CHAR_KEY)
+    {
+      *type_string = string + 1;
+      return TRUE;
+    }
 
-  switch (*(*type_string)++)
-  {
-    case '\0':
-      return FALSE;
+  while (TRUE)
+    {
+      if (string == limit)
+        return FALSE;
 
-    case '(':
-      while (*type_string != limit && **type_string != ')')
-        if (!g_variant_type_string_scan (type_string, limit))
-          return FALSE;
+      switch (g_variant_type_char_class[(guchar) *string++])
+      {
+        case CHAR_KEY:
+        case CHAR_TYPE:
+          break;
 
-      if (*type_string == limit)
-        return FALSE;
+        case CHAR_PREFIX:
+          prefixed = TRUE;
+          continue;
 
-      (*type_string)++; /* ')' */
+        case CHAR_OPEN_STRUCT:
+          if (depth == G_VARIANT_TYPE_MAX_NESTING)
+            return FALSE;
 
-      return TRUE;
+          dict_entries <<= 1;
+          depth++;
+          prefixed = FALSE;
+          continue;
 
-    case '{':
-      if (*type_string == limit || **type_string == '\0')
-        return FALSE;
+        case CHAR_OPEN_DICT_ENTRY:
+          if (depth == G_VARIANT_TYPE_MAX_NESTING || string == limit ||
+              g_variant_type_char_class[(guchar) *string++] != CHAR_KEY)
+            return FALSE;
 
-      if (!strchr ("bynqiuxtdsog?", *(*type_string)++))        /* key */
-        return FALSE;
+          dict_entries = (dict_entries << 1) | 1;
+          depth++;
+          prefixed = FALSE;
+          continue;
 
-      if (!g_variant_type_string_scan (type_string, limit))    /* value */
-        return FALSE;
+        case CHAR_CLOSE_STRUCT:
+          /* not after 'a' or 'm' and not in a dictionary entry */
+          if (depth == 0 || prefixed || (dict_entries & 1))
+            return FALSE;
 
-      if (*type_string == limit || *(*type_string)++ != '}')
-        return FALSE;
+          dict_entries >>= 1;
+          depth--;
+          break;
 
-      return TRUE;
+        default:
+          return FALSE;
+      }
 
-    case 'm': case 'a':
-      return g_variant_type_string_scan (type_string, limit);  /* tailcall */
+      /* a complete type was found.  it was the value of any dictionary
+       * entries that it ends.
+       */
+      prefixed = FALSE;
 
-    case 'b': case 'y': case 'n': case 'q': case 'i': case 'u':
-    case 'x': case 't': case 'd': case 's': case 'o': case 'g':
-    case 'v': case 'r': case '*': case '?':
-      return TRUE;
+      while (dict_entries & 1)
+        {
+          if (string == limit || *string++ != '}')
+            return FALSE;
 
-    default:
-      return FALSE;
-  }
+          dict_entries >>= 1;
+          depth--;
+        }
+
+      if (depth == 0)
+        break;
+    }
+
+  *type_string = string;
+
+  return TRUE;
 }
 
 /**
@@ -521,7 +590,7 @@ g_variant_type_matches (const GVariantType *type,
 
       else
         {
-          const GVariantType *target_type = G_VARIANT_TYPE (type_string);
+          const GVariantType *target_type = (const GVariantType *) type_string;
 
           if (!g_variant_type_is_in_class (target_type, pattern_char))
             return FALSE;
@@ -247,6 +247,14 @@ typedef enum
  **/
 #define G_VARIANT_TYPE_ANY_DICTIONARY       ((const GVariantType *) "ae")
 
+/**
+ * G_VARIANT_TYPE_MAX_NESTING:
+ *
+ * The deepest that structures and dictionary entries may be nested in
+ * a valid type string.  Array and maybe types do not count.
+ **/
+#define G_VARIANT_TYPE_MAX_NESTING          64
+
 #pragma GCC visibility push (default)
 
 /* type string checking */
@@ -10,14 +10,16 @@
 
 #include "gvarianttypeinfo.h"
 #include <glib.h>
+#include <string.h>
 
 struct OPAQUE_TYPE__GVariantTypeInfo
 {
-  GVariantType *type;
+  const GVariantType *type;
 
   gsize fixed_size;
   guchar info_class;
   guchar alignment;
+  guchar immortal;
   gint ref_count;
 };
 
@@ -358,53 +360,246 @@ base_info_free (GVariantTypeInfo *info)
   g_slice_free (GVariantTypeInfo, info);
 }
 
-/* == new/ref/unref == */
-static GStaticRecMutex g_variant_type_info_lock = G_STATIC_REC_MUTEX_INIT;
-static GHashTable *g_variant_type_info_table;
+/* == immortal ==
+ *
+ * The basic types and a few very common containers have statically
+ * allocated infos.  These are never entered into the table and are
+ * never reference counted, so getting and dropping one of them does
+ * not write to any memory that is shared between threads.  ref_count
+ * is kept at 1 so that the assertions in the query functions hold.
+ */
+#define IMMORTAL_INFO(type_string, class, alignment, fixed_size) \
+  { (GVariantType *) type_string, fixed_size, class, alignment - 1, TRUE, 1 }
 
-GVariantTypeInfo *
-g_variant_type_info_get (const GVariantType *type)
+static GVariantTypeInfo g_variant_type_info_basic[] =
 {
-  GVariantTypeInfo *info;
+  IMMORTAL_INFO ("b", BASE_INFO_CLASS, 1, 1),
+  IMMORTAL_INFO ("y", BASE_INFO_CLASS, 1, 1),
+  IMMORTAL_INFO ("n", BASE_INFO_CLASS, 2, 2),
+  IMMORTAL_INFO ("q", BASE_INFO_CLASS, 2, 2),
+  IMMORTAL_INFO ("i", BASE_INFO_CLASS, 4, 4),
+  IMMORTAL_INFO ("u", BASE_INFO_CLASS, 4, 4),
+  IMMORTAL_INFO ("x", BASE_INFO_CLASS, 8, 8),
+  IMMORTAL_INFO ("t", BASE_INFO_CLASS, 8, 8),
+  IMMORTAL_INFO ("d", BASE_INFO_CLASS, 8, 8),
+  IMMORTAL_INFO ("s", BASE_INFO_CLASS, 1, 0),
+  IMMORTAL_INFO ("o", BASE_INFO_CLASS, 1, 0),
+  IMMORTAL_INFO ("g", BASE_INFO_CLASS, 1, 0),
+  IMMORTAL_INFO ("v", BASE_INFO_CLASS, 8, 0)
+};
 
-  if G_UNLIKELY (g_variant_type_info_table == NULL)
-    g_variant_type_info_table = g_hash_table_new (g_variant_type_hash,
-                                                  g_variant_type_equal);
+#define BASIC_INFO(index) (&g_variant_type_info_basic[index])
 
-  g_static_rec_mutex_lock (&g_variant_type_info_lock);
-  info = g_hash_table_lookup (g_variant_type_info_table, type);
+static ArrayInfo g_variant_type_info_as =
+  { IMMORTAL_INFO ("as", ARRAY_INFO_CLASS, 1, 0), BASIC_INFO (9) };
+static ArrayInfo g_variant_type_info_ay =
+  { IMMORTAL_INFO ("ay", ARRAY_INFO_CLASS, 1, 0), BASIC_INFO (1) };
+static ArrayInfo g_variant_type_info_av =
+  { IMMORTAL_INFO ("av", ARRAY_INFO_CLASS, 8, 0), BASIC_INFO (12) };
 
-  if (info == NULL)
-    {
-      GVariantTypeClass class;
+/* the table that struct_generate_table() makes for "{sv}" */
+static GVariantMemberInfo g_variant_type_info_sv_members[] =
+{
+  { BASIC_INFO (9), STRUCT_MEMBER_LAST, 0, ~0, 0 },
+  { BASIC_INFO (12), 0, 7, ~7, 0 }
+};
 
-      class = g_variant_type_get_class (type);
+static StructInfo g_variant_type_info_sv =
+  { IMMORTAL_INFO ("{sv}", STRUCT_INFO_CLASS, 8, 0),
+    g_variant_type_info_sv_members, 2 };
+static ArrayInfo g_variant_type_info_asv =
+  { IMMORTAL_INFO ("a{sv}", ARRAY_INFO_CLASS, 8, 0),
+    &g_variant_type_info_sv.self };
 
-      switch (class)
+static GVariantTypeInfo *
+g_variant_type_info_get_immortal (const GVariantType *type)
+{
+  const gchar *string = (const gchar *) type;
+
+  switch (string[0])
+  {
+    case 'b': return BASIC_INFO (0);
+    case 'y': return BASIC_INFO (1);
+    case 'n': return BASIC_INFO (2);
+    case 'q': return BASIC_INFO (3);
+    case 'i': return BASIC_INFO (4);
+    case 'u': return BASIC_INFO (5);
+    case 'x': return BASIC_INFO (6);
+    case 't': return BASIC_INFO (7);
+    case 'd': return BASIC_INFO (8);
+    case 's': return BASIC_INFO (9);
+    case 'o': return BASIC_INFO (10);
+    case 'g': return BASIC_INFO (11);
+    case 'v': return BASIC_INFO (12);
+
+    case 'a':
+      switch (string[1])
       {
-        case G_VARIANT_TYPE_CLASS_MAYBE:
-        case G_VARIANT_TYPE_CLASS_ARRAY:
-          info = array_info_new (type);
-          break;
+        case 's': return &g_variant_type_info_as.self;
+        case 'y': return &g_variant_type_info_ay.self;
+        case 'v': return &g_variant_type_info_av.self;
 
-        case G_VARIANT_TYPE_CLASS_STRUCT:
-        case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
-          info = struct_info_new (type);
-          break;
+        case '{':
+          if (string[2] == 's' && string[3] == 'v' && string[4] == '}')
+            return &g_variant_type_info_asv.self;
+          return NULL;
 
         default:
-          info = base_info_new (class);
-          break;
+          return NULL;
       }
 
-      info->type = g_variant_type_copy (type);
-      g_hash_table_insert (g_variant_type_info_table, info->type, info);
-      info->ref_count = 1;
+    case '{':
+      if (string[1] == 's' && string[2] == 'v' && string[3] == '}')
+        return &g_variant_type_info_sv.self;
+      return NULL;
+
+    default:
+      return NULL;
+  }
+}
+
+/* == new/ref/unref ==
+ *
+ * The table of type infos is split into shards by the hash of the type
+ * so that threads looking up different types rarely meet on the same
+ * lock.  The lock is held to look up or add an info and to drop the
+ * last reference to one, so a lookup can never find an info that is
+ * being freed.  A new info is built (which may involve getting the
+ * infos of its element or member types) without holding any lock.
+ *
+ * Since there is only ever one info for a given type, the type of an
+ * info is the canonical copy of that type for as long as the info is
+ * alive: two such types are equal exactly when they are the same
+ * pointer.  The copy is freed along with the info, so anyone relying
+ * on this must hold a reference on the info.  Nothing outlives its
+ * info, so types taken from untrusted data never pile up.
+ */
+#define G_VARIANT_TYPE_INFO_SHARDS 32
+
+typedef struct
+{
+  GStaticMutex lock;
+  GHashTable *table;
+} GVariantTypeInfoShard;
+
+static GVariantTypeInfoShard g_variant_type_info_shards[G_VARIANT_TYPE_INFO_SHARDS];
+static GStaticMutex g_variant_type_info_init_lock = G_STATIC_MUTEX_INIT;
+static gint g_variant_type_info_initialised;
+
+static GVariantTypeInfoShard *
+g_variant_type_info_shard (const GVariantType *type)
+{
+  if G_UNLIKELY (!g_atomic_int_get (&g_variant_type_info_initialised))
+    {
+      g_static_mutex_lock (&g_variant_type_info_init_lock);
+
+      if (!g_variant_type_info_initialised)
+        {
+          gint i;
+
+          for (i = 0; i < G_VARIANT_TYPE_INFO_SHARDS; i++)
+            {
+              GVariantTypeInfoShard *shard = &g_variant_type_info_shards[i];
+
+              g_static_mutex_init (&shard->lock);
+              shard->table = g_hash_table_new (g_variant_type_hash,
+                                               g_variant_type_equal);
+            }
+
+          g_atomic_int_set (&g_variant_type_info_initialised, TRUE);
+        }
+
+      g_static_mutex_unlock (&g_variant_type_info_init_lock);
+    }
+
+  return &g_variant_type_info_shards[g_variant_type_hash (type) %
+                                     G_VARIANT_TYPE_INFO_SHARDS];
+}
+
+static void
+g_variant_type_info_free (GVariantTypeInfo *info)
+{
+  g_variant_type_free ((GVariantType *) info->type);
+
+  switch (info->info_class)
+  {
+    case ARRAY_INFO_CLASS:
+      array_info_free (info);
+      break;
+
+    case STRUCT_INFO_CLASS:
+      struct_info_free (info);
+      break;
+
+    case BASE_INFO_CLASS:
+      base_info_free (info);
+      break;
+
+    default:
+      g_error ("GVariantTypeInfo with invalid class '%c'",
+               info->info_class);
+  }
+}
+
+GVariantTypeInfo *
+g_variant_type_info_get (const GVariantType *type)
+{
+  GVariantTypeInfoShard *shard;
+  GVariantTypeInfo *info, *new;
+  GVariantTypeClass class;
+
+  if ((info = g_variant_type_info_get_immortal (type)))
+    return info;
+
+  shard = g_variant_type_info_shard (type);
+
+  g_static_mutex_lock (&shard->lock);
+  info = g_hash_table_lookup (shard->table, type);
+  if (info != NULL)
+    g_atomic_int_inc (&info->ref_count);
+  g_static_mutex_unlock (&shard->lock);
+
+  if (info != NULL)
+    return info;
+
+  class = g_variant_type_get_class (type);
+
+  switch (class)
+  {
+    case G_VARIANT_TYPE_CLASS_MAYBE:
+    case G_VARIANT_TYPE_CLASS_ARRAY:
+      new = array_info_new (type);
+      break;
+
+    case G_VARIANT_TYPE_CLASS_STRUCT:
+    case G_VARIANT_TYPE_CLASS_DICT_ENTRY:
+      new = struct_info_new (type);
+      break;
+
+    default:
+      new = base_info_new (class);
+      break;
+  }
+
+  new->type = g_variant_type_copy (type);
+  new->ref_count = 1;
+  new->immortal = FALSE;
+
+  /* another thread may have added the same type in the meantime */
+  g_static_mutex_lock (&shard->lock);
+  info = g_hash_table_lookup (shard->table, type);
+  if (info == NULL)
+    {
+      g_hash_table_insert (shard->table, (gpointer) new->type, new);
+      info = new;
+      new = NULL;
     }
   else
-    g_variant_type_info_ref (info);
+    g_atomic_int_inc (&info->ref_count);
+  g_static_mutex_unlock (&shard->lock);
 
-  g_static_rec_mutex_unlock (&g_variant_type_info_lock);
+  if (new != NULL)
+    g_variant_type_info_free (new);
 
   return info;
 }
@@ -412,6 +607,9 @@ g_variant_type_info_get (const GVariantType *type)
 GVariantTypeInfo *
 g_variant_type_info_ref (GVariantTypeInfo *info)
 {
+  if (info->immortal)
+    return info;
+
   g_assert_cmpint (info->ref_count, >, 0);
   g_atomic_int_inc (&info->ref_count);
 
@@ -421,33 +619,187 @@ g_variant_type_info_ref (GVariantTypeInfo *info)
 void
 g_variant_type_info_unref (GVariantTypeInfo *info)
 {
-  g_assert_cmpint (info->ref_count, >, 0);
+  GVariantTypeInfoShard *shard;
+  gint ref_count;
+
+  if (info->immortal)
+    return;
 
-  if (g_atomic_int_dec_and_test (&info->ref_count))
+  /* the last reference is only ever dropped under the lock */
+  do
     {
-      g_static_rec_mutex_lock (&g_variant_type_info_lock);
-      g_hash_table_remove (g_variant_type_info_table, info->type);
-      g_static_rec_mutex_unlock (&g_variant_type_info_lock);
+      ref_count = g_atomic_int_get (&info->ref_count);
+      g_assert_cmpint (ref_count, >, 0);
 
-      g_variant_type_free (info->type);
+      if (ref_count == 1)
+        break;
+    }
+  while (!g_atomic_int_compare_and_exchange (&info->ref_count,
+                                             ref_count, ref_count - 1));
 
-      switch (info->info_class)
-      {
-        case ARRAY_INFO_CLASS:
-          array_info_free (info);
-          break;
+  if (ref_count == 1)
+    {
+      shard = g_variant_type_info_shard (info->type);
 
-        case STRUCT_INFO_CLASS:
-          struct_info_free (info);
-          break;
+      g_static_mutex_lock (&shard->lock);
 
-        case BASE_INFO_CLASS:
-          base_info_free (info);
-          break;
+      if (!g_atomic_int_dec_and_test (&info->ref_count))
+        {
+          /* someone got it from the table in the meantime */
+          g_static_mutex_unlock (&shard->lock);
+          return;
+        }
 
-        default:
-          g_error ("GVariantTypeInfo with invalid class '%c'",
-                   info->info_class);
-      }
+      g_hash_table_remove (shard->table, info->type);
+      g_static_mutex_unlock (&shard->lock);
+
+      g_variant_type_info_free (info);
     }
 }
+
+/* == per-thread cache ==
+ *
+ * The child of a variant has its type given by a type string in the
+ * serialised data.  Looking it up from there means copying the string
+ * (since the data might be changed under us), validating it and then
+ * going to the table.  Values of the same few types tend to be found
+ * over and over again (think of a{sv}), so each thread keeps the last
+ * type infos that it looked up this way, keyed on the raw bytes.
+ */
+#define G_VARIANT_TYPE_INFO_CACHE_SIZE 32
+
+typedef struct
+{
+  GVariantTypeInfo *info;
+  gsize length;
+} GVariantTypeInfoCacheEntry;
+
+typedef struct
+{
+  GVariantTypeInfoCacheEntry entries[G_VARIANT_TYPE_INFO_CACHE_SIZE];
+
+  /* counts not yet added to the g_variant_type_info_cache_* */
+  guint hits;
+  guint misses;
+} GVariantTypeInfoCache;
+
+static GStaticPrivate g_variant_type_info_cache = G_STATIC_PRIVATE_INIT;
+static gint g_variant_type_info_cache_hits;
+static gint g_variant_type_info_cache_misses;
+
+static void
+g_variant_type_info_cache_flush (GVariantTypeInfoCache *cache)
+{
+  g_atomic_int_add (&g_variant_type_info_cache_hits, cache->hits);
+  g_atomic_int_add (&g_variant_type_info_cache_misses, cache->misses);
+  cache->hits = cache->misses = 0;
+}
+
+/* called when a thread exits */
+static void
+g_variant_type_info_cache_free (gpointer data)
+{
+  GVariantTypeInfoCache *cache = data;
+  gint i;
+
+  for (i = 0; i < G_VARIANT_TYPE_INFO_CACHE_SIZE; i++)
+    if (cache->entries[i].info)
+      g_variant_type_info_unref (cache->entries[i].info);
+
+  g_variant_type_info_cache_flush (cache);
+  g_free (cache);
+}
+
+/* private
+ *
+ * Gets the type info for the @length bytes of type string at @string,
+ * which need not be nul-terminated or valid.  %NULL is returned if the
+ * string is not a valid concrete type.  Otherwise, the type info is
+ * returned with a reference that the caller must drop.
+ */
+GVariantTypeInfo *
+g_variant_type_info_get_for_string (const gchar *string,
+                                    gsize        length)
+{
+  GVariantTypeInfoCacheEntry *entry;
+  GVariantTypeInfoCache *cache;
+  GVariantTypeInfo *info;
+  guint hash = 0;
+  gchar *copy;
+  gsize i;
+
+  cache = g_static_private_get (&g_variant_type_info_cache);
+
+  if G_UNLIKELY (cache == NULL)
+    {
+      cache = g_new0 (GVariantTypeInfoCache, 1);
+      g_static_private_set (&g_variant_type_info_cache, cache,
+                            &g_variant_type_info_cache_free);
+    }
+
+  for (i = 0; i < length; i++)
+    hash = (hash << 5) - hash + string[i];
+
+  /* if the bytes change while we look at them then either they don't
+   * match (and we do it the slow way) or they match a valid type.
+   */
+  entry = &cache->entries[hash % G_VARIANT_TYPE_INFO_CACHE_SIZE];
+  if (entry->info && entry->length == length &&
+      memcmp (entry->info->type, string, length) == 0)
+    {
+      cache->hits++;
+      return g_variant_type_info_ref (entry->info);
+    }
+
+  cache->misses++;
+  g_variant_type_info_cache_flush (cache);
+
+  copy = g_strndup (string, length);
+  if (strlen (copy) != length ||
+      !g_variant_type_string_is_valid (copy) ||
+      !g_variant_type_is_concrete (G_VARIANT_TYPE (copy)))
+    {
+      g_free (copy);
+      return NULL;
+    }
+
+  info = g_variant_type_info_get (G_VARIANT_TYPE (copy));
+  g_free (copy);
+
+  if (entry->info)
+    g_variant_type_info_unref (entry->info);
+  entry->info = g_variant_type_info_ref (info);
+  entry->length = length;
+
+  return info;
+}
+
+/* private
+ *
+ * Gets the hit and miss counts of the per-thread caches used by
+ * g_variant_type_info_get_for_string(), or resets them to zero if
+ * @reset is %TRUE.  The counts of the calling thread are up to date;
+ * those of other threads are added in on each miss and at thread exit.
+ */
+void
+g_variant_type_info_cache_stats (guint    *hits,
+                                 guint    *misses,
+                                 gboolean  reset)
+{
+  GVariantTypeInfoCache *cache;
+
+  if ((cache = g_static_private_get (&g_variant_type_info_cache)))
+    g_variant_type_info_cache_flush (cache);
+
+  if (reset)
+    {
+      g_atomic_int_set (&g_variant_type_info_cache_hits, 0);
+      g_atomic_int_set (&g_variant_type_info_cache_misses, 0);
+    }
+
+  if (hits)
+    *hits = g_atomic_int_get (&g_variant_type_info_cache_hits);
+
+  if (misses)
+    *misses = g_atomic_int_get (&g_variant_type_info_cache_misses);
+}
@@ -51,4 +51,11 @@ GVariantTypeInfo               *g_variant_type_info_get                 (const G
 GVariantTypeInfo               *g_variant_type_info_ref                 (GVariantTypeInfo   *typeinfo);
 void                            g_variant_type_info_unref               (GVariantTypeInfo   *typeinfo);
 
+/* per-thread cache */
+GVariantTypeInfo               *g_variant_type_info_get_for_string      (const gchar        *string,
+                                                                         gsize               length);
+void                            g_variant_type_info_cache_stats         (guint              *hits,
+                                                                         guint              *misses,
+                                                                         gboolean            reset);
+
 #endif /* _gvarianttypeinfo_h_ */
@@ -1,6 +1,12 @@
-#include <glib/gvariant.h>
+#include <glib/gvariant-loadstore.h>
 #include <glib/gtestutils.h>
+#include <glib/gfileutils.h>
+#include <glib/gstdio.h>
 #include <glib/grand.h>
+#include <glib/gtimer.h>
+#include <glib/gstrfuncs.h>
+#include <string.h>
+#include <unistd.h>
 
 gdouble
 ieee754ify (gdouble floating)
@@ -23,6 +29,77 @@ random_string (GRand *rand)
   return string;
 }
 
+static void
+verify_fixed (GVariant          *value,
+              GRand             *rand,
+              GVariantTypeClass  class,
+              gsize              length)
+{
+  GVariantIter iter;
+  gconstpointer item;
+  gsize elem_size;
+  gsize actual;
+
+  switch (class)
+    {
+      case G_VARIANT_TYPE_CLASS_UINT16:
+        elem_size = 2;
+        break;
+
+      case G_VARIANT_TYPE_CLASS_UINT32:
+        elem_size = 4;
+        break;
+
+      case G_VARIANT_TYPE_CLASS_DOUBLE:
+        elem_size = 8;
+        break;
+
+      default:
+        elem_size = 1;
+        break;
+    }
+
+  g_variant_iter_init (&iter, value);
+
+  actual = 0;
+  while ((item = g_variant_iter_next_fixed (&iter, elem_size)))
+    {
+      switch (class)
+        {
+          case G_VARIANT_TYPE_CLASS_BOOLEAN:
+            g_assert_cmpint (*(const guint8 *) item, ==,
+                             g_rand_int_range (rand, 0, 1));
+            break;
+
+          case G_VARIANT_TYPE_CLASS_BYTE:
+            g_assert_cmpint (*(const guint8 *) item, ==,
+                             g_rand_int_range (rand, 0, 256));
+            break;
+
+          case G_VARIANT_TYPE_CLASS_UINT16:
+            g_assert_cmpint (*(const guint16 *) item, ==,
+                             g_rand_int_range (rand, 0, 65536));
+            break;
+
+          case G_VARIANT_TYPE_CLASS_UINT32:
+            g_assert_cmpint (*(const guint32 *) item, ==,
+                             g_rand_int (rand));
+            break;
+
+          case G_VARIANT_TYPE_CLASS_DOUBLE:
+            g_assert_cmpfloat (*(const gdouble *) item, ==,
+                               ieee754ify (g_rand_double (rand)));
+            break;
+
+          default:
+            g_assert_not_reached ();
+        }
+      actual++;
+    }
+
+  g_assert_cmpint (actual, ==, length);
+}
+
 static void
 verify2 (GVariant *value,
          GRand    *rand)
@@ -38,6 +115,15 @@ verify2 (GVariant *value,
   type = (const GVariantType *) (possible + g_rand_int_range (rand, 0, 6));
   class = g_variant_type_get_class (type);
 
+  if (class != G_VARIANT_TYPE_CLASS_STRING)
+    {
+      GRand *copy;
+
+      copy = g_rand_copy (rand);
+      verify_fixed (value, copy, class, length);
+      g_rand_free (copy);
+    }
+
   actual = g_variant_iter_init (&iter, value);
   g_assert_cmpint (actual, ==, length);
 
@@ -203,11 +289,1139 @@ test (void)
   g_variant_unref (value);
 }
 
+static void
+test_fixed_iter (void)
+{
+  const gsize length = 1000000;
+  GVariantBuilder *builder;
+  GVariantIter iter;
+  gconstpointer item;
+  GVariant *value;
+  GVariant *child;
+  GTimer *timer;
+  gint64 sum;
+  gsize i;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("ai"));
+  for (i = 0; i < length; i++)
+    g_variant_builder_add (builder, "i", (gint32) i);
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_variant_flatten (value);
+
+  timer = g_timer_new ();
+
+  sum = 0;
+  g_variant_iter_init (&iter, value);
+  while ((child = g_variant_iter_next (&iter)))
+    sum += g_variant_get_int32 (child);
+  g_assert_cmpint (sum, ==, (gint64) length * (length - 1) / 2);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "g_variant_iter_next: %gs",
+                           g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  sum = 0;
+  g_variant_iter_init (&iter, value);
+  while ((item = g_variant_iter_next_fixed (&iter, sizeof (gint32))))
+    sum += *(const gint32 *) item;
+  g_assert_cmpint (sum, ==, (gint64) length * (length - 1) / 2);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "g_variant_iter_next_fixed: %gs",
+                           g_timer_elapsed (timer, NULL));
+
+  g_timer_destroy (timer);
+  g_variant_unref (value);
+}
+
+static void
+test_string_index (void)
+{
+  const gsize length = 300000;
+  GVariantBuilder *builder;
+  GVariant *value;
+  GTimer *timer;
+  GRand *rand;
+  gsize i;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("as"));
+  for (i = 0; i < length; i++)
+    {
+      gchar string[32];
+
+      g_snprintf (string, sizeof string, "%d", (int) i);
+      g_variant_builder_add (builder, "s", string);
+    }
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_variant_flatten (value);
+
+  rand = g_rand_new_with_seed (g_test_rand_int ());
+  timer = g_timer_new ();
+
+  for (i = 0; i < 1000000; i++)
+    {
+      gint index = g_rand_int_range (rand, 0, length);
+      gchar string[32];
+      GVariant *child;
+
+      g_assert_cmpint (g_variant_n_children (value), ==, length);
+      child = g_variant_get_child (value, index);
+      g_snprintf (string, sizeof string, "%d", index);
+      g_assert_cmpstr (g_variant_get_string (child, NULL), ==, string);
+      g_variant_unref (child);
+    }
+
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "1000000 random lookups: %gs",
+                           g_timer_elapsed (timer, NULL));
+
+  g_timer_destroy (timer);
+  g_rand_free (rand);
+  g_variant_unref (value);
+}
+
+static void
+test_map_file (void)
+{
+  const gsize length = 100000;
+  GVariantBuilder *builder;
+  GVariant *value, *mapped, *child;
+  const gchar *data, *string;
+  gchar *filename;
+  GError *error;
+  gsize i, size;
+  gint fd;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("as"));
+  for (i = 0; i < length; i++)
+    {
+      gchar string[32];
+
+      g_snprintf (string, sizeof string, "%d", (int) i);
+      g_variant_builder_add (builder, "s", string);
+    }
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  size = g_variant_get_size (value);
+
+  error = NULL;
+  fd = g_file_open_tmp ("gvariant-map-XXXXXX", &filename, &error);
+  g_assert (fd >= 0 && error == NULL);
+  close (fd);
+  g_file_set_contents (filename, g_variant_get_data (value), size, &error);
+  g_assert (error == NULL);
+
+  mapped = g_variant_map_file (G_VARIANT_TYPE ("as"), filename, 0, &error);
+  g_assert (mapped != NULL && error == NULL);
+  g_assert_cmpint (g_variant_get_size (mapped), ==, size);
+  data = g_variant_get_data (mapped);
+  g_assert (memcmp (data, g_variant_get_data (value), size) == 0);
+
+  /* children point straight into the mapping */
+  child = g_variant_get_child (mapped, 12345);
+  string = g_variant_get_string (child, NULL);
+  g_assert_cmpstr (string, ==, "12345");
+  g_assert (data <= string && string < data + size);
+  g_variant_unref (mapped);
+  g_assert_cmpstr (g_variant_get_string (child, NULL), ==, "12345");
+  g_variant_unref (child);
+
+  mapped = g_variant_map_file (G_VARIANT_TYPE_UINT32, filename, 0, &error);
+  g_assert (mapped == NULL);
+  g_assert (error->domain == G_FILE_ERROR &&
+            error->code == G_FILE_ERROR_INVAL);
+  g_clear_error (&error);
+
+  g_remove (filename);
+  mapped = g_variant_map_file (G_VARIANT_TYPE ("as"), filename, 0, &error);
+  g_assert (mapped == NULL);
+  g_assert (error->domain == G_FILE_ERROR);
+  g_clear_error (&error);
+
+  g_free (filename);
+  g_variant_unref (value);
+}
+
+static gboolean
+fail_write (gconstpointer   data,
+            gsize           size,
+            gpointer        user_data,
+            GError        **error)
+{
+  gint *calls = user_data;
+
+  (*calls)++;
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOSPC, "disk full");
+
+  return FALSE;
+}
+
+static void
+test_store_file (void)
+{
+  GVariantBuilder *builder;
+  GVariant *value, *mapped;
+  gchar *filename;
+  GError *error;
+  gint calls;
+  gsize i;
+  gint fd;
+
+  /* bigger than the buffer of the stream */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a{sv}"));
+  for (i = 0; i < 20000; i++)
+    {
+      gchar key[32];
+
+      g_snprintf (key, sizeof key, "key%d", (int) i);
+      if (i % 3)
+        g_variant_builder_add (builder, "{sv}", key,
+                               g_variant_new_uint64 (i));
+      else
+        g_variant_builder_add (builder, "{sv}", key,
+                               g_variant_new_string (key));
+    }
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+
+  error = NULL;
+  fd = g_file_open_tmp ("gvariant-store-XXXXXX", &filename, &error);
+  g_assert (fd >= 0 && error == NULL);
+  close (fd);
+
+  /* written straight from the tree form */
+  g_assert (g_variant_store_file (value, filename, &error));
+  g_assert (error == NULL);
+
+  mapped = g_variant_map_file (G_VARIANT_TYPE ("a{sv}"), filename, 0, &error);
+  g_assert (mapped != NULL && error == NULL);
+  g_assert_cmpint (g_variant_get_size (mapped), ==, g_variant_get_size (value));
+  g_assert (memcmp (g_variant_get_data (mapped), g_variant_get_data (value),
+                    g_variant_get_size (value)) == 0);
+  g_variant_unref (mapped);
+
+  /* the writer is not called again after it fails */
+  calls = 0;
+  g_assert (!g_variant_store_stream (value, fail_write, &calls, &error));
+  g_assert (error->domain == G_FILE_ERROR &&
+            error->code == G_FILE_ERROR_NOSPC);
+  g_assert_cmpint (calls, ==, 1);
+  g_clear_error (&error);
+
+  g_remove (filename);
+  g_free (filename);
+  g_variant_unref (value);
+}
+
+static GVariant *
+nested_dicts (gsize    n_outer,
+              gsize    n_inner,
+              gboolean arena)
+{
+  GVariantBuilder *builder;
+  gsize i, j;
+
+  if (arena)
+    builder = g_variant_builder_new_arena (G_VARIANT_TYPE_CLASS_ARRAY,
+                                           G_VARIANT_TYPE ("a{sa{sv}}"));
+  else
+    builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                     G_VARIANT_TYPE ("a{sa{sv}}"));
+  for (i = 0; i < n_outer; i++)
+    {
+      GVariantBuilder *entry, *inner;
+      gchar key[32];
+
+      entry = g_variant_builder_open (builder,
+                                      G_VARIANT_TYPE_CLASS_DICT_ENTRY, NULL);
+      g_snprintf (key, sizeof key, "/org/example/object%d", (int) i);
+      g_variant_builder_add (entry, "s", key);
+      inner = g_variant_builder_open (entry, G_VARIANT_TYPE_CLASS_ARRAY,
+                                      NULL);
+      for (j = 0; j < n_inner; j++)
+        {
+          GVariantBuilder *property;
+          GVariant *child;
+
+          /* g_variant_builder_add() would flatten each entry */
+          property = g_variant_builder_open (inner,
+                                             G_VARIANT_TYPE_CLASS_DICT_ENTRY,
+                                             NULL);
+          g_snprintf (key, sizeof key, "property%d", (int) j);
+          g_variant_builder_add_value (property, g_variant_new_string (key));
+
+          if (j & 1)
+            child = g_variant_new_string (key);
+          else
+            child = g_variant_new_uint32 (j);
+
+          g_variant_builder_add_value (property, g_variant_new_variant (child));
+          g_variant_builder_close (property);
+        }
+      g_variant_builder_close (inner);
+      g_variant_builder_close (entry);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (builder));
+}
+
+static void
+test_nested_serialise (void)
+{
+  gdouble elapsed = 0;
+  gsize size = 0;
+  gint i;
+
+  for (i = 0; i < 10; i++)
+    {
+      GVariant *value;
+      GTimer *timer;
+
+      value = nested_dicts (2000, 50, FALSE);
+
+      timer = g_timer_new ();
+      g_variant_flatten (value);
+      elapsed += g_timer_elapsed (timer, NULL);
+      g_timer_destroy (timer);
+
+      size += g_variant_get_size (value);
+      g_variant_unref (value);
+    }
+
+  g_test_maximized_result (size / elapsed / 1000000,
+                           "serialising 'a{sa{sv}}' trees: %.0f MB/s",
+                           size / elapsed / 1000000);
+}
+
+static void
+test_builder_serialise (void)
+{
+  const gsize length = 1000000;
+  GVariantBuilder *builder;
+  GVariant *value;
+  GTimer *timer;
+  gdouble elapsed;
+  gsize size;
+  gsize i;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("as"));
+  for (i = 0; i < length; i++)
+    g_variant_builder_add (builder, "s", "a string in an array");
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+
+  timer = g_timer_new ();
+  g_variant_flatten (value);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  size = g_variant_get_size (value);
+  g_variant_unref (value);
+
+  g_test_maximized_result (size / elapsed / 1000000,
+                           "serialising 'as' from a builder: %.0f MB/s",
+                           size / elapsed / 1000000);
+}
+
+static GVariant *
+build_rows (gsize    n_rows,
+            gboolean arena)
+{
+  GVariantBuilder *builder;
+  gsize i;
+
+  if (arena)
+    builder = g_variant_builder_new_arena (G_VARIANT_TYPE_CLASS_ARRAY,
+                                           G_VARIANT_TYPE ("a(sus)"));
+  else
+    builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                     G_VARIANT_TYPE ("a(sus)"));
+
+  for (i = 0; i < n_rows; i++)
+    {
+      gchar name[32];
+
+      g_snprintf (name, sizeof name, "row %d", (int) i);
+      g_variant_builder_add (builder, "(sus)", name, (guint32) i,
+                             "another string");
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (builder));
+}
+
+static void
+assert_same_data (GVariant *one,
+                  GVariant *two)
+{
+  g_assert_cmpint (g_variant_get_size (one), ==, g_variant_get_size (two));
+  g_assert (memcmp (g_variant_get_data (one), g_variant_get_data (two),
+                    g_variant_get_size (one)) == 0);
+}
+
+static void
+test_arena (void)
+{
+  GVariant *plain, *value, *row, *name;
+  GVariantBuilder *builder;
+
+  plain = build_rows (10000, FALSE);
+  value = build_rows (10000, TRUE);
+  assert_same_data (plain, value);
+  g_variant_unref (plain);
+
+  /* children outlive the value that they came from */
+  row = g_variant_get_child (value, 1234);
+  g_variant_unref (value);
+  name = g_variant_get_child (row, 0);
+  g_variant_unref (row);
+  g_assert_cmpstr (g_variant_get_string (name, NULL), ==, "row 1234");
+  g_variant_unref (name);
+
+  /* builders opened from an arena builder use the same arena */
+  plain = nested_dicts (20, 10, FALSE);
+  value = nested_dicts (20, 10, TRUE);
+  assert_same_data (plain, value);
+  g_variant_unref (plain);
+  g_variant_unref (value);
+
+  builder = g_variant_builder_new_arena (G_VARIANT_TYPE_CLASS_ARRAY,
+                                         G_VARIANT_TYPE ("a(sus)"));
+  g_variant_builder_add (builder, "(sus)", "one", 1, "two");
+  g_variant_builder_open (builder, G_VARIANT_TYPE_CLASS_STRUCT, NULL);
+  g_variant_builder_cancel (builder);
+}
+
+static void
+test_arena_perf (void)
+{
+  const gsize n_rows = 1000000;
+  gint arena;
+
+  for (arena = 0; arena < 2; arena++)
+    {
+      gdouble build, destroy;
+      GVariant *value;
+      GTimer *timer;
+
+      timer = g_timer_new ();
+      value = build_rows (n_rows, arena);
+      build = g_timer_elapsed (timer, NULL);
+
+      g_timer_start (timer);
+      g_variant_unref (value);
+      destroy = g_timer_elapsed (timer, NULL);
+      g_timer_destroy (timer);
+
+      g_test_minimized_result (build + destroy,
+                               "%s builder, %d rows of '(sus)': "
+                               "build %gs, free %gs",
+                               arena ? "arena" : "plain", (int) n_rows,
+                               build, destroy);
+    }
+}
+
+static void
+test_fixed_builder (void)
+{
+  struct { guint8 y; guint32 u; } expected_yu[100];
+  struct { guint64 t; guint8 y; } expected_ty[100];
+  GVariantBuilder *builder;
+  gint32 expected_i[1000];
+  gdouble expected_d[100];
+  guint8 expected_b[100];
+  GVariant *value;
+  gsize i;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("ai"));
+  for (i = 0; i < 1000; i++)
+    {
+      expected_i[i] = i * 7919 - 1000000;
+      if (i % 3)
+        g_variant_builder_add (builder, "i", expected_i[i]);
+      else
+        g_variant_builder_add_value (builder,
+                                     g_variant_new_int32 (expected_i[i]));
+    }
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpint (g_variant_get_size (value), ==, sizeof expected_i);
+  g_assert (memcmp (g_variant_get_data (value), expected_i,
+                    sizeof expected_i) == 0);
+  g_variant_unref (value);
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("ad"));
+  for (i = 0; i < 100; i++)
+    g_variant_builder_add (builder, "d", expected_d[i] = i / 3.0);
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpint (g_variant_get_size (value), ==, sizeof expected_d);
+  g_assert (memcmp (g_variant_get_data (value), expected_d,
+                    sizeof expected_d) == 0);
+  g_variant_unref (value);
+
+  /* booleans are stored as 0 or 1 */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("ab"));
+  for (i = 0; i < 100; i++)
+    {
+      g_variant_builder_add (builder, "b", (gboolean) (i % 3) * 5);
+      expected_b[i] = (i % 3) != 0;
+    }
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert (memcmp (g_variant_get_data (value), expected_b,
+                    sizeof expected_b) == 0);
+  g_variant_unref (value);
+
+  /* structures, with padding */
+  memset (expected_yu, 0, sizeof expected_yu);
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a(yu)"));
+  for (i = 0; i < 100; i++)
+    {
+      expected_yu[i].y = i;
+      expected_yu[i].u = i * 1000;
+
+      if (i & 1)
+        g_variant_builder_add (builder, "(yu)", (guint) i, (guint) i * 1000);
+      else
+        {
+          GVariantBuilder *member;
+
+          member = g_variant_builder_open (builder,
+                                           G_VARIANT_TYPE_CLASS_STRUCT, NULL);
+          g_variant_builder_add (member, "y", (guint) i);
+          g_variant_builder_add (member, "u", (guint) i * 1000);
+          g_variant_builder_close (member);
+        }
+    }
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpint (g_variant_get_size (value), ==, sizeof expected_yu);
+  g_assert (memcmp (g_variant_get_data (value), expected_yu,
+                    sizeof expected_yu) == 0);
+  g_variant_unref (value);
+
+  /* padding at the end */
+  memset (expected_ty, 0, sizeof expected_ty);
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a(ty)"));
+  for (i = 0; i < 100; i++)
+    {
+      expected_ty[i].t = G_MAXUINT64 - i;
+      expected_ty[i].y = i;
+      g_variant_builder_add (builder, "(ty)", G_MAXUINT64 - i, (guint) i);
+    }
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpint (g_variant_get_size (value), ==, sizeof expected_ty);
+  g_assert (memcmp (g_variant_get_data (value), expected_ty,
+                    sizeof expected_ty) == 0);
+  g_variant_unref (value);
+
+  /* an untrusted value of the wrong size is stored as zeros */
+  {
+    static const guint32 wrong[4] = { 1, 2, 3, 4 };
+    const gint32 zeros[2] = { 0, 0 };
+    GVariant *loaded;
+
+    loaded = g_variant_load (G_VARIANT_TYPE ("(ii)"),
+                             wrong, sizeof wrong, 0);
+    builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                     G_VARIANT_TYPE ("a(ii)"));
+    g_variant_builder_add_value (builder, loaded);
+    value = g_variant_ref_sink (g_variant_builder_end (builder));
+    g_assert_cmpint (g_variant_get_size (value), ==, sizeof zeros);
+    g_assert (memcmp (g_variant_get_data (value), zeros,
+                      sizeof zeros) == 0);
+    g_variant_unref (value);
+  }
+
+  /* empty */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("at"));
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpint (g_variant_n_children (value), ==, 0);
+  g_variant_unref (value);
+
+  /* cancelled */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("ay"));
+  for (i = 0; i < 100; i++)
+    g_variant_builder_add (builder, "y", (guint) i);
+  g_variant_builder_cancel (builder);
+}
+
+static void
+test_fixed_builder_perf (void)
+{
+  const gsize length = 1000000;
+  GVariantBuilder *builder;
+  GVariant *value;
+  GTimer *timer;
+  gsize i;
+
+  timer = g_timer_new ();
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("at"));
+  for (i = 0; i < length; i++)
+    g_variant_builder_add (builder, "t", (guint64) i);
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_variant_flatten (value);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "building 'at' of %d items: %gs", (int) length,
+                           g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+
+  g_timer_start (timer);
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a(ii)"));
+  for (i = 0; i < length; i++)
+    g_variant_builder_add (builder, "(ii)", (gint) i, (gint) -i);
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_variant_flatten (value);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "building 'a(ii)' of %d items: %gs", (int) length,
+                           g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+
+  g_timer_destroy (timer);
+}
+
+static void
+test_builder_reserve (void)
+{
+  GVariantBuilder *builder;
+  GVariant *value, *child;
+  gsize i;
+
+  /* fewer children than reserved */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("as"));
+  g_variant_builder_reserve (builder, 1000);
+  for (i = 0; i < 10; i++)
+    g_variant_builder_add (builder, "s", "x");
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpint (g_variant_n_children (value), ==, 10);
+  g_variant_unref (value);
+
+  /* more children than reserved, reserving again part-way through */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("au"));
+  g_variant_builder_reserve (builder, 3);
+  for (i = 0; i < 100; i++)
+    {
+      if (i == 50)
+        g_variant_builder_reserve (builder, 60);
+      g_variant_builder_add (builder, "u", (guint32) i);
+    }
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpint (g_variant_n_children (value), ==, 100);
+  for (i = 0; i < 100; i++)
+    g_assert_cmpint (((const guint32 *) g_variant_get_data (value))[i],
+                     ==, i);
+  g_variant_unref (value);
+
+  /* exactly as many, in a struct */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_STRUCT, NULL);
+  g_variant_builder_reserve (builder, 2);
+  g_variant_builder_add (builder, "s", "a");
+  g_variant_builder_add (builder, "s", "b");
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  child = g_variant_get_child (value, 1);
+  g_assert_cmpstr (g_variant_get_string (child, NULL), ==, "b");
+  g_variant_unref (child);
+  g_variant_unref (value);
+
+  /* none at all */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("as"));
+  g_variant_builder_reserve (builder, 100);
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpint (g_variant_n_children (value), ==, 0);
+  g_assert_cmpint (g_variant_get_size (value), ==, 0);
+  g_variant_unref (value);
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("ad"));
+  g_variant_builder_reserve (builder, 100);
+  g_variant_builder_cancel (builder);
+}
+
+static void
+time_reserve (const gchar *type,
+              gboolean     reserve)
+{
+  const gsize length = 1000000;
+  GVariantBuilder *builder;
+  GVariant *value;
+  GTimer *timer;
+  gsize i;
+
+  timer = g_timer_new ();
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE (type));
+  if (reserve)
+    g_variant_builder_reserve (builder, length);
+  for (i = 0; i < length; i++)
+    if (type[1] == 's')
+      g_variant_builder_add (builder, "s", "a string");
+    else
+      g_variant_builder_add (builder, "u", (guint32) i);
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "building '%s' of %d items%s: %gs", type,
+                           (int) length, reserve ? ", reserved" : "",
+                           g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+  g_timer_destroy (timer);
+}
+
+static void
+test_builder_reserve_perf (void)
+{
+  time_reserve ("au", FALSE);
+  time_reserve ("au", TRUE);
+  time_reserve ("as", FALSE);
+  time_reserve ("as", TRUE);
+}
+
+static void
+test_format_string_reuse (void)
+{
+  const gchar *string;
+  GVariant *value;
+  gchar fmt[8];
+  guint32 x;
+  gint i;
+
+  /* the same buffer holding different format strings in turn */
+  for (i = 0; i < 3; i++)
+    {
+      strcpy (fmt, "u");
+      value = g_variant_ref_sink (g_variant_new_uint32 (42));
+      g_variant_get (value, fmt, &x);
+      g_assert_cmpint (x, ==, 42);
+      g_variant_unref (value);
+
+      strcpy (fmt, "(us)");
+      value = g_variant_ref_sink (g_variant_new (fmt, 7, "seven"));
+      g_variant_get (value, fmt, &x, &string);
+      g_assert_cmpint (x, ==, 7);
+      g_assert_cmpstr (string, ==, "seven");
+      g_variant_unref (value);
+    }
+}
+
+static void
+check_struct (GVariant *value)
+{
+  const gchar *s, *o;
+  gboolean b;
+  guchar y;
+  guint32 u;
+  gint64 x;
+  gdouble d;
+
+  g_variant_get (value, "((ys)(xd)b{uo})",
+                 &y, &s, &x, &d, &b, &u, &o);
+  g_assert_cmpint (y, ==, 42);
+  g_assert_cmpstr (s, ==, "string");
+  g_assert_cmpint (x, ==, -1234567890123ll);
+  g_assert_cmpfloat (d, ==, 1.5);
+  g_assert_cmpint (b, ==, TRUE);
+  g_assert_cmpint (u, ==, 77);
+  g_assert_cmpstr (o, ==, "/a/b");
+
+  /* NULL pointers skip members */
+  g_variant_get (value, "((ys)(xd)b{uo})",
+                 NULL, NULL, NULL, &d, NULL, NULL, NULL);
+  g_assert_cmpfloat (d, ==, 1.5);
+}
+
+static void
+test_get_struct (void)
+{
+  GVariant *value, *loaded;
+  GVariantBuilder *builder;
+  GVariant *child;
+  gint16 n;
+  gsize i;
+
+  value = g_variant_new ("((ys)(xd)b{uo})", 42, "string",
+                         (gint64) -1234567890123ll, 1.5, TRUE,
+                         77, "/a/b");
+  g_variant_ref_sink (value);
+  check_struct (value);
+
+  /* untrusted data takes the slow path */
+  loaded = g_variant_load (g_variant_get_type (value),
+                           g_variant_get_data (value),
+                           g_variant_get_size (value), 0);
+  check_struct (loaded);
+  g_variant_unref (loaded);
+  g_variant_unref (value);
+
+  /* a struct inside of a (serialised) array */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a(ns)"));
+  for (i = 0; i < 10; i++)
+    g_variant_builder_add (builder, "(ns)", (gint16) -i, "x");
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_variant_flatten (value);
+  for (i = 0; i < 10; i++)
+    {
+      const gchar *s;
+
+      child = g_variant_get_child (value, i);
+      g_variant_get (child, "(ns)", &n, &s);
+      g_assert_cmpint (n, ==, -(gint) i);
+      g_assert_cmpstr (s, ==, "x");
+      g_variant_unref (child);
+    }
+  g_variant_unref (value);
+}
+
+static void
+test_format_string_perf (void)
+{
+  const gsize length = 1000000;
+  GVariantBuilder *builder;
+  const gchar *string;
+  GVariantIter iter;
+  GVariant *value;
+  GTimer *timer;
+  guint32 x, y;
+  gsize i;
+
+  timer = g_timer_new ();
+  for (i = 0; i < length; i++)
+    {
+      value = g_variant_new ("(uus)", (guint32) i, (guint32) 0, "str");
+      g_variant_unref (g_variant_ref_sink (value));
+    }
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "%d calls to g_variant_new (\"(uus)\"): %gs",
+                           (int) length, g_timer_elapsed (timer, NULL));
+
+  value = g_variant_ref_sink (g_variant_new_uint32 (1));
+  g_timer_start (timer);
+  for (i = 0; i < length; i++)
+    g_variant_get (value, "u", &x);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "%d calls to g_variant_get (\"u\"): %gs",
+                           (int) length, g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+
+  value = g_variant_ref_sink (g_variant_new ("(uus)", 1, 2, "str"));
+  g_timer_start (timer);
+  for (i = 0; i < length; i++)
+    g_variant_get (value, "(uus)", &x, &y, &string);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "%d calls to g_variant_get (\"(uus)\"): %gs",
+                           (int) length, g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+
+  g_timer_start (timer);
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a(us)"));
+  for (i = 0; i < length; i++)
+    g_variant_builder_add (builder, "(us)", (guint32) i, "str");
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_variant_flatten (value);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "%d calls to g_variant_builder_add (\"(us)\"): %gs",
+                           (int) length, g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  g_variant_iter_init (&iter, value);
+  while (g_variant_iterate (&iter, "(us)", &x, &string));
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "%d calls to g_variant_iterate (\"(us)\"): %gs",
+                           (int) length, g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+
+  g_timer_destroy (timer);
+}
+
+static void
+count_calls (gpointer user_data)
+{
+  (*(gint *) user_data)++;
+}
+
+static void
+test_new_fixed_array (void)
+{
+  struct { guint8 y; guint32 u; } records[50];
+  GVariant *value, *child;
+  gdouble samples[1000];
+  gsize length;
+  gint calls;
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (samples); i++)
+    samples[i] = i * 0.25;
+
+  value = g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, samples,
+                                     G_N_ELEMENTS (samples), sizeof (gdouble));
+  g_variant_ref_sink (value);
+  g_assert_cmpstr (g_variant_get_type_string (value), ==, "ad");
+  g_assert (g_variant_get_fixed_array (value, sizeof (gdouble), &length) !=
+            (gconstpointer) samples);
+  g_assert_cmpint (length, ==, G_N_ELEMENTS (samples));
+  g_assert (memcmp (g_variant_get_data (value), samples,
+                    sizeof samples) == 0);
+  g_variant_unref (value);
+
+  /* without a copy */
+  calls = 0;
+  value = g_variant_new_fixed_array_full (G_VARIANT_TYPE_DOUBLE, samples,
+                                          G_N_ELEMENTS (samples),
+                                          sizeof (gdouble),
+                                          count_calls, &calls);
+  g_variant_ref_sink (value);
+  g_assert (g_variant_get_fixed_array (value, sizeof (gdouble), NULL) ==
+            (gconstpointer) samples);
+  child = g_variant_get_child (value, 999);
+  g_assert_cmpfloat (g_variant_get_double (child), ==, 999 * 0.25);
+  g_variant_unref (child);
+  g_assert_cmpint (calls, ==, 0);
+  g_variant_unref (value);
+  g_assert_cmpint (calls, ==, 1);
+
+  /* padding in the C structure that is not zero is fixed up */
+  memset (records, 0xff, sizeof records);
+  for (i = 0; i < G_N_ELEMENTS (records); i++)
+    {
+      records[i].y = i;
+      records[i].u = i * 3;
+    }
+  value = g_variant_new_fixed_array (G_VARIANT_TYPE ("(yu)"), records,
+                                     G_N_ELEMENTS (records), sizeof *records);
+  g_variant_ref_sink (value);
+  g_variant_normalise (value);
+  for (i = 0; i < G_N_ELEMENTS (records); i++)
+    {
+      const guint8 *record;
+
+      record = (const guint8 *) g_variant_get_data (value) + 8 * i;
+      g_assert_cmpint (record[0], ==, i);
+      g_assert_cmpint (record[1] | record[2] | record[3], ==, 0);
+      g_assert_cmpint (*(const guint32 *) (record + 4), ==, i * 3);
+    }
+  g_variant_unref (value);
+
+  value = g_variant_new_fixed_array (G_VARIANT_TYPE ("q"), NULL, 0,
+                                     sizeof (guint16));
+  g_variant_ref_sink (value);
+  g_assert_cmpint (g_variant_n_children (value), ==, 0);
+  g_variant_unref (value);
+}
+
+static void
+test_new_fixed_array_perf (void)
+{
+  const gsize length = 10000000;
+  GVariantBuilder *builder;
+  gdouble *samples;
+  GVariant *value;
+  GTimer *timer;
+  gsize i;
+
+  samples = g_new (gdouble, length);
+  for (i = 0; i < length; i++)
+    samples[i] = i / 7.0;
+
+  timer = g_timer_new ();
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("ad"));
+  for (i = 0; i < length; i++)
+    g_variant_builder_add (builder, "d", samples[i]);
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_variant_flatten (value);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "'ad' of %d samples with a builder: %gs",
+                           (int) length, g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+
+  g_timer_start (timer);
+  value = g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, samples,
+                                     length, sizeof (gdouble));
+  g_variant_ref_sink (value);
+  g_variant_flatten (value);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "'ad' of %d samples, copied: %gs",
+                           (int) length, g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+
+  g_timer_start (timer);
+  value = g_variant_new_fixed_array_full (G_VARIANT_TYPE_DOUBLE, samples,
+                                          length, sizeof (gdouble),
+                                          NULL, NULL);
+  g_variant_ref_sink (value);
+  g_variant_flatten (value);
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "'ad' of %d samples, not copied: %gs",
+                           (int) length, g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+
+  g_timer_destroy (timer);
+  g_free (samples);
+}
+
+static void
+test_builder_types (void)
+{
+  GVariantBuilder *builder;
+  GVariant *right, *wrong, *value;
+  GError *error = NULL;
+  gchar type[] = "a(us)";
+
+  right = g_variant_ref_sink (g_variant_new ("(us)", 1, "one"));
+  wrong = g_variant_ref_sink (g_variant_new ("(su)", "two", 2));
+
+  /* the builder must not keep pointing at the caller's string */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE (type));
+  strcpy (type, "a(su)");
+  g_assert (g_variant_builder_check_add (builder,
+                                         G_VARIANT_TYPE_CLASS_STRUCT,
+                                         G_VARIANT_TYPE (type + 1), NULL) ==
+            FALSE);
+  strcpy (type, "a(us)");
+  g_assert (g_variant_builder_check_add (builder,
+                                         G_VARIANT_TYPE_CLASS_STRUCT,
+                                         G_VARIANT_TYPE (type + 1), NULL));
+  g_assert (!g_variant_builder_check_add (builder,
+                                          G_VARIANT_TYPE_CLASS_STRUCT,
+                                          G_VARIANT_TYPE ("(su)"), &error));
+  g_assert (error->domain == G_VARIANT_BUILDER_ERROR &&
+            error->code == G_VARIANT_BUILDER_ERROR_TYPE);
+  g_clear_error (&error);
+
+  g_assert (!g_variant_builder_check_add (builder,
+                                          G_VARIANT_TYPE_CLASS_ARRAY,
+                                          G_VARIANT_TYPE ("(us)"), &error));
+  g_assert (error->domain == G_VARIANT_BUILDER_ERROR &&
+            error->code == G_VARIANT_BUILDER_ERROR_TYPE);
+  g_clear_error (&error);
+
+  g_assert (!g_variant_builder_check_add (builder,
+                                          G_VARIANT_TYPE_CLASS_STRUCT,
+                                          g_variant_get_type (wrong),
+                                          &error));
+  g_assert (error->domain == G_VARIANT_BUILDER_ERROR &&
+            error->code == G_VARIANT_BUILDER_ERROR_TYPE);
+  g_clear_error (&error);
+
+  g_variant_builder_add_value (builder, right);
+  g_variant_builder_add (builder, "(us)", 3, "three");
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpint (g_variant_n_children (value), ==, 2);
+  g_variant_unref (value);
+
+  /* no type given: later items must match the first */
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY, NULL);
+  g_variant_builder_add_value (builder, right);
+  g_assert (g_variant_builder_check_add (builder,
+                                         G_VARIANT_TYPE_CLASS_STRUCT,
+                                         g_variant_get_type (right), NULL));
+  g_assert (!g_variant_builder_check_add (builder,
+                                          G_VARIANT_TYPE_CLASS_STRUCT,
+                                          g_variant_get_type (wrong),
+                                          &error));
+  g_assert (error->domain == G_VARIANT_BUILDER_ERROR &&
+            error->code == G_VARIANT_BUILDER_ERROR_TYPE);
+  g_clear_error (&error);
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_assert_cmpstr (g_variant_get_type_string (value), ==, "a(us)");
+  g_variant_unref (value);
+
+  g_variant_unref (right);
+  g_variant_unref (wrong);
+}
+
+static void
+time_typed_add (GVariant *item)
+{
+  const gsize length = 1000000;
+  GVariantBuilder *builder;
+  GVariant *value;
+  const gchar *type;
+  gchar *array_type;
+  GTimer *timer;
+  gsize i;
+
+  item = g_variant_ref_sink (item);
+  type = g_variant_get_type_string (item);
+  array_type = g_strdup_printf ("a%s", type);
+
+  timer = g_timer_new ();
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE (array_type));
+  for (i = 0; i < length; i++)
+    g_variant_builder_add_value (builder, item);
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_test_minimized_result (g_timer_elapsed (timer, NULL),
+                           "adding %d '%s' values: %gs", (int) length,
+                           type, g_timer_elapsed (timer, NULL));
+  g_variant_unref (value);
+  g_timer_destroy (timer);
+
+  g_free (array_type);
+  g_variant_unref (item);
+}
+
+static void
+test_builder_types_perf (void)
+{
+  GVariantBuilder *strings, *dict;
+
+  time_typed_add (g_variant_new ("(us)", 1, "one"));
+
+  strings = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("as"));
+  dict = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                G_VARIANT_TYPE ("a{sv}"));
+  time_typed_add (g_variant_new ("(**(ii)u)",
+                                 g_variant_builder_end (strings),
+                                 g_variant_builder_end (dict),
+                                 1, 2, 3));
+}
+
 int
 main (int argc, char **argv)
 {
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/gvariant/big", test);
+  g_test_add_func ("/gvariant/big/map-file", test_map_file);
+  g_test_add_func ("/gvariant/big/store-file", test_store_file);
+  g_test_add_func ("/gvariant/big/arena", test_arena);
+  g_test_add_func ("/gvariant/big/fixed-builder", test_fixed_builder);
+  g_test_add_func ("/gvariant/big/new-fixed-array", test_new_fixed_array);
+  g_test_add_func ("/gvariant/big/builder-reserve", test_builder_reserve);
+  g_test_add_func ("/gvariant/big/format-reuse", test_format_string_reuse);
+  g_test_add_func ("/gvariant/big/get-struct", test_get_struct);
+  g_test_add_func ("/gvariant/big/builder-types", test_builder_types);
+
+  if (g_test_perf ())
+    {
+      g_test_add_func ("/gvariant/big/fixed-iter", test_fixed_iter);
+      g_test_add_func ("/gvariant/big/string-index", test_string_index);
+      g_test_add_func ("/gvariant/big/nested-serialise",
+                       test_nested_serialise);
+      g_test_add_func ("/gvariant/big/builder-serialise",
+                       test_builder_serialise);
+      g_test_add_func ("/gvariant/big/arena-build", test_arena_perf);
+      g_test_add_func ("/gvariant/big/fixed-build", test_fixed_builder_perf);
+      g_test_add_func ("/gvariant/big/fixed-array-build",
+                       test_new_fixed_array_perf);
+      g_test_add_func ("/gvariant/big/reserve-build",
+                       test_builder_reserve_perf);
+      g_test_add_func ("/gvariant/big/format-strings",
+                       test_format_string_perf);
+      g_test_add_func ("/gvariant/big/builder-types-perf",
+                       test_builder_types_perf);
+    }
 
   return g_test_run ();
 }
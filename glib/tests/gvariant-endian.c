@@ -1,4 +1,5 @@
 #include <glib/gvariant-loadstore.h>
+#include <string.h>
 #include <glib.h>
 
 static void
@@ -31,10 +32,344 @@ test_byteswap (void)
   g_string_free (string, TRUE);
 }
 
+static void
+test_scalar (void)
+{
+  const guint32 native = 0x01020304;
+  const guint32 foreign = GUINT32_SWAP_LE_BE (native);
+  GVariant *value;
+
+  value = g_variant_load (G_VARIANT_TYPE_UINT32, &foreign, sizeof foreign,
+                          G_BYTE_ORDER == G_LITTLE_ENDIAN ?
+                            G_BIG_ENDIAN : G_LITTLE_ENDIAN);
+  g_assert_cmpint (g_variant_get_uint32 (value), ==, native);
+  g_assert_cmpint (g_variant_get_size (value), ==, sizeof native);
+  g_assert (memcmp (g_variant_get_data (value), &native, sizeof native) == 0);
+  g_variant_unref (value);
+
+  value = g_variant_new_uint32 (native);
+  g_assert (memcmp (g_variant_get_data (value), &native, sizeof native) == 0);
+  g_variant_unref (value);
+}
+
+#define FOREIGN_ENDIAN \
+  (G_BYTE_ORDER == G_LITTLE_ENDIAN ? G_BIG_ENDIAN : G_LITTLE_ENDIAN)
+
+/* loads @foreign as @type in the opposite byte order and checks that
+ * the result matches @native
+ */
+static void
+check_swapped (const gchar   *type,
+               gconstpointer  foreign,
+               gconstpointer  native,
+               gsize          size)
+{
+  GVariant *value;
+
+  value = g_variant_load (G_VARIANT_TYPE (type), foreign, size,
+                          FOREIGN_ENDIAN);
+  g_assert_cmpint (g_variant_get_size (value), ==, size);
+  g_assert (memcmp (g_variant_get_data (value), native, size) == 0);
+  g_variant_unref (value);
+}
+
+static void
+test_arrays (void)
+{
+  /* odd lengths leave a tail for the scalar code after the vectors */
+  const gsize n = 1001;
+  guint64 *native64, *foreign64;
+  guint32 *native32, *foreign32;
+  guint16 *native16, *foreign16;
+  guchar *native, *foreign;
+  gsize i;
+
+  native64 = g_new (guint64, n);
+  foreign64 = g_new (guint64, n);
+  for (i = 0; i < n; i++)
+    {
+      native64[i] = G_GUINT64_CONSTANT (0x0102030405060708) * (i + 1);
+      foreign64[i] = GUINT64_SWAP_LE_BE (native64[i]);
+    }
+  check_swapped ("at", foreign64, native64, n * 8);
+  check_swapped ("ad", foreign64, native64, n * 8);
+  g_free (foreign64);
+  g_free (native64);
+
+  native32 = g_new (guint32, 3 * n);
+  foreign32 = g_new (guint32, 3 * n);
+  for (i = 0; i < 3 * n; i++)
+    {
+      native32[i] = 0x01020304 * (i + 1);
+      foreign32[i] = GUINT32_SWAP_LE_BE (native32[i]);
+    }
+  check_swapped ("a(iiu)", foreign32, native32, 3 * n * 4);
+  g_free (foreign32);
+  g_free (native32);
+
+  native16 = g_new (guint16, n);
+  foreign16 = g_new (guint16, n);
+  for (i = 0; i < n; i++)
+    {
+      native16[i] = 0x0102 * (i + 1);
+      foreign16[i] = GUINT16_SWAP_LE_BE (native16[i]);
+    }
+  check_swapped ("aq", foreign16, native16, n * 2);
+  g_free (foreign16);
+  g_free (native16);
+
+  /* items with padding and unswapped bytes: (tyq) is
+   *   t: 0-7  y: 8  pad: 9  q: 10-11  pad: 12-15
+   */
+  native = g_malloc0 (n * 16);
+  foreign = g_malloc0 (n * 16);
+  for (i = 0; i < n; i++)
+    {
+      guint64 t = G_GUINT64_CONSTANT (0x1122334455667788) + i;
+      guint16 q = 0x0102 + i;
+
+      memcpy (native + i * 16, &t, 8);
+      native[i * 16 + 8] = i;
+      memcpy (native + i * 16 + 10, &q, 2);
+
+      t = GUINT64_SWAP_LE_BE (t);
+      q = GUINT16_SWAP_LE_BE (q);
+      memcpy (foreign + i * 16, &t, 8);
+      foreign[i * 16 + 8] = i;
+      memcpy (foreign + i * 16 + 10, &q, 2);
+    }
+  check_swapped ("a(tyq)", foreign, native, n * 16);
+  check_swapped ("a(t(yq))", foreign, native, n * 16);
+  g_free (foreign);
+  g_free (native);
+}
+
+static void
+test_not_normal (void)
+{
+  const guchar foreign[] = {
+    1, 0xff, 0, 0,
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    0, 0, 0, 2
+#else
+    2, 0, 0, 0
+#endif
+  };
+  const guchar native[] = { 1, 0, 0, 0, 2, 0, 0, 0 };
+  GVariant *value;
+
+  /* can not be swapped in place, so it is renormalised instead */
+  value = g_variant_load (G_VARIANT_TYPE ("(yu)"), foreign, sizeof foreign,
+                          FOREIGN_ENDIAN);
+  g_assert_cmpint (g_variant_get_size (value), ==, sizeof native);
+  g_assert (memcmp (g_variant_get_data (value), native, sizeof native) == 0);
+  g_variant_unref (value);
+}
+
+/* 'a(sat)': @n_records records with @n_items numbers each */
+static gpointer
+foreign_records (gsize  n_records,
+                 gsize  n_items,
+                 gsize *size)
+{
+  GVariantBuilder *builder;
+  GVariant *native, *swapped;
+  gpointer data;
+  gsize i, j;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a(sat)"));
+  for (i = 0; i < n_records; i++)
+    {
+      GVariantBuilder *record, *items;
+
+      record = g_variant_builder_open (builder, G_VARIANT_TYPE_CLASS_STRUCT,
+                                       NULL);
+      g_variant_builder_add (record, "s", "a record");
+      items = g_variant_builder_open (record, G_VARIANT_TYPE_CLASS_ARRAY,
+                                      NULL);
+      for (j = 0; j < n_items; j++)
+        g_variant_builder_add (items, "t", (guint64) i * 1000 + j);
+      g_variant_builder_close (items);
+      g_variant_builder_close (record);
+    }
+  native = g_variant_ref_sink (g_variant_builder_end (builder));
+
+  /* swapping is its own inverse */
+  *size = g_variant_get_size (native);
+  swapped = g_variant_load (G_VARIANT_TYPE ("a(sat)"),
+                            g_variant_get_data (native), *size,
+                            FOREIGN_ENDIAN);
+  data = g_memdup (g_variant_get_data (swapped), *size);
+  g_variant_unref (swapped);
+  g_variant_unref (native);
+
+  return data;
+}
+
+/* reads item @j of record @i of @records */
+static guint64
+deep_lookup (GVariant *records,
+             gsize     i,
+             gsize     j)
+{
+  GVariant *record, *items, *item;
+  guint64 result;
+
+  record = g_variant_get_child (records, i);
+  items = g_variant_get_child (record, 1);
+  item = g_variant_get_child (items, j);
+  result = g_variant_get_uint64 (item);
+  g_variant_unref (item);
+  g_variant_unref (items);
+  g_variant_unref (record);
+
+  return result;
+}
+
+static void
+notify_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+
+  *flag = TRUE;
+}
+
+static void
+test_lazy (void)
+{
+  GVariant *records, *record, *items;
+  GVariantStats stats;
+  gpointer data, original;
+  gboolean notified;
+  gsize size;
+
+  data = foreign_records (1000, 100, &size);
+
+  /* one number is swapped, not the whole array */
+  g_variant_reset_stats ();
+  records = g_variant_load (G_VARIANT_TYPE ("a(sat)"), data, size,
+                            FOREIGN_ENDIAN | G_VARIANT_LAZY_BYTESWAP);
+  g_assert_cmpint (deep_lookup (records, 567, 89), ==, 567089);
+  g_variant_get_stats (&stats);
+  g_assert_cmpint (stats.bytes_byteswapped, ==, sizeof (guint64));
+
+  /* only the numbers of one record are swapped to get at them */
+  record = g_variant_get_child (records, 123);
+  items = g_variant_get_child (record, 1);
+  g_assert_cmpint (((const guint64 *) g_variant_get_data (items))[45],
+                   ==, 123045);
+  g_variant_get_stats (&stats);
+  g_assert_cmpint (stats.bytes_byteswapped, ==, 101 * sizeof (guint64));
+  g_variant_unref (items);
+  g_variant_unref (record);
+
+  /* everything is swapped for the data of the whole array */
+  g_variant_get_data (records);
+  g_variant_get_stats (&stats);
+  g_assert_cmpint (stats.bytes_byteswapped, ==, 101 * sizeof (guint64) + size);
+  g_assert_cmpint (deep_lookup (records, 999, 99), ==, 999099);
+  g_variant_unref (records);
+
+  /* without the lazy flag, everything is swapped immediately */
+  g_variant_reset_stats ();
+  records = g_variant_load (G_VARIANT_TYPE ("a(sat)"), data, size,
+                            FOREIGN_ENDIAN);
+  g_variant_get_stats (&stats);
+  g_assert_cmpint (stats.bytes_byteswapped, ==, size);
+  g_assert_cmpint (deep_lookup (records, 567, 89), ==, 567089);
+  g_variant_unref (records);
+
+  /* data that we may not modify is copied before it is swapped, and
+   * it is released when the last value using it is gone
+   */
+  g_variant_reset_stats ();
+  original = g_memdup (data, size);
+  notified = FALSE;
+  records = g_variant_from_data (G_VARIANT_TYPE ("a(sat)"), data, size,
+                                 FOREIGN_ENDIAN | G_VARIANT_LAZY_BYTESWAP,
+                                 notify_flag, &notified);
+  g_assert_cmpint (deep_lookup (records, 321, 7), ==, 321007);
+  record = g_variant_get_child (records, 321);
+  items = g_variant_get_child (record, 1);
+  g_variant_unref (record);
+  g_variant_unref (records);
+  g_assert (!notified);
+
+  g_assert_cmpint (((const guint64 *) g_variant_get_data (items))[99],
+                   ==, 321099);
+  g_variant_get_stats (&stats);
+  g_assert_cmpint (stats.bytes_byteswapped, ==, 101 * sizeof (guint64));
+  g_assert (notified);
+  g_variant_unref (items);
+
+  g_assert (memcmp (data, original, size) == 0);
+  g_free (original);
+  g_free (data);
+}
+
+static void
+time_byteswap (const gchar *type,
+               gsize        item_size,
+               gsize        size)
+{
+  GVariant *value;
+  GTimer *timer;
+  gdouble elapsed;
+  guchar *data;
+  gsize i;
+
+  data = g_malloc (size);
+  for (i = 0; i < size; i++)
+    data[i] = i * 7;
+
+  /* keep the padding of the items zero */
+  if (item_size == 16)
+    for (i = 0; i < size; i += 16)
+      memset (data + i + 9, 0, 7);
+
+  /* fetching the data forces the byteswap to happen.  trust the data
+   * so that only the copy and the swap are timed, not the validation.
+   */
+  timer = g_timer_new ();
+  value = g_variant_load (G_VARIANT_TYPE (type), data, size,
+                          FOREIGN_ENDIAN | G_VARIANT_TRUSTED);
+  g_variant_get_data (value);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  g_variant_unref (value);
+  g_free (data);
+
+  g_test_maximized_result (size / elapsed / 1000000,
+                           "'%s' (%d bytes): %.0f MB/s",
+                           type, (int) size, size / elapsed / 1000000);
+}
+
+static void
+test_byteswap_perf (void)
+{
+  const gsize size = 16 * 1024 * 1024;
+
+  time_byteswap ("at", 8, size);
+  time_byteswap ("au", 4, size);
+  time_byteswap ("aq", 2, size);
+  time_byteswap ("a(iiu)", 12, size - size % 12);
+  time_byteswap ("a(ty)", 16, size);
+}
+
 int
 main (int argc, char **argv)
 {
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/gvariant/endian/0", test_byteswap);
+  g_test_add_func ("/gvariant/endian/scalar", test_scalar);
+  g_test_add_func ("/gvariant/endian/arrays", test_arrays);
+  g_test_add_func ("/gvariant/endian/lazy", test_lazy);
+  g_test_add_func ("/gvariant/endian/not-normal", test_not_normal);
+
+  if (g_test_perf ())
+    g_test_add_func ("/gvariant/endian/byteswap", test_byteswap_perf);
+
   return g_test_run ();
 }
@@ -1,4 +1,6 @@
 #include <glib.h>
+#include <glib/gvariant-loadstore.h>
+#include <string.h>
 #include <glib/gvariant.h>
 
 #define TESTS                     1024
@@ -286,6 +288,51 @@ random_markup (GString *markup,
   g_string_free (signature, TRUE);
 }
 
+/* whatever the serialiser produces must be accepted as normal */
+static void
+check_normal (GVariant *variant)
+{
+  gconstpointer data;
+  GVariant *loaded;
+
+  loaded = g_variant_load (g_variant_get_type (variant),
+                           g_variant_get_data (variant),
+                           g_variant_get_size (variant), 0);
+  data = g_variant_get_data (loaded);
+
+  /* a renormalised copy would have its own data */
+  g_variant_normalise (loaded);
+  g_assert (g_variant_get_data (loaded) == data);
+  g_variant_unref (loaded);
+}
+
+static gboolean
+append_to_string (gconstpointer   data,
+                  gsize           size,
+                  gpointer        user_data,
+                  GError        **error)
+{
+  g_string_append_len (user_data, data, size);
+
+  return TRUE;
+}
+
+/* streaming (from the tree form) must produce the same data as
+ * serialising
+ */
+static void
+check_stream (GVariant *variant)
+{
+  GString *stream;
+
+  stream = g_string_new (NULL);
+  g_assert (g_variant_store_stream (variant, append_to_string, stream, NULL));
+  g_assert_cmpint (stream->len, ==, g_variant_get_size (variant));
+  g_assert (memcmp (stream->str, g_variant_get_data (variant),
+                    stream->len) == 0);
+  g_string_free (stream, TRUE);
+}
+
 static void
 test (void)
 {
@@ -304,6 +351,7 @@ test (void)
       random_markup (markup1, depth);
       /* g_message ("%s", markup1->str); */
       variant = g_variant_markup_parse (markup1->str, -1, NULL, &error);
+      check_stream (variant);
       g_variant_flatten (variant);
 
       if (variant == NULL)
@@ -314,6 +362,8 @@ test (void)
       else
         g_assert (error == NULL);
 
+      check_normal (variant);
+
       markup2 = g_variant_markup_print (variant, NULL, FALSE, 0, 0);
       g_assert_cmpstr (markup1->str, ==, markup2->str);
       g_string_free (markup1, TRUE);
@@ -1,5 +1,6 @@
 #include <glib/gvariant-loadstore.h>
 #include <glib.h>
+#include <string.h>
 #include <stdio.h>
 
 #define add_tests(func, basename, array) \
@@ -82,10 +83,314 @@ test (gconstpointer data)
   g_string_free (markup, TRUE);
 }
 
+static void
+test_normalise (void)
+{
+  const gchar *data;
+  GVariant *value;
+  guint8 *bools;
+  gsize i;
+
+  /* long enough that the bad byte is found by the vector code */
+  bools = g_malloc (1000);
+  for (i = 0; i < 1000; i++)
+    bools[i] = i & 1;
+
+  value = g_variant_load (G_VARIANT_TYPE ("ab"), bools, 1000, 0);
+  g_variant_normalise (value);
+  g_assert (memcmp (g_variant_get_data (value), bools, 1000) == 0);
+  g_variant_unref (value);
+
+  bools[777] = 2;
+  value = g_variant_load (G_VARIANT_TYPE ("ab"), bools, 1000, 0);
+  g_variant_normalise (value);
+  data = g_variant_get_data (value);
+  g_assert_cmpint (data[776], ==, 0);
+  g_assert_cmpint (data[777], ==, 1);
+  g_assert_cmpint (data[778], ==, 0);
+  g_variant_unref (value);
+  g_free (bools);
+
+  /* string with an embedded nul */
+  value = g_variant_load (G_VARIANT_TYPE ("s"), "hello\0world\0", 12, 0);
+  g_variant_normalise (value);
+  g_assert_cmpstr (g_variant_get_string (value, NULL), ==, "hello");
+  g_variant_unref (value);
+}
+
+static gboolean
+is_normal (const gchar   *type,
+           gconstpointer  data,
+           gsize          size)
+{
+  gconstpointer before;
+  GVariant *value;
+  gboolean normal;
+
+  value = g_variant_load (G_VARIANT_TYPE (type), data, size, 0);
+  before = g_variant_get_data (value);
+  g_variant_normalise (value);
+
+  /* only a value that was not normal gets a new copy of its data */
+  normal = g_variant_get_data (value) == before;
+  g_variant_unref (value);
+
+  return normal;
+}
+
+static void
+test_normal_struct (void)
+{
+  GVariant *value;
+  const gchar *data;
+
+  g_assert (is_normal ("(yu)", "\x01\0\0\0\x02\0\0\0", 8));
+  g_assert (is_normal ("(uy)", "\x02\0\0\0\x01\0\0\0", 8));
+  g_assert (is_normal ("(sy)", "a\0\x01\x02", 4));
+  g_assert (is_normal ("(ysu)", "\x01" "a\0\0\x02\0\0\0\x03", 9));
+  g_assert (is_normal ("{sv}", "a\0\0\0\0\0\0\0\x01\0y\x02", 12));
+  g_assert (is_normal ("()", "", 1));
+
+  /* non-zero padding */
+  g_assert (!is_normal ("(yu)", "\x01\xff\0\0\x02\0\0\0", 8));
+  g_assert (!is_normal ("(uy)", "\x02\0\0\0\x01\0\0\x01", 8));
+  g_assert (!is_normal ("{sv}", "a\0\0\0\0\x01\0\0\x01\0y\x02", 12));
+
+  /* wrong unit */
+  g_assert (!is_normal ("()", "\x01", 1));
+
+  /* offset pointing outside of the content */
+  g_assert (!is_normal ("(sy)", "a\0\x01\x05", 4));
+  g_assert (!is_normal ("(ss)", "a\0b\0\x00", 5));
+
+  /* members that are not normal */
+  g_assert (!is_normal ("(bs)", "\x02" "a\0", 3));
+  g_assert (!is_normal ("(sy)", "ab\x01\x02", 4));
+
+  /* variant containing a value of the wrong size or an invalid type */
+  g_assert (!is_normal ("v", "\x01\0u", 3));
+  g_assert (!is_normal ("v", "\x01\0z", 3));
+  g_assert (!is_normal ("v", "\x01\0", 2));
+
+  /* the renormalised copy has zero padding */
+  value = g_variant_load (G_VARIANT_TYPE ("(yu)"),
+                          "\x01\xff\0\0\x02\0\0\0", 8, 0);
+  g_variant_normalise (value);
+  data = g_variant_get_data (value);
+  g_assert_cmpint (data[0], ==, 1);
+  g_assert_cmpint (data[1], ==, 0);
+  g_assert_cmpint (data[4], ==, 2);
+  g_variant_unref (value);
+}
+
+static GString *
+nested_variants (gint depth)
+{
+  GString *data;
+  gint i;
+
+  /* a byte inside of @depth variants */
+  data = g_string_new ("\x2a");
+  g_string_append_len (data, "\0y", 2);
+  for (i = 1; i < depth; i++)
+    g_string_append_len (data, "\0v", 2);
+
+  return data;
+}
+
+static void
+test_normal_deep (void)
+{
+  GString *data;
+
+  /* far too deep for a recursive checker */
+  data = nested_variants (1000000);
+  g_assert (is_normal ("v", data->str, data->len));
+  g_string_free (data, TRUE);
+
+  /* break the innermost type string.  renormalising is still
+   * recursive, so keep this one shallow.
+   */
+  data = nested_variants (100);
+  g_assert (is_normal ("v", data->str, data->len));
+  data->str[2] = 'z';
+  g_assert (!is_normal ("v", data->str, data->len));
+  g_string_free (data, TRUE);
+}
+
+static GVariant *
+property_bag (gsize n_items)
+{
+  GVariantBuilder *builder;
+  GVariant *value, *loaded;
+  gsize i;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a{sv}"));
+  for (i = 0; i < n_items; i++)
+    if (i & 1)
+      g_variant_builder_add (builder, "{sv}", "key",
+                             g_variant_new ("(ii)", (gint) i, (gint) i));
+    else
+      g_variant_builder_add (builder, "{sv}", "key",
+                             g_variant_new_string ("value"));
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+
+  /* a fresh copy of the data, so its children are found from scratch */
+  loaded = g_variant_load (G_VARIANT_TYPE ("a{sv}"),
+                           g_variant_get_data (value),
+                           g_variant_get_size (value), 0);
+  g_variant_unref (value);
+
+  return loaded;
+}
+
+static void
+read_property_bag (GVariant *bag)
+{
+  gsize n, i;
+
+  n = g_variant_n_children (bag);
+  for (i = 0; i < n; i++)
+    {
+      GVariant *entry, *variant, *child;
+
+      entry = g_variant_get_child (bag, i);
+      variant = g_variant_get_child (entry, 1);
+      child = g_variant_get_variant (variant);
+      g_assert_cmpstr (g_variant_get_type_string (child), ==,
+                       i & 1 ? "(ii)" : "s");
+      g_variant_unref (child);
+      g_variant_unref (variant);
+      g_variant_unref (entry);
+    }
+}
+
+static void
+test_variant_type_cache (void)
+{
+  GVariantStats stats;
+  GVariant *bag;
+
+  bag = property_bag (1000);
+  g_variant_reset_stats ();
+  read_property_bag (bag);
+  g_variant_unref (bag);
+
+  /* each of the two types only needs to be looked up once */
+  g_variant_get_stats (&stats);
+  g_assert_cmpint (stats.type_cache_hits + stats.type_cache_misses, ==, 1000);
+  g_assert_cmpint (stats.type_cache_misses, <=, 2);
+}
+
+static void
+time_normalise (const gchar   *type,
+                gconstpointer  data,
+                gsize          size)
+{
+  GVariant *value;
+  GTimer *timer;
+  gdouble elapsed;
+
+  value = g_variant_load (G_VARIANT_TYPE (type), data, size, 0);
+
+  timer = g_timer_new ();
+  g_variant_normalise (value);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  g_variant_unref (value);
+
+  g_test_maximized_result (size / elapsed / 1000000,
+                           "'%s' (%d bytes): %.0f MB/s",
+                           type, (int) size, size / elapsed / 1000000);
+}
+
+static void
+test_validate_perf (void)
+{
+  const gsize size = 16 * 1024 * 1024;
+  GVariantBuilder *builder;
+  GVariant *strings;
+  guint8 *blob;
+  gsize i;
+
+  blob = g_malloc (size);
+
+  for (i = 0; i < size; i++)
+    blob[i] = (i * 7 >> 3) & 1;
+  time_normalise ("ab", blob, size);
+
+  for (i = 0; i < size - 1; i++)
+    blob[i] = 'a' + i % 26;
+  blob[size - 1] = '\0';
+  time_normalise ("s", blob, size);
+
+  g_free (blob);
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("as"));
+  for (i = 0; i < 256 * 1024; i++)
+    g_variant_builder_add (builder, "s", "a string in an array");
+  strings = g_variant_ref_sink (g_variant_builder_end (builder));
+
+  blob = g_memdup (g_variant_get_data (strings), g_variant_get_size (strings));
+  time_normalise ("as", blob, g_variant_get_size (strings));
+  g_variant_unref (strings);
+  g_free (blob);
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a{sv}"));
+  for (i = 0; i < 128 * 1024; i++)
+    g_variant_builder_add (builder, "{sv}", "a key",
+                           g_variant_new_uint32 (i));
+  strings = g_variant_ref_sink (g_variant_builder_end (builder));
+
+  blob = g_memdup (g_variant_get_data (strings), g_variant_get_size (strings));
+  time_normalise ("a{sv}", blob, g_variant_get_size (strings));
+  g_variant_unref (strings);
+  g_free (blob);
+}
+
+static void
+test_variant_type_cache_perf (void)
+{
+  GVariant *bag;
+  GTimer *timer;
+  gdouble elapsed;
+  gint i;
+
+  bag = property_bag (1000);
+
+  timer = g_timer_new ();
+  for (i = 0; i < 1000; i++)
+    read_property_bag (bag);
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  g_variant_unref (bag);
+
+  g_test_maximized_result (1000000 / elapsed,
+                           "a{sv} values: %.0f/s", 1000000 / elapsed);
+}
+
 int
 main (int argc, char **argv)
 {
   g_test_init (&argc, &argv, NULL);
   add_tests (test, "/gvariant/serialiser", test_cases);
+  g_test_add_func ("/gvariant/serialiser/normalise", test_normalise);
+  g_test_add_func ("/gvariant/serialiser/normal-struct", test_normal_struct);
+  g_test_add_func ("/gvariant/serialiser/normal-deep", test_normal_deep);
+  g_test_add_func ("/gvariant/serialiser/variant-type-cache",
+                   test_variant_type_cache);
+
+  if (g_test_perf ())
+    {
+      g_test_add_func ("/gvariant/serialiser/validate", test_validate_perf);
+      g_test_add_func ("/gvariant/serialiser/variant-type-cache-perf",
+                       test_variant_type_cache_perf);
+    }
+
   return g_test_run ();
 }
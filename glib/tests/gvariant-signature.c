@@ -300,11 +300,117 @@ test (void)
     }
 }
 
+static gboolean
+nested_is_valid (const gchar *open,
+                 const gchar *close,
+                 gint         depth)
+{
+  GString *type;
+  gboolean valid;
+  gint i;
+
+  type = g_string_new (NULL);
+  for (i = 0; i < depth; i++)
+    g_string_append (type, open);
+  g_string_append_c (type, 'y');
+  for (i = 0; i < depth; i++)
+    g_string_append (type, close);
+
+  valid = g_variant_type_string_is_valid (type->str);
+  g_string_free (type, TRUE);
+
+  return valid;
+}
+
+static void
+test_scan (void)
+{
+  const gchar *valid[] = {
+    "b", "()", "v", "as", "a{sv}", "(a{s(ii)}mv)", "{?*}", "aaaay",
+    "((((y))))", "m(ma{ym(ss)})", "(r*?)"
+  };
+  const gchar *invalid[] = {
+    "", "a", "m", "(", ")", "(a)", "(m)", "{sv", "{vs}", "{s}", "{sss}",
+    "(}", "{s)", "{}", "ae", "(y))", "yy", "a{sv}}", "{s(}"
+  };
+  const gchar *type, *end;
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS (valid); i++)
+    g_assert (g_variant_type_string_is_valid (valid[i]));
+
+  for (i = 0; i < G_N_ELEMENTS (invalid); i++)
+    g_assert (!g_variant_type_string_is_valid (invalid[i]));
+
+  /* nothing at or after the limit is looked at */
+  type = "(ii)i";
+  for (i = 0; i < 4; i++)
+    {
+      end = type;
+      g_assert (!g_variant_type_string_scan (&end, type + i));
+    }
+  end = type;
+  g_assert (g_variant_type_string_scan (&end, type + 4));
+  g_assert (end == type + 4);
+
+  g_assert (nested_is_valid ("(", ")", G_VARIANT_TYPE_MAX_NESTING));
+  g_assert (!nested_is_valid ("(", ")", G_VARIANT_TYPE_MAX_NESTING + 1));
+  g_assert (nested_is_valid ("{s", "}", G_VARIANT_TYPE_MAX_NESTING));
+  g_assert (!nested_is_valid ("{s", "}", G_VARIANT_TYPE_MAX_NESTING + 1));
+  g_assert (nested_is_valid ("a(", ")", G_VARIANT_TYPE_MAX_NESTING));
+  g_assert (nested_is_valid ("am", "", 1000));
+
+  /* long enough that runs of basic types are found by the vector code */
+  g_assert (g_variant_is_signature ("ssssssssssssssssssssssssssssssssssssuv"));
+  g_assert (g_variant_is_signature ("yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyya{sv}"));
+  g_assert (!g_variant_is_signature ("iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiir"));
+  g_assert (!g_variant_is_signature ("iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiia"));
+  g_assert (!g_variant_is_signature ("iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii)"));
+}
+
+static void
+test_scan_perf (void)
+{
+  /* taken from real D-Bus interfaces */
+  const gchar *signatures[] = {
+    "s", "u", "b", "o", "as", "a{sv}", "sa{sv}as", "a{oa{sa{sv}}}",
+    "(ssssbssssbb)", "a(ssssssouso)", "uusa{sv}", "susssasa{sv}i",
+    "a(sssbuusub)", "(a{sv}a{sv})", "a(oa{sv})", "ss", "sv", "ay",
+    "a(uuusa{sv})", "(bbbbbbbbb)"
+  };
+  const gint iterations = 100000;
+  gsize bytes = 0;
+  GTimer *timer;
+  gdouble elapsed;
+  gint i, j;
+
+  for (j = 0; j < G_N_ELEMENTS (signatures); j++)
+    bytes += strlen (signatures[j]);
+
+  timer = g_timer_new ();
+  for (i = 0; i < iterations; i++)
+    for (j = 0; j < G_N_ELEMENTS (signatures); j++)
+      if (!g_variant_is_signature (signatures[j]))
+        g_assert_not_reached ();
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  g_test_maximized_result (iterations * G_N_ELEMENTS (signatures) / elapsed,
+                           "%.0f signatures/s (%.0f MB/s)",
+                           iterations * G_N_ELEMENTS (signatures) / elapsed,
+                           iterations * bytes / elapsed / 1000000);
+}
+
 int
 main (int    argc,
       char **argv)
 {
   g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/gvariant/signature/scan", test_scan);
   g_test_add_func ("/gvariant/signature/0", test);
+
+  if (g_test_perf ())
+    g_test_add_func ("/gvariant/signature/scan-perf", test_scan_perf);
+
   return g_test_run ();
 }
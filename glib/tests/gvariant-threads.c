@@ -0,0 +1,461 @@
+#include <glib/gvariant-loadstore.h>
+#include <glib/gvariant.h>
+#include <glib/gtestutils.h>
+#include <glib/gthread.h>
+#include <glib/gasyncqueue.h>
+#include <glib/gtimer.h>
+#include <glib/gstrfuncs.h>
+
+#define N_ITEMS 4096
+
+typedef struct
+{
+  GVariant *value;
+  gsize     iterations;
+  gsize     start;
+} Reader;
+
+static GVariant *
+build (void)
+{
+  GVariantBuilder *builder;
+  gsize i;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("a(su)"));
+
+  for (i = 0; i < N_ITEMS; i++)
+    {
+      gchar *string;
+
+      string = g_strdup_printf ("item %d", (int) i);
+      g_variant_builder_add (builder, "(su)", string, (guint32) i);
+      g_free (string);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (builder));
+}
+
+static void
+check_item (GVariant *item,
+            gsize     index)
+{
+  GVariant *string, *number;
+  gchar expected[32];
+
+  g_assert_cmpint (g_variant_n_children (item), ==, 2);
+
+  string = g_variant_get_child (item, 0);
+  number = g_variant_get_child (item, 1);
+
+  g_snprintf (expected, sizeof expected, "item %d", (int) index);
+  g_assert_cmpstr (g_variant_get_string (string, NULL), ==, expected);
+  g_assert_cmpint (g_variant_get_uint32 (number), ==, index);
+  g_assert (g_variant_get_data (string) != NULL);
+
+  g_variant_unref (string);
+  g_variant_unref (number);
+}
+
+static gpointer
+reader (gpointer data)
+{
+  Reader *r = data;
+  gsize i;
+
+  for (i = 0; i < r->iterations; i++)
+    {
+      gsize index = (r->start + i * 7) % N_ITEMS;
+      GVariant *item;
+
+      g_assert_cmpint (g_variant_n_children (r->value), ==, N_ITEMS);
+      item = g_variant_get_child (r->value, index);
+      check_item (item, index);
+      g_variant_unref (item);
+    }
+
+  return NULL;
+}
+
+static gdouble
+run_readers (GVariant *value,
+             gint      n_threads,
+             gsize     iterations)
+{
+  GThread *threads[64];
+  Reader readers[64];
+  GTimer *timer;
+  gdouble elapsed;
+  gint i;
+
+  g_assert_cmpint (n_threads, <=, G_N_ELEMENTS (threads));
+
+  timer = g_timer_new ();
+
+  for (i = 0; i < n_threads; i++)
+    {
+      readers[i].value = value;
+      readers[i].iterations = iterations;
+      readers[i].start = i * (N_ITEMS / n_threads);
+      threads[i] = g_thread_create (reader, &readers[i], TRUE, NULL);
+    }
+
+  for (i = 0; i < n_threads; i++)
+    g_thread_join (threads[i]);
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  return elapsed;
+}
+
+static void
+test_serialised (void)
+{
+  GVariant *value;
+
+  value = build ();
+  g_variant_flatten (value);
+  run_readers (value, 4, 20000);
+  g_variant_unref (value);
+}
+
+static void
+test_flatten (void)
+{
+  gint i;
+
+  /* readers race against the tree being replaced by its serialised
+   * form.  they must see either one or the other, consistently.
+   */
+  for (i = 0; i < 10; i++)
+    {
+      GThread *threads[4];
+      Reader readers[4];
+      GVariant *value;
+      gint j;
+
+      value = build ();
+
+      for (j = 0; j < G_N_ELEMENTS (threads); j++)
+        {
+          readers[j].value = value;
+          readers[j].iterations = 2000;
+          readers[j].start = j * 1000;
+          threads[j] = g_thread_create (reader, &readers[j], TRUE, NULL);
+        }
+
+      g_variant_flatten (value);
+
+      for (j = 0; j < G_N_ELEMENTS (threads); j++)
+        g_thread_join (threads[j]);
+
+      g_variant_unref (value);
+    }
+}
+
+static void
+test_contention (void)
+{
+  const gsize iterations = 200000;
+  GVariant *value;
+  gint n_threads;
+
+  value = build ();
+  g_variant_flatten (value);
+
+  for (n_threads = 1; n_threads <= 32; n_threads *= 2)
+    {
+      gdouble elapsed;
+
+      elapsed = run_readers (value, n_threads, iterations);
+      g_test_maximized_result (n_threads * iterations / elapsed,
+                               "%d threads: %.0f lookups/s",
+                               n_threads, n_threads * iterations / elapsed);
+    }
+
+  g_variant_unref (value);
+}
+
+static gpointer
+variant_reader (gpointer data)
+{
+  Reader *r = data;
+  gsize i;
+
+  for (i = 0; i < r->iterations; i++)
+    {
+      GVariant *item, *child;
+
+      /* each child of a variant looks up the type info of its type */
+      item = g_variant_get_child (r->value, (r->start + i) % N_ITEMS);
+      child = g_variant_get_variant (item);
+      g_variant_unref (child);
+      g_variant_unref (item);
+    }
+
+  return NULL;
+}
+
+static void
+test_type_info_contention (void)
+{
+  const gsize iterations = 100000;
+  GVariantBuilder *builder;
+  GVariant *value, *kept[5];
+  gint n_threads;
+  gsize i;
+
+  builder = g_variant_builder_new (G_VARIANT_TYPE_CLASS_ARRAY,
+                                   G_VARIANT_TYPE ("av"));
+  for (i = 0; i < N_ITEMS; i++)
+    {
+      GVariant *child;
+
+      switch (i % 5)
+        {
+        case 0:
+          child = g_variant_new_uint32 (i);
+          break;
+
+        case 1:
+          child = g_variant_new_string ("a string");
+          break;
+
+        case 2:
+          child = g_variant_new ("(su)", "a string", (guint32) i);
+          break;
+
+        case 3:
+          child = g_variant_new ("mi", TRUE, (gint) i);
+          break;
+
+        default:
+          child = g_variant_new ("(yy)", 1, 2);
+          break;
+        }
+
+      /* keep one value of each type alive, so that the type infos
+       * stay in the table and only the lookups are measured.
+       */
+      child = g_variant_ref_sink (child);
+      if (i < G_N_ELEMENTS (kept))
+        kept[i] = g_variant_ref (child);
+
+      g_variant_builder_add_value (builder, g_variant_new_variant (child));
+    }
+  value = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_variant_flatten (value);
+
+  for (n_threads = 1; n_threads <= 32; n_threads *= 2)
+    {
+      GThread *threads[32];
+      Reader readers[32];
+      GTimer *timer;
+      gdouble elapsed;
+      gint j;
+
+      timer = g_timer_new ();
+      for (j = 0; j < n_threads; j++)
+        {
+          readers[j].value = value;
+          readers[j].iterations = iterations;
+          readers[j].start = j * 1000;
+          threads[j] = g_thread_create (variant_reader, &readers[j],
+                                        TRUE, NULL);
+        }
+
+      for (j = 0; j < n_threads; j++)
+        g_thread_join (threads[j]);
+
+      elapsed = g_timer_elapsed (timer, NULL);
+      g_timer_destroy (timer);
+
+      g_test_maximized_result (n_threads * iterations / elapsed,
+                               "%d threads: %.0f variant children/s",
+                               n_threads, n_threads * iterations / elapsed);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (kept); i++)
+    g_variant_unref (kept[i]);
+  g_variant_unref (value);
+}
+
+static gpointer
+scalar_maker (gpointer data)
+{
+  guint iterations = GPOINTER_TO_UINT (data);
+  guint i;
+
+  for (i = 0; i < iterations; i++)
+    {
+      g_variant_unref (g_variant_ref_sink (g_variant_new_int32 (i)));
+      g_variant_unref (g_variant_ref_sink (g_variant_new_double (i)));
+      g_variant_unref (g_variant_ref_sink (g_variant_new_string ("str")));
+    }
+
+  return NULL;
+}
+
+static void
+test_scalar_contention (void)
+{
+  const guint iterations = 200000;
+  gint n_threads;
+
+  for (n_threads = 1; n_threads <= 32; n_threads *= 2)
+    {
+      GThread *threads[32];
+      GTimer *timer;
+      gdouble elapsed;
+      gint j;
+
+      timer = g_timer_new ();
+      for (j = 0; j < n_threads; j++)
+        threads[j] = g_thread_create (scalar_maker,
+                                      GUINT_TO_POINTER (iterations),
+                                      TRUE, NULL);
+
+      for (j = 0; j < n_threads; j++)
+        g_thread_join (threads[j]);
+
+      elapsed = g_timer_elapsed (timer, NULL);
+      g_timer_destroy (timer);
+
+      g_test_maximized_result (3 * n_threads * iterations / elapsed,
+                               "%d threads: %.0f scalars/s", n_threads,
+                               3 * n_threads * iterations / elapsed);
+    }
+}
+
+static gpointer
+producer (gpointer data)
+{
+  GAsyncQueue *queue = data;
+  gsize i;
+
+  for (i = 0; i < N_ITEMS * 64; i++)
+    {
+      GVariant *value;
+
+      value = g_variant_new ("(us)", (guint32) i, "a string");
+      g_async_queue_push (queue, g_variant_ref_sink (value));
+    }
+
+  return NULL;
+}
+
+static gpointer
+consumer (gpointer data)
+{
+  GAsyncQueue *queue = data;
+  gsize i;
+
+  for (i = 0; i < N_ITEMS * 64; i++)
+    {
+      GVariant *value, *child;
+
+      value = g_async_queue_pop (queue);
+      child = g_variant_get_child (value, 0);
+      g_assert_cmpint (g_variant_get_uint32 (child), ==, i);
+      g_variant_unref (child);
+      g_variant_unref (value);
+    }
+
+  return NULL;
+}
+
+static gdouble
+run_pairs (gint           n_pairs,
+           GVariantStats *stats)
+{
+  GAsyncQueue *queues[16];
+  GThread *threads[32];
+  GTimer *timer;
+  gdouble elapsed;
+  gint i;
+
+  g_assert_cmpint (n_pairs, <=, G_N_ELEMENTS (queues));
+
+  g_variant_reset_stats ();
+  timer = g_timer_new ();
+
+  for (i = 0; i < n_pairs; i++)
+    {
+      queues[i] = g_async_queue_new ();
+      threads[2 * i] = g_thread_create (producer, queues[i], TRUE, NULL);
+      threads[2 * i + 1] = g_thread_create (consumer, queues[i], TRUE, NULL);
+    }
+
+  for (i = 0; i < 2 * n_pairs; i++)
+    g_thread_join (threads[i]);
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  for (i = 0; i < n_pairs; i++)
+    g_async_queue_unref (queues[i]);
+
+  g_variant_get_stats (stats);
+
+  return elapsed;
+}
+
+static void
+test_producer_consumer (void)
+{
+  GVariantStats stats;
+
+  /* every value is freed by a thread other than the one that made it,
+   * so the memory can only be reused by way of the depot.
+   */
+  run_pairs (1, &stats);
+  g_assert_cmpint (stats.magazine_exchanges, >, 0);
+  g_assert_cmpint (stats.magazine_hits, >, stats.magazine_misses);
+}
+
+static void
+test_producer_consumer_perf (void)
+{
+  gint n_pairs;
+
+  for (n_pairs = 1; n_pairs <= 8; n_pairs *= 2)
+    {
+      GVariantStats stats;
+      gdouble elapsed;
+      gsize n_values;
+
+      elapsed = run_pairs (n_pairs, &stats);
+      n_values = n_pairs * N_ITEMS * 64;
+      g_test_maximized_result (n_values / elapsed,
+                               "%d producer/consumer pairs: %.0f values/s "
+                               "(%u hits, %u misses, %u exchanges)",
+                               n_pairs, n_values / elapsed,
+                               stats.magazine_hits, stats.magazine_misses,
+                               stats.magazine_exchanges);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  g_thread_init (NULL);
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/gvariant/threads/serialised", test_serialised);
+  g_test_add_func ("/gvariant/threads/flatten", test_flatten);
+  g_test_add_func ("/gvariant/threads/producer-consumer",
+                   test_producer_consumer);
+
+  if (g_test_perf ())
+    {
+      g_test_add_func ("/gvariant/threads/contention", test_contention);
+      g_test_add_func ("/gvariant/threads/producer-consumer-perf",
+                       test_producer_consumer_perf);
+      g_test_add_func ("/gvariant/threads/type-info-contention",
+                       test_type_info_contention);
+      g_test_add_func ("/gvariant/threads/scalar-contention",
+                       test_scalar_contention);
+    }
+
+  return g_test_run ();
+}